@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Filters and aggregates of ColumnBatch against the same work done row
+// by row through the Cursor getters, over a synthetic in-memory cursor:
+//
+//   SELECT COUNT(qty), SUM(qty), MIN(qty), MAX(qty) WHERE price > 50.0
+//
+// Built next to the library sources, once for each kernel:
+//
+//   g++ -std=c++11 -O2 -DNDEBUG -mavx2   -I. -Iincludes -include pch.h bench/batch.cpp src/dbbatch.cpp -o batch-avx2
+//   g++ -std=c++11 -O2 -DNDEBUG -msse4.2 -I. -Iincludes -include pch.h bench/batch.cpp src/dbbatch.cpp -o batch-sse
+//   g++ -std=c++11 -O2 -DNDEBUG          -I. -Iincludes -include pch.h bench/batch.cpp src/dbbatch.cpp -o batch-scalar
+//
+//   batch [rows=10000000] [rounds=5]
+//
+// The best of the rounds is reported, in milliseconds. "batch" is the
+// whole path, filling the batches off the cursor; "kernels" are the
+// filter and aggregate alone, over batches filled beforehand.
+
+#include "pch.h"
+#include <db/batch.hpp>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace
+{
+	// every 16th price is NULL; prices are 0..100, quantities -500..499
+	struct Data
+	{
+		std::vector<double> prices;
+		std::vector<long long> qtys;
+		std::vector<unsigned char> nulls;
+		explicit Data(size_t rows)
+			: prices(rows)
+			, qtys(rows)
+			, nulls(rows)
+		{
+			unsigned long long seed = 0x2545F4914F6CDD1DULL;
+			for (size_t row = 0; row < rows; ++row)
+			{
+				seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+				prices[row] = (double)((seed >> 33) % 10001) / 100.0;
+				qtys[row] = (long long)((seed >> 17) % 1000) - 500;
+				nulls[row] = (seed >> 60) == 0;
+			}
+		}
+	};
+
+	class DataCursor: public db::Cursor
+	{
+		const Data& m_data;
+		size_t m_row;
+	public:
+		explicit DataCursor(const Data& data): m_data(data), m_row((size_t)-1) {}
+		bool next() override { return ++m_row < m_data.prices.size(); }
+		size_t columnCount() override { return 2; }
+		int getInt(int column) override { return (int)getLongLong(column); }
+		long getLong(int column) override { return (long)getLongLong(column); }
+		long long getLongLong(int column) override { return column == 1 ? m_data.qtys[m_row] : 0; }
+		double getDouble(int column) override { return column == 0 ? m_data.prices[m_row] : 0; }
+		float getFloat(int column) override { return (float)getDouble(column); }
+		db::Decimal getDecimal(int) override { return db::Decimal(); }
+		tyme::time_t getTimestamp(int) override { return 0; }
+		const char* getText(int) override { return nullptr; }
+		size_t getBlobSize(int) override { return 0; }
+		const void* getBlob(int) override { return nullptr; }
+		bool isNull(int column) override { return column == 0 && m_data.nulls[m_row]; }
+		db::ConnectionPtr getConnection() const override { return nullptr; }
+		db::StatementPtr getStatement() const override { return nullptr; }
+	};
+
+	typedef std::chrono::steady_clock Clock;
+
+	double since(Clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+	}
+
+	db::IntAggregate rowByRow(const Data& data)
+	{
+		db::IntAggregate out;
+		db::CursorPtr c = std::make_shared<DataCursor>(data);
+		while (c->next())
+		{
+			if (!c->isNull(0) && c->getDouble(0) > 50.0)
+				out.add(c->getLongLong(1));
+		}
+		return out;
+	}
+
+	db::IntAggregate batched(const Data& data)
+	{
+		db::IntAggregate out;
+		db::CursorPtr c = std::make_shared<DataCursor>(data);
+		db::ColumnBatch batch;
+		size_t price = batch.define(0, db::BatchColumn::REAL);
+		size_t qty = batch.define(1, db::BatchColumn::INTEGER);
+		while (batch.fill(c))
+		{
+			db::Selection selection = db::selectAll(batch);
+			db::filter(batch, price, db::GT, 50.0, selection);
+			db::aggregate(batch, qty, selection, out);
+		}
+		return out;
+	}
+
+	db::IntAggregate kernels(const std::vector<db::ColumnBatch>& batches)
+	{
+		db::IntAggregate out;
+		db::Selection selection;
+		for (auto&& batch : batches)
+		{
+			selection.assign(batch.rows(), 0xFF);
+			db::filter(batch, 0, db::GT, 50.0, selection);
+			db::aggregate(batch, 1, selection, out);
+		}
+		return out;
+	}
+
+	bool same(const db::IntAggregate& left, const db::IntAggregate& right)
+	{
+		return left.count == right.count && left.sum == right.sum && left.min == right.min && left.max == right.max;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	size_t rows = argc > 1 ? (size_t)strtoull(argv[1], nullptr, 10) : 10000000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 5;
+	if (!rows || rounds < 1)
+	{
+		fprintf(stderr, "usage: %s [rows] [rounds]\n", argv[0]);
+		return 1;
+	}
+
+#if defined(DB_NO_SIMD)
+	const char* kernel = "scalar (DB_NO_SIMD)";
+#elif defined(__AVX2__)
+	const char* kernel = "AVX2";
+#elif defined(__SSE4_2__)
+	const char* kernel = "SSE4.2";
+#else
+	const char* kernel = "scalar";
+#endif
+
+	Data data(rows);
+	std::vector<db::ColumnBatch> batches;
+	{
+		db::CursorPtr c = std::make_shared<DataCursor>(data);
+		db::ColumnBatch batch;
+		batch.define(0, db::BatchColumn::REAL);
+		batch.define(1, db::BatchColumn::INTEGER);
+		while (batch.fill(c))
+			batches.push_back(batch);
+	}
+
+	double best[3] = { 1e300, 1e300, 1e300 };
+	db::IntAggregate results[3];
+	for (int round = 0; round < rounds; ++round)
+	{
+		Clock::time_point start = Clock::now();
+		results[0] = rowByRow(data);
+		best[0] = std::min(best[0], since(start));
+
+		start = Clock::now();
+		results[1] = batched(data);
+		best[1] = std::min(best[1], since(start));
+
+		start = Clock::now();
+		results[2] = kernels(batches);
+		best[2] = std::min(best[2], since(start));
+	}
+
+	printf("%zu rows, %d rounds, %s kernels\n", rows, rounds, kernel);
+	printf("  row by row %10.2f ms\n", best[0]);
+	printf("  batch      %10.2f ms\n", best[1]);
+	printf("  kernels    %10.2f ms\n", best[2]);
+	printf("  count %llu sum %lld min %lld max %lld\n", results[0].count, results[0].sum, results[0].min, results[0].max);
+
+	if (!same(results[0], results[1]) || !same(results[0], results[2]))
+	{
+		fprintf(stderr, "the results differ\n");
+		return 1;
+	}
+	return 0;
+}
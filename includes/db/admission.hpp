@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DBCONN_ADMISSION_H__
+#define __DBCONN_ADMISSION_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+namespace db
+{
+	struct AdmissionConfig
+	{
+		size_t minLimit;
+		size_t maxLimit;
+		size_t initialLimit;
+		size_t queueSize;        // per priority class
+		long long maxWait;       // ms
+		double tolerance;        // latency over the best one, which still counts as healthy
+		double backoff;          // limit multiplier on congestion
+		size_t breakerWindow;    // last outcomes looked at by the breaker
+		size_t breakerSamples;   // outcomes needed before the breaker may trip
+		double breakerRate;      // failure ratio tripping the breaker
+		long long breakerCooldown; // ms
+
+		AdmissionConfig()
+			: minLimit(1)
+			, maxLimit(64)
+			, initialLimit(8)
+			, queueSize(64)
+			, maxWait(1000)
+			, tolerance(2.0)
+			, backoff(0.9)
+			, breakerWindow(100)
+			, breakerSamples(20)
+			, breakerRate(0.5)
+			, breakerCooldown(5000)
+		{
+		}
+	};
+
+	struct AdmissionStats
+	{
+		double limit;
+		size_t inflight;
+		size_t queued;
+		unsigned long long admitted;
+		unsigned long long rejected;
+		bool open;
+	};
+
+	class AdmissionController;
+	typedef std::shared_ptr<AdmissionController> AdmissionControllerPtr;
+
+	// Limits the number of concurrent calls to the database. The limit grows
+	// by one per round of calls as long as their latency stays close to the
+	// best seen, and shrinks multiplicatively when it does not. Calls over
+	// the limit wait in bounded per-priority queues; a full queue, or a wait
+	// longer than maxWait, fails with error::OVERLOADED. The breaker fails
+	// all calls with error::CIRCUIT_OPEN for breakerCooldown after the
+	// failure rate spikes, then lets a single probe through.
+	class AdmissionController
+	{
+	public:
+		enum Priority
+		{
+			HIGH,
+			NORMAL,
+			LOW,
+			PRIORITY_COUNT
+		};
+
+		// sets the priority of the calls made by this thread
+		class Scope
+		{
+			Priority m_previous;
+		public:
+			explicit Scope(Priority priority);
+			~Scope();
+		};
+		static Priority current();
+
+		class Ticket
+		{
+			AdmissionControllerPtr m_owner;
+			long long m_start;
+			long m_error;
+			bool m_probe;
+			bool m_done;
+			Ticket(const Ticket&);
+			Ticket& operator=(const Ticket&);
+		public:
+			// a null controller admits everything
+			explicit Ticket(const AdmissionControllerPtr& owner, Priority priority = current());
+			// without done(), the call never reached the database and
+			// counts neither for the limit nor for the breaker
+			~Ticket();
+			bool admitted() const { return m_error == 0; }
+			long error() const { return m_error; }
+			const char* message() const;
+			// failed: the database is in trouble, not the call itself
+			void done(bool failed);
+		};
+
+		explicit AdmissionController(const AdmissionConfig& config);
+
+		// controllers shared by all the connections using the same name
+		static AdmissionControllerPtr named(const std::string& name, const AdmissionConfig& config);
+
+		AdmissionStats stats();
+	private:
+		enum BreakerState
+		{
+			CLOSED,
+			OPEN,
+			HALF_OPEN
+		};
+
+		struct Waiter
+		{
+			bool granted;
+		};
+
+		AdmissionConfig m_config;
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::deque<Waiter*> m_queues[PRIORITY_COUNT];
+		double m_limit;
+		size_t m_inflight;
+		double m_bestLatency;
+		double m_latency;
+		long long m_lastDecrease;
+		unsigned long long m_admitted;
+		unsigned long long m_rejected;
+
+		BreakerState m_breaker;
+		long long m_openedAt;
+		bool m_probing;
+		std::vector<char> m_outcomes;
+		size_t m_nextOutcome;
+		size_t m_samples;
+		size_t m_failures;
+
+		static long long now();
+		long acquire(Priority priority, bool& probe);
+		void release(long long latency, bool failed, bool probe);
+		void abandon(bool probe);
+		bool waiting(Priority priority) const;
+		void grant();
+		void adapt(long long latency, bool failed, long long at);
+		void record(bool failed, long long at);
+	};
+}
+
+#endif //__DBCONN_ADMISSION_H__
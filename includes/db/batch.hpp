@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DBCONN_BATCH_H__
+#define __DBCONN_BATCH_H__
+
+#include <db/conn.hpp>
+#include <limits>
+
+namespace db
+{
+	struct BatchColumn
+	{
+		enum Type
+		{
+			INTEGER,
+			REAL,
+			TIMESTAMP
+		};
+
+		int column; // in the cursor
+		Type type;
+		std::vector<long long> ints;      // INTEGER and TIMESTAMP
+		std::vector<double> reals;        // REAL
+		std::vector<unsigned char> nulls; // 0xFF for a NULL, 0 otherwise
+	};
+
+	// A selection is a mask over the rows of a batch: 0xFF for the rows
+	// selected, 0 for the rest. The filters only ever narrow it down.
+	typedef std::vector<unsigned char> Selection;
+
+	// Rows of a cursor kept column by column, in contiguous arrays; the
+	// filters and aggregates below go through them several values at
+	// a time, with AVX2 or SSE4.2. The library has to be built for them:
+	// -mavx2 or -msse4.2 with gcc and clang, /arch:AVX2 with MSVC. Without
+	// them, or with DB_NO_SIMD, the kernels are branch-free scalar loops.
+	// fill() copies the bound buffers of the mysql cursors directly; over
+	// the other cursors, it costs about as much as reading the rows one
+	// by one, so the batch pays off with several filters or aggregates;
+	// bench/batch.cpp compares both against a row-by-row loop.
+	class ColumnBatch
+	{
+		std::vector<BatchColumn> m_columns;
+		size_t m_rows;
+	public:
+		ColumnBatch(): m_rows(0) {}
+
+		// index of the new column in the batch
+		size_t define(int column, BatchColumn::Type type);
+
+		// replaces the rows with up to maxRows read off the cursor; the
+		// number of rows read, 0 at the end
+		size_t fill(const CursorPtr& c, size_t maxRows = 4096);
+
+		size_t rows() const { return m_rows; }
+		size_t columns() const { return m_columns.size(); }
+		const BatchColumn& column(size_t index) const { return m_columns[index]; }
+
+		// the columns given, in that order, of the rows selected
+		bool project(const Selection& selection, const std::vector<size_t>& columns, ColumnBatch& out) const;
+	};
+
+	inline Selection selectAll(const ColumnBatch& batch) { return Selection(batch.rows(), 0xFF); }
+	size_t countSelected(const Selection& selection);
+
+	enum Compare
+	{
+		LT,
+		LE,
+		EQ,
+		NE,
+		GE,
+		GT
+	};
+
+	// keeps the rows, which are not NULL and compare to the operand;
+	// INTEGER and TIMESTAMP columns take the first one, REAL the second
+	bool filter(const ColumnBatch& batch, size_t column, Compare op, long long operand, Selection& selection);
+	bool filter(const ColumnBatch& batch, size_t column, Compare op, double operand, Selection& selection);
+
+	// min and max are only meaningful with count > 0
+	template <typename Value>
+	struct Aggregate
+	{
+		unsigned long long count;
+		Value sum;
+		Value min;
+		Value max;
+		Aggregate()
+			: count(0)
+			, sum(0)
+			, min(std::numeric_limits<Value>::max())
+			, max(std::numeric_limits<Value>::lowest())
+		{
+		}
+		void add(Value value)
+		{
+			++count;
+			sum += value;
+			if (value < min) min = value;
+			if (value > max) max = value;
+		}
+		void merge(const Aggregate& other)
+		{
+			count += other.count;
+			sum += other.sum;
+			if (other.min < min) min = other.min;
+			if (other.max > max) max = other.max;
+		}
+		double mean() const { return count ? (double)sum / count : 0.0; }
+	};
+	typedef Aggregate<long long> IntAggregate;
+	typedef Aggregate<double> RealAggregate;
+
+	// add the selected, not NULL values of a column; called once for
+	// each batch of a cursor
+	bool aggregate(const ColumnBatch& batch, size_t column, const Selection& selection, IntAggregate& out);
+	bool aggregate(const ColumnBatch& batch, size_t column, const Selection& selection, RealAggregate& out);
+
+	// Hash GROUP BY an INTEGER or TIMESTAMP key, aggregating another
+	// column; IntAggregate for INTEGER and TIMESTAMP values, RealAggregate
+	// for REAL ones. The rows with a NULL key go to nullGroup().
+	template <typename Value>
+	class GroupBy
+	{
+		std::vector<unsigned> m_slots; // group + 1, 0 for an empty slot
+		std::vector< Aggregate<Value> > m_groups;
+		std::vector<long long> m_groupKeys;
+		Aggregate<Value> m_nullGroup;
+		bool m_hasNulls;
+
+		Aggregate<Value>& group(long long key);
+		void grow();
+	public:
+		GroupBy(): m_hasNulls(false) {}
+		bool add(const ColumnBatch& batch, size_t key, size_t value, const Selection& selection);
+		size_t size() const { return m_groups.size(); }
+		long long key(size_t index) const { return m_groupKeys[index]; }
+		const Aggregate<Value>& at(size_t index) const { return m_groups[index]; }
+		bool hasNullGroup() const { return m_hasNulls; }
+		const Aggregate<Value>& nullGroup() const { return m_nullGroup; }
+	};
+}
+
+#endif //__DBCONN_BATCH_H__
@@ -27,7 +27,12 @@
 
 #include <memory>
 #include <utils.hpp>
+#include <db/intern.hpp>
+#include <db/memory.hpp>
+#include <db/tracing.hpp>
 #include <list>
+#include <string.h>
+#include <type_traits>
 #include <vector>
 
 namespace filesystem { class path; }
@@ -40,6 +45,28 @@ namespace db
 	typedef std::shared_ptr<Connection> ConnectionPtr;
 	typedef std::shared_ptr<Statement> StatementPtr;
 	typedef std::shared_ptr<Cursor> CursorPtr;
+	struct Results;
+	typedef std::shared_ptr<Results> ResultsPtr;
+	struct BatchColumn;
+
+	// Fixed-point number, unscaled / 10^scale. Holds up to 18 digits;
+	// fractional digits past that are rounded, half away from zero.
+	struct Decimal
+	{
+		long long unscaled;
+		int scale;
+		Decimal(): unscaled(0), scale(0) {}
+		Decimal(long long unscaled, int scale): unscaled(unscaled), scale(scale) {}
+		double toDouble() const;
+		// unscaled value with another number of fractional digits, rounded
+		// half away from zero; false on overflow
+		bool rescale(int scale, long long& out) const;
+		// [-+]digits[.digits], as sent by the server; no allocations
+		static bool parse(const char* text, size_t length, Decimal& out);
+		// zero-terminated text, as parse() reads it; the length written,
+		// 0 if the buffer is too small
+		size_t format(char* buffer, size_t size) const;
+	};
 
 	struct Cursor
 	{
@@ -49,6 +76,9 @@ namespace db
 		virtual int getInt(int column) = 0;
 		virtual long getLong(int column) = 0;
 		virtual long long getLongLong(int column) = 0;
+		virtual double getDouble(int column) = 0;
+		virtual float getFloat(int column) = 0;
+		virtual Decimal getDecimal(int column) = 0;
 		virtual tyme::time_t getTimestamp(int column) = 0;
 		virtual const char* getText(int column) = 0;
 		virtual size_t getBlobSize(int column) = 0;
@@ -56,12 +86,36 @@ namespace db
 		virtual bool isNull(int column) = 0;
 		virtual ConnectionPtr getConnection() const = 0;
 		virtual StatementPtr getStatement() const = 0;
+
+		// getDecimal(), telling a failed read or a value over 18 digits
+		// apart from a zero; the error is left on the statement
+		virtual bool readDecimal(int column, Decimal& value) { value = getDecimal(column); return true; }
+
+		// Random access, for cursors holding the whole result (see
+		// Statement::setBuffered); the forward-only ones have npos rows
+		// and refuse to seek. seek() makes the row current, as if next()
+		// has just read it; rewind() goes back before the first row. The
+		// bookmark() of the current row can be passed to seek() later;
+		// it is npos before the first row and after next() fails.
+		static const size_t npos = (size_t)-1;
+		virtual size_t rowCount() { return npos; }
+		virtual size_t bookmark() { return npos; }
+		virtual bool seek(size_t) { return false; }
+		virtual bool rewind() { return false; }
+
+		// for ColumnBatch::fill(): copies the current row into the columns
+		// at row, bypassing the getters; false, if the cursor cannot
+		virtual bool copyRow(BatchColumn* /*columns*/, size_t /*count*/, size_t /*row*/) { return false; }
 	};
 
 	struct time_tag {};
 
 	template <typename Type> struct Selector;
 	template <typename Type> struct Struct;
+	// true for the types declared with CURSOR_INTERN_RULE
+	template <typename Type> struct Interning: std::false_type {};
+	template <typename Type> struct Binder;
+	template <typename Type> struct Params;
 
 	template <>
 	struct Selector<int> { static int get(const CursorPtr& c, int column) { return c->getInt(column); } };
@@ -72,6 +126,15 @@ namespace db
 	template <>
 	struct Selector<long long> { static long long get(const CursorPtr& c, int column) { return c->getLongLong(column); } };
 
+	template <>
+	struct Selector<double> { static double get(const CursorPtr& c, int column) { return c->getDouble(column); } };
+
+	template <>
+	struct Selector<float> { static float get(const CursorPtr& c, int column) { return c->getFloat(column); } };
+
+	template <>
+	struct Selector<Decimal> { static Decimal get(const CursorPtr& c, int column) { return c->getDecimal(column); } };
+
 	template <>
 	struct Selector<time_tag> { static tyme::time_t get(const CursorPtr& c, int column) { return c->getTimestamp(column); } };
 
@@ -81,10 +144,22 @@ namespace db
 	template <>
 	struct Selector<std::string> { static std::string get(const CursorPtr& c, int column) { return c->isNull(column) ? std::string() : c->getText(column); } };
 
+	// Capture<Type> reads the column the way Selector<Type> would, without
+	// building the value; used to record rows for a later, off-thread get
+	template <typename Type>
+	struct Capture { static void get(const CursorPtr& c, int column) { Selector<Type>::get(c, column); } };
+
+	template <>
+	struct Capture<std::string> { static void get(const CursorPtr& c, int column) { if (!c->isNull(column)) c->getText(column); } };
+
+	template <>
+	struct Capture<Interned> { static void get(const CursorPtr& c, int column) { Capture<std::string>::get(c, column); } };
+
 	struct SelectorBase
 	{
 		virtual ~SelectorBase() {}
 		virtual bool get(const CursorPtr& c, void* context) = 0;
+		virtual void capture(const CursorPtr& c) = 0;
 	};
 	typedef std::shared_ptr<SelectorBase> SelectorBasePtr;
 
@@ -108,6 +183,11 @@ namespace db
 			ctx->*m_member = Selector<Member>::get(c, m_column);
 			return true;
 		}
+
+		void capture(const CursorPtr& c)
+		{
+			Capture<Member>::get(c, m_column);
+		}
 	};
 
 	template <typename Type>
@@ -130,12 +210,63 @@ namespace db
 			ctx->*m_member = Selector<db::time_tag>::get(c, m_column);
 			return true;
 		}
+
+		void capture(const CursorPtr& c)
+		{
+			Capture<db::time_tag>::get(c, m_column);
+		}
+	};
+
+	typedef std::shared_ptr<StringPoolPtr> StringPoolSlot;
+
+	template <typename Type>
+	struct InternedMemberSelector: SelectorBase
+	{
+		int m_column;
+		Interned Type::* m_member;
+		StringPoolSlot m_pool;
+		InternedMemberSelector(int column, Interned Type::* member, const StringPoolSlot& pool)
+			: m_column(column)
+			, m_member(member)
+			, m_pool(pool)
+		{
+		}
+
+		bool get(const CursorPtr& c, void* context)
+		{
+			Type* ctx = (Type*)context;
+			if (!ctx)
+				return false;
+
+			if (c->isNull(m_column))
+			{
+				ctx->*m_member = Interned();
+				return true;
+			}
+
+			// not a NULL, so no text means the cursor failed to read it
+			const char* text = c->getText(m_column);
+			if (!text)
+			{
+				ctx->*m_member = Interned();
+				return false;
+			}
+
+			ctx->*m_member = (*m_pool)->intern(text);
+			return !(ctx->*m_member).isNull();
+		}
+
+		void capture(const CursorPtr& c)
+		{
+			Capture<Interned>::get(c, m_column);
+		}
 	};
 
 	template <typename Type>
 	struct CursorStruct
 	{
 		std::list<SelectorBasePtr> m_selectors;
+		StringPoolSlot m_pool;
 
 		template <typename Member>
 		void add(int column, Member Type::* dest)
@@ -148,6 +279,16 @@ namespace db
 			m_selectors.push_back(std::make_shared< TimeMemberSelector<Type> >(column, dest));
 		}
 
+		// null, if there are no interned members
+		StringPoolPtr pool() const { return m_pool ? *m_pool : nullptr; }
+
+		// shares a pool between several loads, or several tables
+		void intern(const StringPoolPtr& pool)
+		{
+			if (m_pool && pool)
+				*m_pool = pool;
+		}
+
 		bool get(const CursorPtr& c, Type& ctx)
 		{
 			for (auto&& selector : m_selectors)
@@ -158,6 +299,12 @@ namespace db
 			return true;
 		};
 
+		void capture(const CursorPtr& c)
+		{
+			for (auto&& selector : m_selectors)
+				selector->capture(c);
+		};
+
 		bool get(const CursorPtr& c, std::list<Type>& ctx)
 		{
 			while (c->next())
@@ -165,7 +312,7 @@ namespace db
 				Type item;
 				if (!get(c, item))
 					return false;
-				ctx.push_back(item);
+				ctx.push_back(std::move(item));
 			}
 			return true;
 		};
@@ -177,30 +324,96 @@ namespace db
 				Type item;
 				if (!get(c, item))
 					return false;
-				ctx.push_back(item);
+				ctx.push_back(std::move(item));
 			}
 			return true;
 		};
 	};
 
+	template <typename Type>
+	struct InterningStruct: CursorStruct<Type>
+	{
+		// opt-in for low-cardinality text columns: repeated values share
+		// a single copy in the pool(), which must outlive the loaded rows
+		void addInterned(int column, Interned Type::* dest)
+		{
+			if (!this->m_pool)
+				this->m_pool = std::make_shared<StringPoolPtr>(std::make_shared<StringPool>());
+			this->m_selectors.push_back(std::make_shared< InternedMemberSelector<Type> >(column, dest, this->m_pool));
+		}
+	};
+
 	template <typename Type> 
 	static inline bool get(const CursorPtr& c, Type& t)
 	{
+		static_assert(!Interning<Type>::value, "the interned values would outlive their pool; pass a StringPoolPtr&");
 		return Struct<Type>().get(c, t);
 	}
 
 	template <typename Type> 
 	static inline bool get(const CursorPtr& c, std::list<Type>& l)
 	{
+		static_assert(!Interning<Type>::value, "the interned values would outlive their pool; pass a StringPoolPtr&");
 		return Struct<Type>().get(c, l);
 	}
 
 	template <typename Type> 
 	static inline bool get(const CursorPtr& c, std::vector<Type>& l)
 	{
+		static_assert(!Interning<Type>::value, "the interned values would outlive their pool; pass a StringPoolPtr&");
 		return Struct<Type>().get(c, l);
 	}
 
+	// for structures with interned members; uses the pool given, or
+	// returns the one the values were interned in
+	template <typename Type> 
+	static inline bool get(const CursorPtr& c, Type& t, StringPoolPtr& pool)
+	{
+		Struct<Type> rules;
+		rules.intern(pool);
+		bool ret = rules.get(c, t);
+		pool = rules.pool();
+		return ret;
+	}
+
+	template <typename Type> 
+	static inline bool get(const CursorPtr& c, std::list<Type>& l, StringPoolPtr& pool)
+	{
+		Struct<Type> rules;
+		rules.intern(pool);
+		bool ret = rules.get(c, l);
+		pool = rules.pool();
+		return ret;
+	}
+
+	template <typename Type> 
+	static inline bool get(const CursorPtr& c, std::vector<Type>& l, StringPoolPtr& pool)
+	{
+		Struct<Type> rules;
+		rules.intern(pool);
+		bool ret = rules.get(c, l);
+		pool = rules.pool();
+		return ret;
+	}
+
+	namespace error
+	{
+		// Library-level errors reported through ErrorReporter::errorCode;
+		// they are negative, so they never clash with the codes of the drivers
+		enum
+		{
+			TRANSACTION_LOST = -1,
+			SHARD_KEY_REQUIRED = -2,
+			SHARD_UNAVAILABLE = -3,
+			OVERLOADED = -4,
+			CIRCUIT_OPEN = -5,
+			TIMEOUT = -6,
+			CANCELLED = -7,
+			INJECTED = -8, // by the `faulty' driver
+			MEMORY_LIMIT = -9
+		};
+	}
+
 	struct ErrorReporter
 	{
 		virtual ~ErrorReporter() {}
@@ -208,6 +421,18 @@ namespace db
 		virtual long errorCode() = 0;
 	};
 
+	// Outcomes of the statements of a batch, or of a procedure returning
+	// several result sets, in order. A failing statement ends the batch;
+	// its error is reported while it is the current one.
+	struct Results : ErrorReporter
+	{
+		// moves to the next statement; false past the last one
+		virtual bool next() = 0;
+		// rows of the current statement, null if it did not return any
+		virtual CursorPtr cursor() = 0;
+		virtual long long affectedRows() = 0;
+	};
+
 	struct Statement : ErrorReporter
 	{
 		virtual bool bind(int arg, int value) = 0;
@@ -215,12 +440,34 @@ namespace db
 		virtual bool bind(int arg, long value) = 0;
 		virtual bool bind(int arg, long long value) = 0;
 		virtual bool bind(int arg, const char* value) = 0;
-		virtual bool bind(int arg, const std::string& value) { return bind(arg, value.c_str()); }
+		virtual bool bind(int arg, const std::string& value) { return bindText(arg, value.data(), value.length()); }
 		virtual bool bind(int arg, const void* value, size_t size) = 0;
+		virtual bool bindText(int arg, const char* value, size_t length) = 0;
+
+		// The *Ref variants do not copy the value. The memory is owned by
+		// the caller and must stay valid and unchanged until the last
+		// execute()/query() using it has returned, or until the argument
+		// is bound again. Debug builds check the contents before each
+		// execution and fail it, if the memory was modified.
+		virtual bool bindTextRef(int arg, const char* value, size_t length) = 0;
+		virtual bool bindBlobRef(int arg, const void* value, size_t size) = 0;
 		virtual bool bindTime(int arg, tyme::time_t value) = 0;
 		virtual bool bindNull(int arg) = 0;
+		// query() stores the whole result on the client, making the
+		// cursor scrollable, instead of reading it row by row
+		virtual void setBuffered(bool buffered) = 0;
+		// deadline for each of the following execute() and query() calls,
+		// 0 for none; an expired call fails with error::TIMEOUT
+		virtual void setTimeout(long milliseconds) = 0;
 		virtual bool execute() = 0;
 		virtual CursorPtr query() = 0;
+		// all the result sets; a statement from Connection::direct() may
+		// hold several statements, when the connection allows it, and a
+		// CALL returns one result per SELECT of the procedure
+		virtual ResultsPtr results() = 0;
+		// called from another thread, stops the running execute() or
+		// query(), which then fails with error::CANCELLED
+		virtual bool cancel() = 0;
 		virtual ConnectionPtr getConnection() const = 0;
 	};
 
@@ -233,8 +480,16 @@ namespace db
 		virtual bool exec(const char* sql) = 0;
 		virtual StatementPtr prepare(const char* sql) = 0;
 		virtual StatementPtr prepare(const char* sql, long lowLimit, long hiLimit) = 0;
+		// for SQL run once: the arguments are escaped into the text on the
+		// client and the query costs a single round trip; with stream, the
+		// rows are read as the cursor goes and the connection is busy
+		// until the cursor is gone
+		virtual StatementPtr direct(const char* sql, bool stream = false) = 0;
 		virtual bool reconnect() = 0;
 		virtual std::string getURI() const = 0;
+		// the buffers held by the statements and cursors of this connection;
+		// nullptr, if the driver does not account for them
+		virtual MemoryBudgetPtr memory() const { return nullptr; }
 		static ConnectionPtr open(const filesystem::path& path);
 	};
 
@@ -254,12 +509,16 @@ namespace db
 		~Transaction()
 		{
 			if (m_state == BEGAN)
+			{
+				Span span("transaction.rollback");
 				m_conn->rollbackTransaction();
+			}
 		}
 		bool begin()
 		{
 			if (m_state != UNKNOWN)
 				return false;
+			Span span("transaction.begin");
 			if (!m_conn->beginTransaction())
 				return false;
 			m_state = BEGAN;
@@ -270,6 +529,7 @@ namespace db
 			if (m_state != BEGAN)
 				return false;
 			m_state = COMMITED;
+			Span span("transaction.commit");
 			return m_conn->commitTransaction();
 		}
 		bool rollback()
@@ -277,10 +537,194 @@ namespace db
 			if (m_state != BEGAN)
 				return false;
 			m_state = REVERTED;
+			Span span("transaction.rollback");
 			return m_conn->rollbackTransaction();
 		}
 	};
 
+	// Binder<Type> is the reverse of Selector<Type>. Text is bound by
+	// reference: the bound object must outlive the execute().
+	template <>
+	struct Binder<short> { static bool bind(const StatementPtr& s, int arg, short value) { return s->bind(arg, value); } };
+
+	template <>
+	struct Binder<int> { static bool bind(const StatementPtr& s, int arg, int value) { return s->bind(arg, value); } };
+
+	template <>
+	struct Binder<long> { static bool bind(const StatementPtr& s, int arg, long value) { return s->bind(arg, value); } };
+
+	template <>
+	struct Binder<long long> { static bool bind(const StatementPtr& s, int arg, long long value) { return s->bind(arg, value); } };
+
+	template <>
+	struct Binder<double> { static bool bind(const StatementPtr& s, int arg, double value); };
+
+	template <>
+	struct Binder<float> { static bool bind(const StatementPtr& s, int arg, float value) { return Binder<double>::bind(s, arg, value); } };
+
+	template <>
+	struct Binder<Decimal> { static bool bind(const StatementPtr& s, int arg, const Decimal& value); };
+
+	template <>
+	struct Binder<time_tag> { static bool bind(const StatementPtr& s, int arg, tyme::time_t value) { return s->bindTime(arg, value); } };
+
+	template <>
+	struct Binder<const char*> { static bool bind(const StatementPtr& s, int arg, const char* value) { return value ? s->bindTextRef(arg, value, strlen(value)) : s->bindNull(arg); } };
+
+	template <>
+	struct Binder<std::string> { static bool bind(const StatementPtr& s, int arg, const std::string& value) { return s->bindTextRef(arg, value.data(), value.length()); } };
+
+	template <>
+	struct Binder<Interned> { static bool bind(const StatementPtr& s, int arg, const Interned& value) { return value.isNull() ? s->bindNull(arg) : s->bindTextRef(arg, value.c_str(), value.length()); } };
+
+	struct BinderBase
+	{
+		virtual ~BinderBase() {}
+		virtual bool bind(const StatementPtr& s, int first, const void* context) = 0;
+	};
+	typedef std::shared_ptr<BinderBase> BinderBasePtr;
+
+	template <typename Type, typename Member>
+	struct MemberBinder: BinderBase
+	{
+		int m_arg;
+		Member Type::* m_member;
+		MemberBinder(int arg, Member Type::* member)
+			: m_arg(arg)
+			, m_member(member)
+		{
+		}
+
+		bool bind(const StatementPtr& s, int first, const void* context)
+		{
+			const Type* ctx = (const Type*)context;
+			if (!ctx)
+				return false;
+
+			return Binder<Member>::bind(s, first + m_arg, ctx->*m_member);
+		}
+	};
+
+	template <typename Type>
+	struct TimeMemberBinder: BinderBase
+	{
+		int m_arg;
+		tyme::time_t Type::* m_member;
+		TimeMemberBinder(int arg, tyme::time_t Type::* member)
+			: m_arg(arg)
+			, m_member(member)
+		{
+		}
+
+		bool bind(const StatementPtr& s, int first, const void* context)
+		{
+			const Type* ctx = (const Type*)context;
+			if (!ctx)
+				return false;
+
+			return Binder<db::time_tag>::bind(s, first + m_arg, ctx->*m_member);
+		}
+	};
+
+	template <typename Type>
+	struct ParamStruct
+	{
+		std::list<BinderBasePtr> m_binders;
+		size_t m_args;
+		ParamStruct(): m_args(0) {}
+
+		template <typename Member>
+		void add(int arg, Member Type::* src)
+		{
+			m_binders.push_back(std::make_shared< MemberBinder<Type, Member> >(arg, src));
+			if ((size_t)arg >= m_args)
+				m_args = arg + 1;
+		}
+
+		void addTime(int arg, tyme::time_t Type::* src)
+		{
+			m_binders.push_back(std::make_shared< TimeMemberBinder<Type> >(arg, src));
+			if ((size_t)arg >= m_args)
+				m_args = arg + 1;
+		}
+
+		// arguments taken by a single object
+		size_t args() const { return m_args; }
+
+		// binds the object as the arguments first, first + 1, ...
+		bool bind(const StatementPtr& s, const Type& ctx, int first = 0)
+		{
+			for (auto&& binder : m_binders)
+			{
+				if (!binder->bind(s, first, &ctx))
+					return false;
+			}
+			return true;
+		}
+	};
+
+	template <typename Type>
+	static inline bool bind(const StatementPtr& s, const Type& t, int first = 0)
+	{
+		return Params<Type>().bind(s, t, first);
+	}
+
+	// prefix followed by " (?, ...), (?, ...)" for the given number of rows
+	StatementPtr prepareInsert(const ConnectionPtr& conn, const char* prefix, size_t args, size_t rows);
+
+	// Writes the whole container in multi-row INSERTs of up to batchRows
+	// rows; prefix is the statement up to VALUES, for example "INSERT INTO
+	// tab (a, b) VALUES". The rows are bound in place, without copies.
+	template <typename Container>
+	bool insert(const ConnectionPtr& conn, const char* prefix, const Container& rows, size_t batchRows = 256)
+	{
+		typedef typename Container::value_type Type;
+		Params<Type> rules;
+		size_t args = rules.args();
+		if (!conn || !args)
+			return false;
+
+		// the server takes at most 65535 arguments in a statement
+		size_t maxRows = 65535 / args;
+		if (!batchRows)
+			batchRows = 1;
+		if (batchRows > maxRows)
+			batchRows = maxRows;
+
+		StatementPtr full;
+		auto it = rows.begin();
+		size_t left = rows.size();
+		while (left)
+		{
+			size_t count = left < batchRows ? left : batchRows;
+			StatementPtr stmt;
+			if (count == batchRows)
+			{
+				if (!full)
+					full = prepareInsert(conn, prefix, args, count);
+				stmt = full;
+			}
+			else
+				stmt = prepareInsert(conn, prefix, args, count);
+
+			if (!stmt)
+				return false;
+
+			int first = 0;
+			for (size_t i = 0; i < count; ++i, ++it)
+			{
+				if (!rules.bind(stmt, *it, first))
+					return false;
+				first += (int)args;
+			}
+
+			if (!stmt->execute())
+				return false;
+			left -= count;
+		}
+		return true;
+	}
+
 	struct environment
 	{
 		bool failed;
@@ -297,7 +741,30 @@ namespace db
 		Struct(); \
 	}; \
 	Struct<type>::Struct()
+// needed for CURSOR_INTERN; the rows load only with a StringPoolPtr&
+#define CURSOR_INTERN_RULE(type) \
+	template <> \
+	struct Interning<type>: std::true_type {}; \
+	template <> \
+	struct Struct<type>: InterningStruct<type> \
+	{ \
+		typedef type Type; \
+		Struct(); \
+	}; \
+	Struct<type>::Struct()
 #define CURSOR_ADD(column, name) add(column, &Type::name)
 #define CURSOR_TIME(column, name) addTime(column, &Type::name)
+#define CURSOR_INTERN(column, name) addInterned(column, &Type::name)
+
+#define PARAM_RULE(type) \
+	template <> \
+	struct Params<type>: ParamStruct<type> \
+	{ \
+		typedef type Type; \
+		Params(); \
+	}; \
+	Params<type>::Params()
+#define PARAM_ADD(arg, name) add(arg, &Type::name)
+#define PARAM_TIME(arg, name) addTime(arg, &Type::name)
 
 #endif //__DBCONN_H__
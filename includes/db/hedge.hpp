@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DBCONN_HEDGE_H__
+#define __DBCONN_HEDGE_H__
+
+#include <db/conn.hpp>
+#include <functional>
+#include <mutex>
+
+namespace db
+{
+	struct HedgeStats
+	{
+		unsigned long long queries;
+		unsigned long long hedged;     // the second connection was asked, too
+		unsigned long long hedgeWins;  // ...and answered first
+		unsigned long long failed;
+		long long delay;               // current hedging delay, ms
+	};
+
+	// Idempotent read sent to the first connection and, if that one did
+	// not answer in time, to the second one as well. The first cursor to
+	// arrive is used and the other statement is cancelled; the query
+	// returns after the other one has stopped, so both connections are
+	// free again. The delay is the 95th percentile of the recent answers,
+	// the cancelled ones included; keep one object per SQL text to keep
+	// its statistics apart. The statements prepared by the last call are
+	// kept for the next one, while their connections are still in use.
+	class HedgedQuery: public ErrorReporter
+	{
+	public:
+		typedef std::function<bool (const StatementPtr&)> Binder;
+	private:
+		std::string m_sql;
+		Binder m_binder;
+		long long m_initialDelay;
+		std::mutex m_mutex;
+		std::vector<long long> m_latencies;
+		size_t m_nextLatency;
+		HedgeStats m_stats;
+		long m_error;
+		std::string m_message;
+		struct Prepared
+		{
+			std::weak_ptr<Connection> conn;
+			StatementPtr stmt;
+		};
+		Prepared m_prepared[2];
+
+		long long delay();
+		StatementPtr prepared(const ConnectionPtr& conn);
+		void record(long long latency);
+	public:
+		explicit HedgedQuery(const std::string& sql, long long initialDelay = 50, size_t window = 256);
+		HedgedQuery& bind(const Binder& binder) { m_binder = binder; return *this; }
+		CursorPtr query(const ConnectionPtr& first, const ConnectionPtr& second);
+		HedgeStats stats();
+		const char* errorMessage() override { return m_message.c_str(); }
+		long errorCode() override { return m_error; }
+	};
+}
+
+#endif //__DBCONN_HEDGE_H__
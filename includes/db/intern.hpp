@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DBCONN_INTERN_H__
+#define __DBCONN_INTERN_H__
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace db
+{
+	// Handle to a text kept in a StringPool; a single pointer, compared by
+	// address. A default handle, used for NULLs, reads as an empty string.
+	class Interned
+	{
+		const char* m_data; // preceded by the length, see StringPool
+		friend class StringPool;
+		explicit Interned(const char* data): m_data(data) {}
+	public:
+		Interned(): m_data(nullptr) {}
+		bool isNull() const { return !m_data; }
+		const char* c_str() const { return m_data ? m_data : ""; }
+		size_t length() const { return m_data ? ((const size_t*)m_data)[-1] : 0; }
+		bool empty() const { return !length(); }
+		std::string str() const { return std::string(c_str(), length()); }
+		// handles from the same pool are equal, if the texts are
+		bool operator == (const Interned& right) const { return m_data == right.m_data; }
+		bool operator != (const Interned& right) const { return m_data != right.m_data; }
+	};
+
+	struct InternStats
+	{
+		size_t values;      // texts interned
+		size_t unique;      // distinct texts stored
+		size_t stringBytes; // what the values would take as std::strings
+		size_t poolBytes;   // what they take as handles, arena and index
+		long long saved() const { return (long long)stringBytes - (long long)poolBytes; }
+	};
+
+	// Dictionary arena for low-cardinality text columns. Texts are copied
+	// once into large blocks and never moved or freed before the pool is;
+	// the handles must not outlive it. Safe to use from several threads.
+	class StringPool
+	{
+		struct Key
+		{
+			const char* data;
+			size_t length;
+		};
+		struct Hash { size_t operator()(const Key& key) const; };
+		struct Equal { bool operator()(const Key& left, const Key& right) const; };
+
+		std::mutex m_mutex;
+		std::unordered_set<Key, Hash, Equal> m_index;
+		std::vector< std::unique_ptr<char[]> > m_blocks;
+		size_t m_blockSize;
+		size_t m_used;     // in the last block
+		size_t m_reserved; // in all blocks
+		InternStats m_stats;
+
+		char* allocate(size_t size);
+	public:
+		explicit StringPool(size_t blockSize = 64 * 1024);
+		StringPool(const StringPool&) = delete;
+		StringPool& operator=(const StringPool&) = delete;
+		Interned intern(const char* text, size_t length);
+		Interned intern(const char* text);
+		InternStats stats();
+	};
+	typedef std::shared_ptr<StringPool> StringPoolPtr;
+}
+
+#endif //__DBCONN_INTERN_H__
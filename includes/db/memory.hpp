@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DBCONN_MEMORY_H__
+#define __DBCONN_MEMORY_H__
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+namespace db
+{
+	struct MemoryLimits
+	{
+		size_t soft;  // over it, buffered queries read their rows as they go instead
+		size_t hard;  // see MemoryBudget; 0 for none
+		size_t keep;  // result buffers grown over it are freed before the next row
+		MemoryLimits()
+			: soft(0)
+			, hard(0)
+			, keep(64 * 1024)
+		{
+		}
+	};
+
+	struct MemoryStats
+	{
+		size_t used;
+		size_t peak;
+		unsigned long long refused;  // reservations over the hard limit of this budget, not of a parent
+		unsigned long long spilled;  // buffered queries read as streams
+		unsigned long long shrunk;   // buffers freed after an oversized row
+	};
+
+	class MemoryBudget;
+	typedef std::shared_ptr<MemoryBudget> MemoryBudgetPtr;
+
+	// Bytes held by the bind buffers, result buffers and buffered result
+	// sets of the drivers. Each connection has its own budget, charged
+	// together with its parents: a named one shared by the connections
+	// of the same name, if configured, and the global one.
+	//
+	// Over the hard limit, the bind and result buffers are not allocated
+	// and the call fails with error::MEMORY_LIMIT. A buffered result set
+	// is only measured after the client library has read it whole; one
+	// over the limit is freed at once and the query fails the same way,
+	// but the memory was taken for that while. The soft limit, which
+	// makes the prepared queries read their rows as they go, is what
+	// keeps large results from being read whole in the first place.
+	class MemoryBudget
+	{
+		MemoryBudgetPtr m_parent;
+		std::atomic<size_t> m_soft;
+		std::atomic<size_t> m_hard;
+		std::atomic<size_t> m_keep;
+		std::atomic<size_t> m_used;
+		std::atomic<size_t> m_peak;
+		std::atomic<unsigned long long> m_refused;
+		std::atomic<unsigned long long> m_spilled;
+		std::atomic<unsigned long long> m_shrunk;
+		MemoryBudget(const MemoryBudget&);
+		MemoryBudget& operator=(const MemoryBudget&);
+	public:
+		explicit MemoryBudget(const MemoryLimits& limits, const MemoryBudgetPtr& parent = global());
+
+		// no limits, until setLimits() is called on it
+		static const MemoryBudgetPtr& global();
+		// budgets shared by all the connections using the same name
+		static MemoryBudgetPtr named(const std::string& name, const MemoryLimits& limits);
+
+		void setLimits(const MemoryLimits& limits);
+		const MemoryBudgetPtr& parent() const { return m_parent; }
+
+		// false, if this budget or any of its parents would go over the
+		// hard limit; nothing is charged then
+		bool reserve(size_t bytes);
+		void release(size_t bytes);
+		// over the soft limit here or in any of the parents
+		bool pressured() const;
+		// the smallest keep of this budget and its parents
+		size_t keep() const;
+
+		void spilled();
+		void shrunk();
+		MemoryStats stats() const;
+	};
+}
+
+#endif //__DBCONN_MEMORY_H__
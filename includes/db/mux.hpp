@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DBCONN_MUX_H__
+#define __DBCONN_MUX_H__
+
+#include <db/conn.hpp>
+
+namespace db
+{
+	struct MuxStats
+	{
+		size_t sessions;     // logical connections alive
+		size_t connections;  // physical connections open
+		size_t pinned;       // sessions holding on to a physical connection
+		size_t waiting;      // calls queued for a free connection right now
+		unsigned long long calls;
+		long long waitTotal; // microseconds spent in the queue by all calls
+		long long waitMax;
+		double ratio() const { return connections ? (double)sessions / connections : 0.0; }
+		double averageWait() const { return calls ? (double)waitTotal / calls : 0.0; }
+	};
+
+	// Returned by Connection::open for the `mux' driver:
+	//
+	//   driver=mux
+	//   target=orders.ini   (the physical connections; relative to this file)
+	//   connections=4       (physical connections shared by the sessions)
+	//   wait=1000           (ms a call may wait for a free connection, 0 forever)
+	//
+	// Every open() of the same file gives a new session over the same
+	// physical connections. A call borrows a connection for its duration,
+	// a query() until its cursor is gone. A session stays on a single
+	// connection while a transaction is open, after exec() of a statement
+	// changing the session state (SET, USE, LOCK TABLES, CREATE TEMPORARY)
+	// and between pin() and unpin(). A call, which waited in vain, fails
+	// with error::OVERLOADED.
+	struct MultiplexedConnection: Connection
+	{
+		virtual bool pin() = 0;
+		virtual void unpin() = 0;
+		virtual MuxStats stats() = 0;
+	};
+	typedef std::shared_ptr<MultiplexedConnection> MultiplexedConnectionPtr;
+}
+
+#endif //__DBCONN_MUX_H__
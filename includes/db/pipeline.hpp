@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DBCONN_PIPELINE_H__
+#define __DBCONN_PIPELINE_H__
+
+#include <db/conn.hpp>
+#include <db/intern.hpp>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+namespace db
+{
+	struct RowCell
+	{
+		enum
+		{
+			NULLNESS = 1,
+			VALUE = 2,
+			SIZE = 4,
+			DATA = 8,
+			REAL = 16,
+			DECIMAL = 32,
+			RAW = 64 // the data is the text of a number, decimal or timestamp
+		};
+
+		unsigned flags;
+		bool null;
+		long long value;
+		double real;
+		Decimal decimal;
+		size_t size;
+		size_t offset;
+	};
+
+	// Values read from consecutive rows of a cursor; the text and blob
+	// contents of all the rows are kept in a single arena.
+	class RowChunk
+	{
+		size_t m_columns;
+		size_t m_rows;
+		std::vector<RowCell> m_cells;
+		std::vector<char> m_data;
+	public:
+		explicit RowChunk(size_t columns): m_columns(columns), m_rows(0) {}
+		void reserve(size_t rows);
+		void addRow();
+		size_t rows() const { return m_rows; }
+		size_t columns() const { return m_columns; }
+		RowCell& cell(size_t row, size_t column) { return m_cells[row * m_columns + column]; }
+		const RowCell& cell(size_t row, size_t column) const { return m_cells[row * m_columns + column]; }
+		void store(RowCell& cell, const void* data, size_t size);
+		const char* data(const RowCell& cell) const { return &m_data[cell.offset]; }
+	};
+	typedef std::shared_ptr<RowChunk> RowChunkPtr;
+
+	// Forwards the getters to the source cursor, recording the results
+	// in the last row of the attached chunk. With raw(), the numbers,
+	// decimals and timestamps are recorded as text, for ChunkCursor to
+	// parse, and read as zeros here.
+	class RowRecorder: public Cursor
+	{
+		CursorPtr m_source;
+		RowChunkPtr m_chunk;
+		bool m_raw;
+		RowCell* current(int column);
+		bool recordRaw(int column);
+	public:
+		explicit RowRecorder(const CursorPtr& source): m_source(source), m_raw(false) {}
+		void attach(const RowChunkPtr& chunk) { m_chunk = chunk; }
+		void raw(bool raw) { m_raw = raw; }
+		bool next() override;
+		size_t columnCount() override { return m_source->columnCount(); }
+		int getInt(int column) override;
+		long getLong(int column) override;
+		long long getLongLong(int column) override;
+		double getDouble(int column) override;
+		float getFloat(int column) override;
+		Decimal getDecimal(int column) override;
+		bool readDecimal(int column, Decimal& value) override;
+		tyme::time_t getTimestamp(int column) override;
+		const char* getText(int column) override;
+		size_t getBlobSize(int column) override;
+		const void* getBlob(int column) override;
+		bool isNull(int column) override;
+		ConnectionPtr getConnection() const override { return m_source->getConnection(); }
+		StatementPtr getStatement() const override { return m_source->getStatement(); }
+	};
+
+	// Replays a recorded chunk; values, which were not recorded, read as
+	// nulls and zeros. The values recorded as text are parsed the way
+	// the text protocol cursors parse them.
+	class ChunkCursor: public Cursor
+	{
+		RowChunkPtr m_chunk;
+		size_t m_row;
+		CursorPtr m_source;
+		const RowCell* current(int column, unsigned flag);
+	public:
+		ChunkCursor(const RowChunkPtr& chunk, const CursorPtr& source)
+			: m_chunk(chunk)
+			, m_row((size_t)-1)
+			, m_source(source)
+		{
+		}
+		bool next() override;
+		size_t columnCount() override { return m_chunk->columns(); }
+		int getInt(int column) override { return (int)getLongLong(column); }
+		long getLong(int column) override { return (long)getLongLong(column); }
+		long long getLongLong(int column) override;
+		double getDouble(int column) override;
+		float getFloat(int column) override { return (float)getDouble(column); }
+		Decimal getDecimal(int column) override;
+		bool readDecimal(int column, Decimal& value) override;
+		tyme::time_t getTimestamp(int column) override;
+		const char* getText(int column) override;
+		size_t getBlobSize(int column) override;
+		const void* getBlob(int column) override { return getText(column); }
+		bool isNull(int column) override;
+		ConnectionPtr getConnection() const override { return m_source->getConnection(); }
+		StatementPtr getStatement() const override { return m_source->getStatement(); }
+		size_t rowCount() override { return m_chunk->rows(); }
+		size_t bookmark() override { return m_row < m_chunk->rows() ? m_row : npos; }
+		bool seek(size_t row) override;
+		bool rewind() override { m_row = npos; return true; }
+	};
+
+	struct PipelineOptions
+	{
+		size_t workers;    // 0 for one per core, less the fetching thread
+		size_t chunkRows;  // rows recorded before handing the chunk over
+		size_t maxChunks;  // recorded chunks waiting for a worker, 0 for two per worker
+		StringPoolPtr pool; // for interned members; required, if there are any
+		// the fetching thread copies numbers, decimals and timestamps as
+		// text and the workers parse them; meant for cursors reading rows
+		// as text (Connection::direct()), where parsing is most of the
+		// decoding. Binary cursors would convert the values to text first.
+		bool parseInWorkers;
+		PipelineOptions()
+			: workers(0)
+			, chunkRows(4096)
+			, maxChunks(0)
+			, parseInWorkers(false)
+		{
+		}
+	};
+
+	class ChunkQueue
+	{
+	public:
+		struct Item
+		{
+			size_t seq;
+			RowChunkPtr chunk;
+		};
+	private:
+		std::mutex m_mutex;
+		std::condition_variable m_pushed;
+		std::condition_variable m_popped;
+		std::deque<Item> m_items;
+		size_t m_limit;
+		bool m_closed;
+	public:
+		explicit ChunkQueue(size_t limit): m_limit(limit), m_closed(false) {}
+		bool push(size_t seq, const RowChunkPtr& chunk);
+		bool pop(Item& item);
+		void close();
+
+		// closes the queue and waits for the threads popping from it
+		class Joiner
+		{
+			ChunkQueue& m_queue;
+			std::vector<std::thread>& m_threads;
+		public:
+			Joiner(ChunkQueue& queue, std::vector<std::thread>& threads): m_queue(queue), m_threads(threads) {}
+			~Joiner() { join(); }
+			void join()
+			{
+				m_queue.close();
+				for (auto&& thread : m_threads)
+				{
+					if (thread.joinable())
+						thread.join();
+				}
+			}
+		};
+	};
+
+	// Materializes the whole cursor on several threads: the calling thread
+	// fetches rows and records them in chunks, the workers decode the
+	// chunks with Struct<Type>. The order of rows is preserved.
+	template <typename Type>
+	bool getParallel(const CursorPtr& c, std::vector<Type>& ctx, const PipelineOptions& options = PipelineOptions())
+	{
+		size_t workers = options.workers;
+		if (!workers)
+		{
+			workers = std::thread::hardware_concurrency();
+			if (workers > 1)
+				--workers;
+		}
+		if (!workers)
+			workers = 1;
+
+		size_t chunkRows = options.chunkRows ? options.chunkRows : 1;
+		size_t maxChunks = options.maxChunks ? options.maxChunks : workers * 2;
+
+		// the selectors do not change while reading, the workers share them
+		Struct<Type> rules;
+		if (rules.pool())
+		{
+			if (!options.pool)
+				return false; // the values would outlive their pool
+			rules.intern(options.pool);
+		}
+
+		ChunkQueue queue(maxChunks);
+		std::mutex results_mutex;
+		std::vector< std::vector<Type> > results;
+		bool failed = false;
+
+		auto worker = [&]()
+		{
+			ChunkQueue::Item item;
+			while (queue.pop(item))
+			{
+				try {
+					std::vector<Type> decoded;
+					decoded.reserve(item.chunk->rows());
+					CursorPtr replay = std::make_shared<ChunkCursor>(item.chunk, c);
+					bool ok = rules.get(replay, decoded);
+
+					std::lock_guard<std::mutex> lock(results_mutex);
+					if (!ok)
+					{
+						failed = true;
+						queue.close();
+					}
+					if (results.size() <= item.seq)
+						results.resize(item.seq + 1);
+					results[item.seq] = std::move(decoded);
+				} catch(std::bad_alloc) {
+					std::lock_guard<std::mutex> lock(results_mutex);
+					failed = true;
+					queue.close();
+				}
+			}
+		};
+
+		std::vector<std::thread> pool;
+		// the workers are stopped and joined, even if the fetching throws
+		ChunkQueue::Joiner joiner(queue, pool);
+		pool.reserve(workers);
+		for (size_t i = 0; i < workers; ++i)
+			pool.push_back(std::thread(worker));
+
+		auto recorder = std::make_shared<RowRecorder>(c);
+		recorder->raw(options.parseInWorkers);
+		CursorPtr recording = recorder;
+		size_t columns = c->columnCount();
+		size_t seq = 0;
+		bool more = true;
+		while (more)
+		{
+			auto chunk = std::make_shared<RowChunk>(columns);
+			chunk->reserve(chunkRows);
+			recorder->attach(chunk);
+			while (chunk->rows() < chunkRows && (more = recorder->next()))
+				rules.capture(recording);
+
+			if (!chunk->rows() || !queue.push(seq++, chunk))
+				break;
+		}
+		recorder->attach(nullptr);
+		joiner.join();
+
+		if (failed)
+			return false;
+
+		size_t total = ctx.size();
+		for (auto&& decoded : results)
+			total += decoded.size();
+		ctx.reserve(total);
+		for (auto&& decoded : results)
+		{
+			ctx.insert(ctx.end(), std::make_move_iterator(decoded.begin()), std::make_move_iterator(decoded.end()));
+			decoded.clear();
+			decoded.shrink_to_fit();
+		}
+
+		return true;
+	}
+};
+
+#endif //__DBCONN_PIPELINE_H__
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DBCONN_PREFETCH_H__
+#define __DBCONN_PREFETCH_H__
+
+#include <db/pipeline.hpp>
+#include <atomic>
+#include <functional>
+
+namespace db
+{
+	struct PrefetchOptions
+	{
+		size_t batchRows; // rows fetched before handing the batch over
+		size_t batches;   // fetched batches waiting to be read, at least 1
+		PrefetchOptions()
+			: batchRows(1024)
+			, batches(2)
+		{
+		}
+	};
+
+	// Reads the source cursor on a helper thread, a batch ahead of the
+	// reader. Only the values touched by the capture function are
+	// recorded; see prefetch<Type>() for the usual one. The source must
+	// not be used directly until this cursor is gone. Destroying the
+	// cursor early stops the helper after the row it is fetching. When
+	// the source fails, or the helper runs out of memory, next() returns
+	// false early and errorCode() tells why.
+	class PrefetchCursor: public Cursor, public ErrorReporter
+	{
+	public:
+		typedef std::function<void (const CursorPtr&)> Capture;
+	private:
+		CursorPtr m_source;
+		ChunkQueue m_queue;
+		std::atomic<bool> m_stopping; // looked at for every row
+		std::thread m_thread;
+		std::shared_ptr<ChunkCursor> m_current;
+		std::string m_message;
+		std::atomic<long> m_error; // set after m_message
+
+		void fetch(Capture capture, size_t batchRows);
+		void fetchAll(const Capture& capture, size_t batchRows);
+		void fail(long code, const char* message);
+	public:
+		PrefetchCursor(const CursorPtr& source, const Capture& capture, const PrefetchOptions& options = PrefetchOptions());
+		~PrefetchCursor();
+		bool next() override;
+		size_t columnCount() override { return m_source->columnCount(); }
+		int getInt(int column) override { return m_current ? m_current->getInt(column) : 0; }
+		long getLong(int column) override { return m_current ? m_current->getLong(column) : 0; }
+		long long getLongLong(int column) override { return m_current ? m_current->getLongLong(column) : 0; }
+		double getDouble(int column) override { return m_current ? m_current->getDouble(column) : 0; }
+		float getFloat(int column) override { return m_current ? m_current->getFloat(column) : 0; }
+		Decimal getDecimal(int column) override { return m_current ? m_current->getDecimal(column) : Decimal(); }
+		bool readDecimal(int column, Decimal& value) override { value = Decimal(); return m_current ? m_current->readDecimal(column, value) : false; }
+		tyme::time_t getTimestamp(int column) override { return m_current ? m_current->getTimestamp(column) : 0; }
+		const char* getText(int column) override { return m_current ? m_current->getText(column) : nullptr; }
+		size_t getBlobSize(int column) override { return m_current ? m_current->getBlobSize(column) : 0; }
+		const void* getBlob(int column) override { return m_current ? m_current->getBlob(column) : nullptr; }
+		bool isNull(int column) override { return m_current ? m_current->isNull(column) : true; }
+		ConnectionPtr getConnection() const override { return m_source->getConnection(); }
+		StatementPtr getStatement() const override { return m_source->getStatement(); }
+		const char* errorMessage() override { return m_error ? m_message.c_str() : ""; }
+		long errorCode() override { return m_error; }
+	};
+
+	// Prefetches the columns Struct<Type> reads; get() the result with
+	// the same Type.
+	template <typename Type>
+	CursorPtr prefetch(const CursorPtr& c, const PrefetchOptions& options = PrefetchOptions())
+	{
+		if (!c)
+			return nullptr;
+
+		auto rules = std::make_shared< Struct<Type> >();
+		try {
+			return std::make_shared<PrefetchCursor>(c, [rules](const CursorPtr& recorder) { rules->capture(recorder); }, options);
+		} catch (std::exception&) { return nullptr; }
+	}
+}
+
+#endif //__DBCONN_PREFETCH_H__
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DBCONN_REPLAY_H__
+#define __DBCONN_REPLAY_H__
+
+#include <db/conn.hpp>
+
+namespace db
+{
+	// Traces are written by the `record' driver:
+	//
+	//   driver=record
+	//   target=orders.ini   (the connection recorded; relative to this file)
+	//   trace=orders.trace  (shared by all the connections of this file)
+	//
+	// A trace is a header followed by records in the byte order of the
+	// machine, which wrote it. Every record starts with the event, the
+	// session (one per opened connection) and the start of the call in
+	// microseconds since the trace was opened. Texts are a 32-bit length
+	// and the bytes; calls end with the outcome and the time they took.
+	// The result of FETCHED is 0 for query() and counts the statements
+	// of results() from 1.
+	namespace trace
+	{
+		static const char MAGIC[8] = "DBTRACE";
+		static const unsigned VERSION = 2;
+		static const unsigned BYTE_ORDER_MARK = 0x01020304;
+
+		enum Event
+		{
+			OPEN = 1,
+			CLOSE,
+			PREPARE,   // stmt, low limit, high limit (-1 for none), sql, call
+			DIRECT,    // stmt, stream, sql, call
+			BIND,      // stmt, arg, Value, 64-bit number or text
+			OPTION,    // stmt, Option, value
+			EXECUTE,   // stmt, call
+			QUERY,     // stmt, call
+			FETCHED,   // stmt, result, rows, read to the end, microseconds since the query started
+			RESULTS,   // stmt, call
+			EXEC,      // sql, call
+			BEGIN,     // call
+			COMMIT,    // call
+			ROLLBACK,  // call
+			RECONNECT  // call
+		};
+
+		enum Value
+		{
+			NUL,
+			INTEGER,
+			TEXT,
+			BLOB,
+			TIME
+		};
+
+		enum Option
+		{
+			BUFFERED,
+			TIMEOUT
+		};
+	}
+
+	struct ReplayOptions
+	{
+		double speed;       // 1 for the recorded pace, 2 for twice as fast, 0 for no pauses
+		size_t concurrency; // sessions replayed at the same time
+		ReplayOptions()
+			: speed(1.0)
+			, concurrency(8)
+		{
+		}
+	};
+
+	// in microseconds
+	struct LatencyStats
+	{
+		unsigned long long count;
+		unsigned long long errors;
+		long long p50;
+		long long p90;
+		long long p99;
+		long long max;
+		double mean;
+	};
+
+	struct ReplayStats
+	{
+		size_t sessions;
+		size_t failedSessions;         // the target could not be opened
+		unsigned long long mismatches; // outcomes or row counts other than recorded; a cursor
+		                               // left early only needs as many rows, as it read
+		long long duration;            // microseconds of the whole replay
+		LatencyStats queries;          // including reading all the rows
+		LatencyStats executes;         // execute(), results() and Connection::exec()
+		LatencyStats transactions;     // begin, commit and rollback
+	};
+
+	// Re-issues a recorded trace against another connection file. The
+	// sessions run on their own connections, concurrency at a time, each
+	// waiting for the recorded moment of its calls.
+	class Replay
+	{
+	public:
+		// false, if the trace cannot be read
+		static bool run(const filesystem::path& trace, const filesystem::path& target, const ReplayOptions& options, ReplayStats& stats);
+	};
+}
+
+#endif //__DBCONN_REPLAY_H__
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DBCONN_SCATTER_H__
+#define __DBCONN_SCATTER_H__
+
+#include <db/conn.hpp>
+#include <functional>
+
+namespace db
+{
+	struct MergeKey
+	{
+		enum Kind
+		{
+			INTEGER,
+			TEXT, // bytewise; the query must sort with a binary collation, e.g. ORDER BY name COLLATE utf8_bin
+			TIMESTAMP
+		};
+
+		int column;
+		Kind kind;
+		bool descending;
+	};
+
+	// The rows of a Scatter::query(). A shard whose cursor fails after
+	// the query ends its rows early and the others go on; failed() lists
+	// such shards, errorCode() and errorMessage() describe the first one.
+	class ScatterCursor: public Cursor, public ErrorReporter
+	{
+	public:
+		virtual std::vector<size_t> failed() const = 0;
+	};
+	typedef std::shared_ptr<ScatterCursor> ScatterCursorPtr;
+
+	// Runs the same query on several connections at once. The rows are
+	// either concatenated in the order of the connections, or, with the
+	// orderBy() keys matching the ORDER BY of the query, merged in order.
+	// Every connection streams its own cursor, the merge keeps only the
+	// current row of each.
+	class Scatter: public ErrorReporter
+	{
+	public:
+		typedef std::function<bool (const StatementPtr&)> Binder;
+	private:
+		std::string m_sql;
+		Binder m_binder;
+		std::vector<MergeKey> m_keys;
+		long m_error;
+		std::string m_message;
+	public:
+		explicit Scatter(const std::string& sql)
+			: m_sql(sql)
+			, m_error(0)
+		{
+		}
+		Scatter& bind(const Binder& binder) { m_binder = binder; return *this; }
+		Scatter& orderBy(int column, MergeKey::Kind kind, bool descending = false)
+		{
+			MergeKey key = { column, kind, descending };
+			m_keys.push_back(key);
+			return *this;
+		}
+
+		// fails, if any of the connections fails before its first row
+		ScatterCursorPtr query(const std::vector<ConnectionPtr>& conns);
+		const char* errorMessage() override { return m_message.c_str(); }
+		long errorCode() override { return m_error; }
+	};
+}
+
+#endif //__DBCONN_SCATTER_H__
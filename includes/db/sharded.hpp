@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DBCONN_SHARDED_H__
+#define __DBCONN_SHARDED_H__
+
+#include <db/conn.hpp>
+
+namespace db
+{
+	// Returned by Connection::open for the `sharded' driver:
+	//
+	//   driver=sharded
+	//   shards=2
+	//   shard.0=users-0.ini       (relative to this file)
+	//   shard.1=users-1.ini
+	//   function=hash             (or range)
+	//   range.1=1000000           (lowest key of shard 1; range only)
+	//   pool=4                    (idle connections kept per shard)
+	//
+	// The statements must run on the connection of a shard; the sharded
+	// connection itself only fails with error::SHARD_KEY_REQUIRED.
+	struct ShardedConnection: Connection
+	{
+		static const size_t npos = (size_t)-1;
+
+		virtual size_t shardCount() const = 0;
+		virtual size_t shardOf(long long key) = 0;
+		// range function works only with integer keys
+		virtual size_t shardOf(const std::string& key) = 0;
+		// the connection returns to the shard's pool, rolled back, when it
+		// and every statement and cursor made from it are released
+		virtual ConnectionPtr shard(size_t index) = 0;
+
+		ConnectionPtr forKey(long long key) { return shard(shardOf(key)); }
+		ConnectionPtr forKey(const std::string& key) { return shard(shardOf(key)); }
+
+		// one connection per shard, e.g. for db::Scatter
+		std::vector<ConnectionPtr> allShards()
+		{
+			std::vector<ConnectionPtr> conns;
+			conns.reserve(shardCount());
+			for (size_t i = 0; i < shardCount(); ++i)
+				conns.push_back(shard(i));
+			return conns;
+		}
+	};
+	typedef std::shared_ptr<ShardedConnection> ShardedConnectionPtr;
+}
+
+#endif //__DBCONN_SHARDED_H__
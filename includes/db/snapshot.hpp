@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DBCONN_SNAPSHOT_H__
+#define __DBCONN_SNAPSHOT_H__
+
+#include <db/pipeline.hpp>
+#include <functional>
+
+namespace db
+{
+	struct SnapshotInfo
+	{
+		unsigned version;
+		size_t columns;
+		unsigned long long rows;
+		long long created; // seconds since the epoch
+		std::string tag;
+	};
+
+	// Fully fetched result stored in segments of rows, column by column
+	// in each segment, read back through a memory map. Texts and blobs
+	// are not copied on reading. The files follow the byte order of the
+	// machine, which wrote them.
+	class Snapshot
+	{
+	public:
+		typedef std::function<void (const CursorPtr&)> Capture;
+
+		// Reads the rest of the cursor and stores the values touched by
+		// the capture function, see snapshot<Type>(). Each segment goes
+		// to disk as soon as it is fetched. The tag names the query and
+		// its arguments; the file is synced and replaced atomically.
+		static bool write(const filesystem::path& path, const std::string& tag, const CursorPtr& c, const Capture& capture);
+
+		// Null, if the file is missing, damaged, of another version or
+		// another tag, or older than maxAge seconds (0 for any age).
+		static CursorPtr open(const filesystem::path& path, const std::string& tag, long long maxAge = 0);
+
+		static bool info(const filesystem::path& path, SnapshotInfo& info);
+	};
+
+	// Stores the columns Struct<Type> reads; get() the opened snapshot
+	// with the same Type.
+	template <typename Type>
+	bool snapshot(const filesystem::path& path, const std::string& tag, const CursorPtr& c)
+	{
+		Struct<Type> rules;
+		return Snapshot::write(path, tag, c, [&rules](const CursorPtr& recorder) { rules.capture(recorder); });
+	}
+}
+
+#endif //__DBCONN_SNAPSHOT_H__
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DBCONN_TRACING_H__
+#define __DBCONN_TRACING_H__
+
+#include <atomic>
+#include <string>
+
+namespace filesystem { class path; }
+
+namespace db
+{
+	// Identifies the caller's operation; spans recorded while it is the
+	// current one become its children
+	struct TraceContext
+	{
+		unsigned long long traceId; // 0 for none
+		unsigned long long spanId;
+		bool sampled;
+	};
+
+	struct TracerOptions
+	{
+		enum Format
+		{
+			JSON_LINES,   // a span per line
+			CHROME_TRACE  // for chrome://tracing and Perfetto
+		};
+
+		Format format;
+		double sampling;    // share of the root contexts recorded
+		size_t capacity;    // spans waiting for the export, rounded up to a power of two
+		long long interval; // ms between exports
+		TracerOptions()
+			: format(JSON_LINES)
+			, sampling(1.0)
+			, capacity(16384)
+			, interval(200)
+		{
+		}
+	};
+
+	struct TracerStats
+	{
+		unsigned long long recorded;
+		unsigned long long dropped;  // the buffer was full
+		unsigned long long exported;
+	};
+
+	// Spans are put into a lock-free ring and written to the file by
+	// a background thread. While the tracer is stopped, or the current
+	// context is not sampled, a span costs an atomic load.
+	class Tracer
+	{
+		static std::atomic<bool> s_enabled;
+	public:
+		static bool start(const filesystem::path& file, const TracerOptions& options = TracerOptions());
+		// exports what is left; called by ~environment()
+		static void stop();
+		static bool enabled() { return s_enabled.load(std::memory_order_relaxed); }
+		static TracerStats stats();
+
+		// a new trace, sampled at the configured rate
+		static TraceContext root();
+		// the context of the thread, traceId of 0 if none
+		static TraceContext current();
+
+		// makes the context current on this thread, until the scope ends
+		class Scope
+		{
+			TraceContext m_previous;
+		public:
+			explicit Scope(const TraceContext& context);
+			~Scope();
+		};
+	};
+
+	// Time from the construction to end(), a child of the current context;
+	// the spans started meanwhile on the thread are its children. The name
+	// is never copied and is read later by the export thread, so it has to
+	// be a string literal. The detail is copied by end(), cut to fit the
+	// record on a UTF-8 character boundary.
+	class Span
+	{
+		const char* m_name;
+		unsigned long long m_traceId;
+		unsigned long long m_parentId;
+		unsigned long long m_spanId;
+		long long m_start;
+		long long m_value;
+		const char* m_detail;
+		bool m_active;
+		void begin();
+	public:
+		explicit Span(const char* name, const char* detail = nullptr)
+			: m_name(name)
+			, m_value(-1)
+			, m_detail(detail)
+			, m_active(false)
+		{
+			if (Tracer::enabled())
+				begin();
+		}
+		~Span() { end(); }
+		bool active() const { return m_active; }
+		// a number shown with the span, e.g. rows fetched
+		void value(long long value) { m_value = value; }
+		void end();
+
+		// for the spans measured by hand; start is steady time in us
+		static long long now();
+		static void record(const char* name, long long start, long long duration, long long value = -1, const char* detail = nullptr);
+	};
+}
+
+#endif //__DBCONN_TRACING_H__
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __DBCONN_WRITER_H__
+#define __DBCONN_WRITER_H__
+
+#include <db/conn.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string.h>
+#include <thread>
+
+namespace db
+{
+	// Values of a single row, in the order of the writer's columns
+	class WriteRow
+	{
+		struct Cell
+		{
+			enum Kind
+			{
+				NUL,
+				INTEGER,
+				TEXT,
+				BLOB,
+				TIME
+			};
+
+			Kind kind;
+			long long value;
+			size_t offset;
+			size_t size;
+		};
+
+		std::vector<Cell> m_cells;
+		std::string m_data;
+		WriteRow& push(Cell::Kind kind, long long value, const void* data, size_t size);
+	public:
+		WriteRow& add(int value) { return push(Cell::INTEGER, value, nullptr, 0); }
+		WriteRow& add(long value) { return push(Cell::INTEGER, value, nullptr, 0); }
+		WriteRow& add(long long value) { return push(Cell::INTEGER, value, nullptr, 0); }
+		WriteRow& add(const char* value) { return value ? addText(value, strlen(value)) : addNull(); }
+		WriteRow& add(const std::string& value) { return addText(value.c_str(), value.length()); }
+		WriteRow& addText(const char* value, size_t length) { return push(Cell::TEXT, 0, value, length); }
+		WriteRow& addBlob(const void* value, size_t size) { return push(Cell::BLOB, 0, value, size); }
+		WriteRow& addTime(tyme::time_t value) { return push(Cell::TIME, value, nullptr, 0); }
+		WriteRow& addNull() { return push(Cell::NUL, 0, nullptr, 0); }
+		size_t size() const { return m_cells.size(); }
+		void clear() { m_cells.clear(); m_data.clear(); }
+
+		// binds the values as arguments first, first + 1, ...; the
+		// statement refers to the row's memory until it is executed
+		bool bind(const StatementPtr& stmt, int first) const;
+	};
+
+	struct WriterOptions
+	{
+		enum Overflow
+		{
+			DROP,  // write() returns false at once
+			BLOCK  // write() waits for the next flush
+		};
+
+		size_t batchRows;   // rows in a single INSERT, up to 65535 arguments; a full batch is flushed at once
+		long long interval; // ms between flushes of an incomplete batch
+		size_t capacity;    // rows waiting for the flush
+		Overflow overflow;
+		WriterOptions()
+			: batchRows(256)
+			, interval(1000)
+			, capacity(65536)
+			, overflow(DROP)
+		{
+		}
+	};
+
+	struct WriterStats
+	{
+		size_t depth;                  // rows waiting right now
+		unsigned long long accepted;
+		unsigned long long dropped;    // by the overflow policy or after close(), even if accepted
+		unsigned long long written;
+		unsigned long long failed;     // rows of the batches the server refused
+		unsigned long long flushes;
+		long long flushTotal;          // microseconds spent in the INSERTs
+		long long flushMax;
+		double averageFlush() const { return flushes ? (double)flushTotal / flushes : 0.0; }
+	};
+
+	class WriteBehind;
+	typedef std::shared_ptr<WriteBehind> WriteBehindPtr;
+
+	// Fire-and-forget INSERTs. The rows are queued without locking and
+	// written by a background thread in multi-row INSERTs on a connection
+	// of its own; the connection must not be used by anybody else. A row
+	// refused by the server is counted and forgotten. The writers still
+	// open, when db::environment goes away, are flushed and closed first.
+	class WriteBehind: public ErrorReporter
+	{
+		struct Node
+		{
+			std::atomic<Node*> next;
+			WriteRow row;
+			Node(): next(nullptr) {}
+		};
+
+		ConnectionPtr m_conn;
+		std::string m_insert;
+		size_t m_columns;
+		WriterOptions m_options;
+
+		// producers swap the head, the flusher follows the tail
+		std::atomic<Node*> m_head;
+		Node* m_tail;
+		Node m_stub;
+		std::atomic<size_t> m_depth;
+		std::atomic<size_t> m_blocked;
+		std::atomic<bool> m_closed;
+		std::atomic<unsigned long long> m_accepted;
+		std::atomic<unsigned long long> m_dropped;
+
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::condition_variable m_space;
+		std::condition_variable m_drained;
+		unsigned long long m_flushRequested;
+		unsigned long long m_flushServed;
+		bool m_stopped;
+		std::thread m_thread;
+
+		StatementPtr m_full;
+		unsigned long long m_written;
+		unsigned long long m_failed;
+		unsigned long long m_flushes;
+		long long m_flushTotal;
+		long long m_flushMax;
+		long m_error;
+		std::string m_message;
+
+		bool push(Node* node);
+		bool pop(WriteRow& row);
+		void dropQueued();
+		void run();
+		bool insert(const std::vector<WriteRow>& batch, StatementPtr& stmt);
+		void flush(std::vector<WriteRow>& batch);
+	public:
+		WriteBehind(const ConnectionPtr& conn, const std::string& table, const std::vector<std::string>& columns, const WriterOptions& options = WriterOptions());
+		~WriteBehind();
+
+		// null, if the flushing thread could not be started
+		static WriteBehindPtr create(const ConnectionPtr& conn, const std::string& table, const std::vector<std::string>& columns, const WriterOptions& options = WriterOptions());
+
+		// false, if the row was dropped or does not match the columns
+		bool write(WriteRow&& row);
+		bool write(const WriteRow& row) { return write(WriteRow(row)); }
+
+		// waits until the rows queued so far are written
+		void flush();
+		// writes what is queued and stops the thread; later rows are dropped
+		void close();
+		WriterStats stats();
+
+		// called by ~environment()
+		static void closeAll();
+
+		const char* errorMessage() override { return m_message.c_str(); }
+		long errorCode() override { return m_error; }
+	};
+}
+
+#endif //__DBCONN_WRITER_H__
@@ -0,0 +1,324 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include <db/admission.hpp>
+#include <db/conn.hpp>
+#include <db/tracing.hpp>
+#include <chrono>
+
+namespace db
+{
+	static thread_local AdmissionController::Priority s_priority = AdmissionController::NORMAL;
+
+	AdmissionController::Scope::Scope(Priority priority)
+		: m_previous(s_priority)
+	{
+		s_priority = priority;
+	}
+
+	AdmissionController::Scope::~Scope()
+	{
+		s_priority = m_previous;
+	}
+
+	AdmissionController::Priority AdmissionController::current()
+	{
+		return s_priority;
+	}
+
+	AdmissionController::Ticket::Ticket(const AdmissionControllerPtr& owner, Priority priority)
+		: m_owner(owner)
+		, m_start(0)
+		, m_error(0)
+		, m_probe(false)
+		, m_done(!owner)
+	{
+		if (!m_owner)
+			return;
+
+		{
+			Span span("pool.wait");
+			m_error = m_owner->acquire(priority, m_probe);
+		}
+		m_done = m_error != 0;
+		m_start = now();
+	}
+
+	AdmissionController::Ticket::~Ticket()
+	{
+		if (m_done)
+			return;
+		m_done = true;
+		m_owner->abandon(m_probe);
+	}
+
+	const char* AdmissionController::Ticket::message() const
+	{
+		switch (m_error)
+		{
+		case 0: return "";
+		case error::CIRCUIT_OPEN: return "Database circuit breaker is open";
+		default: break;
+		}
+		return "Database is overloaded";
+	}
+
+	void AdmissionController::Ticket::done(bool failed)
+	{
+		if (m_done)
+			return;
+		m_done = true;
+		m_owner->release(now() - m_start, failed, m_probe);
+	}
+
+	AdmissionController::AdmissionController(const AdmissionConfig& config)
+		: m_config(config)
+		, m_limit((double)config.initialLimit)
+		, m_inflight(0)
+		, m_bestLatency(0)
+		, m_latency(0)
+		, m_lastDecrease(0)
+		, m_admitted(0)
+		, m_rejected(0)
+		, m_breaker(CLOSED)
+		, m_openedAt(0)
+		, m_probing(false)
+		, m_outcomes(config.breakerWindow ? config.breakerWindow : 1, 0)
+		, m_nextOutcome(0)
+		, m_samples(0)
+		, m_failures(0)
+	{
+		if (m_config.minLimit < 1)
+			m_config.minLimit = 1;
+		if (m_config.maxLimit < m_config.minLimit)
+			m_config.maxLimit = m_config.minLimit;
+		if (m_limit < m_config.minLimit)
+			m_limit = (double)m_config.minLimit;
+		if (m_limit > m_config.maxLimit)
+			m_limit = (double)m_config.maxLimit;
+	}
+
+	AdmissionControllerPtr AdmissionController::named(const std::string& name, const AdmissionConfig& config)
+	{
+		static std::mutex mutex;
+		static std::map<std::string, std::weak_ptr<AdmissionController>> controllers;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		auto controller = controllers[name].lock();
+		if (!controller)
+		{
+			controller = std::make_shared<AdmissionController>(config);
+			controllers[name] = controller;
+		}
+		return controller;
+	}
+
+	AdmissionStats AdmissionController::stats()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		AdmissionStats stats = {};
+		stats.limit = m_limit;
+		stats.inflight = m_inflight;
+		for (auto&& queue : m_queues)
+			stats.queued += queue.size();
+		stats.admitted = m_admitted;
+		stats.rejected = m_rejected;
+		stats.open = m_breaker != CLOSED;
+		return stats;
+	}
+
+	long long AdmissionController::now()
+	{
+		using namespace std::chrono;
+		return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	long AdmissionController::acquire(Priority priority, bool& probe)
+	{
+		if (priority < HIGH || priority >= PRIORITY_COUNT)
+			priority = NORMAL;
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		if (m_breaker == OPEN && now() - m_openedAt >= m_config.breakerCooldown * 1000)
+			m_breaker = HALF_OPEN;
+
+		if (m_breaker == HALF_OPEN && !m_probing)
+		{
+			m_probing = probe = true;
+			++m_inflight;
+			++m_admitted;
+			return 0;
+		}
+
+		if (m_breaker != CLOSED)
+		{
+			++m_rejected;
+			return error::CIRCUIT_OPEN;
+		}
+
+		if (m_inflight < (size_t)m_limit && !waiting(priority))
+		{
+			++m_inflight;
+			++m_admitted;
+			return 0;
+		}
+
+		auto& queue = m_queues[priority];
+		if (queue.size() >= m_config.queueSize)
+		{
+			++m_rejected;
+			return error::OVERLOADED;
+		}
+
+		Waiter waiter = { false };
+		queue.push_back(&waiter);
+		if (!m_wake.wait_for(lock, std::chrono::milliseconds(m_config.maxWait), [&waiter] { return waiter.granted; }))
+		{
+			queue.erase(std::find(queue.begin(), queue.end(), &waiter));
+			++m_rejected;
+			return error::OVERLOADED;
+		}
+
+		++m_admitted;
+		return 0;
+	}
+
+	void AdmissionController::release(long long latency, bool failed, bool probe)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		long long at = now();
+		--m_inflight;
+
+		if (probe)
+		{
+			m_probing = false;
+			if (failed)
+			{
+				m_breaker = OPEN;
+				m_openedAt = at;
+			}
+			else
+			{
+				m_breaker = CLOSED;
+				std::fill(m_outcomes.begin(), m_outcomes.end(), 0);
+				m_samples = m_failures = 0;
+			}
+		}
+		else
+			record(failed, at);
+
+		adapt(latency, failed, at);
+		grant();
+	}
+
+	void AdmissionController::abandon(bool probe)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		--m_inflight;
+
+		// still half-open, the next call becomes the probe
+		if (probe)
+			m_probing = false;
+
+		grant();
+	}
+
+	bool AdmissionController::waiting(Priority priority) const
+	{
+		for (int p = HIGH; p <= priority; ++p)
+		{
+			if (!m_queues[p].empty())
+				return true;
+		}
+		return false;
+	}
+
+	void AdmissionController::grant()
+	{
+		bool granted = false;
+		for (auto&& queue : m_queues)
+		{
+			while (!queue.empty() && m_inflight < (size_t)m_limit)
+			{
+				queue.front()->granted = true;
+				queue.pop_front();
+				++m_inflight;
+				granted = true;
+			}
+		}
+
+		if (granted)
+			m_wake.notify_all();
+	}
+
+	void AdmissionController::adapt(long long latency, bool failed, long long at)
+	{
+		double sample = latency > 0 ? (double)latency : 1.0;
+
+		// let the best latency drift up, so the controller follows a lasting change of the load
+		m_bestLatency = m_bestLatency == 0 || sample < m_bestLatency ? sample : m_bestLatency * 1.001;
+		m_latency = m_latency == 0 ? sample : m_latency * 0.9 + sample * 0.1;
+
+		if (failed || m_latency > m_bestLatency * m_config.tolerance)
+		{
+			// once per round trip, the calls already in flight do not know about the cut yet
+			if (at - m_lastDecrease >= (long long)m_latency)
+			{
+				m_limit *= m_config.backoff;
+				if (m_limit < m_config.minLimit)
+					m_limit = (double)m_config.minLimit;
+				m_lastDecrease = at;
+			}
+		}
+		else
+		{
+			m_limit += 1.0 / m_limit;
+			if (m_limit > m_config.maxLimit)
+				m_limit = (double)m_config.maxLimit;
+		}
+	}
+
+	void AdmissionController::record(bool failed, long long at)
+	{
+		if (m_breaker != CLOSED)
+			return;
+
+		char& slot = m_outcomes[m_nextOutcome];
+		if (m_samples == m_outcomes.size())
+			m_failures -= slot;
+		else
+			++m_samples;
+		slot = failed ? 1 : 0;
+		m_failures += slot;
+		m_nextOutcome = (m_nextOutcome + 1) % m_outcomes.size();
+
+		if (m_failures && m_samples >= m_config.breakerSamples && m_failures >= m_config.breakerRate * m_samples)
+		{
+			m_breaker = OPEN;
+			m_openedAt = at;
+		}
+	}
+}
@@ -0,0 +1,621 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include <db/batch.hpp>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+#if !defined(DB_NO_SIMD) && defined(__AVX2__)
+#	define DB_SIMD_AVX2
+#	include <immintrin.h>
+#elif !defined(DB_NO_SIMD) && defined(__SSE4_2__)
+#	define DB_SIMD_SSE
+#	include <nmmintrin.h>
+#endif
+
+namespace db
+{
+	size_t ColumnBatch::define(int column, BatchColumn::Type type)
+	{
+		BatchColumn def;
+		def.column = column;
+		def.type = type;
+		m_columns.push_back(def);
+		m_rows = 0;
+		for (auto&& col : m_columns)
+		{
+			col.ints.clear();
+			col.reals.clear();
+			col.nulls.clear();
+		}
+		return m_columns.size() - 1;
+	}
+
+	size_t ColumnBatch::fill(const CursorPtr& c, size_t maxRows)
+	{
+		// written in place and cut down to the rows read at the end
+		for (auto&& col : m_columns)
+		{
+			if (col.type == BatchColumn::REAL)
+				col.reals.resize(maxRows);
+			else
+				col.ints.resize(maxRows);
+			col.nulls.resize(maxRows);
+		}
+
+		Cursor& cursor = *c;
+		BatchColumn* columns = m_columns.empty() ? nullptr : &m_columns[0];
+		bool direct = true;
+		size_t rows = 0;
+		while (rows < maxRows && cursor.next())
+		{
+			// the driver's own copy, while it manages; the getters otherwise
+			if (direct)
+				direct = cursor.copyRow(columns, m_columns.size(), rows);
+			if (direct)
+			{
+				++rows;
+				continue;
+			}
+
+			for (auto&& col : m_columns)
+			{
+				bool null = cursor.isNull(col.column);
+				col.nulls[rows] = null ? 0xFF : 0;
+				switch (col.type)
+				{
+				case BatchColumn::INTEGER: col.ints[rows] = null ? 0 : cursor.getLongLong(col.column); break;
+				case BatchColumn::REAL: col.reals[rows] = null ? 0 : cursor.getDouble(col.column); break;
+				case BatchColumn::TIMESTAMP: col.ints[rows] = null ? 0 : (long long)cursor.getTimestamp(col.column); break;
+				}
+			}
+			++rows;
+		}
+
+		for (auto&& col : m_columns)
+		{
+			if (col.type == BatchColumn::REAL)
+				col.reals.resize(rows);
+			else
+				col.ints.resize(rows);
+			col.nulls.resize(rows);
+		}
+		m_rows = rows;
+		return m_rows;
+	}
+
+	bool ColumnBatch::project(const Selection& selection, const std::vector<size_t>& columns, ColumnBatch& out) const
+	{
+		if (selection.size() != m_rows)
+			return false;
+
+		out.m_columns.clear();
+		out.m_rows = countSelected(selection);
+		for (auto index : columns)
+		{
+			if (index >= m_columns.size())
+				return false;
+
+			const BatchColumn& src = m_columns[index];
+			BatchColumn dst;
+			dst.column = src.column;
+			dst.type = src.type;
+			dst.nulls.reserve(out.m_rows);
+			if (src.type == BatchColumn::REAL)
+				dst.reals.reserve(out.m_rows);
+			else
+				dst.ints.reserve(out.m_rows);
+
+			for (size_t row = 0; row < m_rows; ++row)
+			{
+				if (!selection[row])
+					continue;
+				dst.nulls.push_back(src.nulls[row]);
+				if (src.type == BatchColumn::REAL)
+					dst.reals.push_back(src.reals[row]);
+				else
+					dst.ints.push_back(src.ints[row]);
+			}
+			out.m_columns.push_back(std::move(dst));
+		}
+		return true;
+	}
+
+	size_t countSelected(const Selection& selection)
+	{
+		size_t count = 0;
+		for (auto selected : selection)
+			count += selected & 1;
+		return count;
+	}
+
+	namespace
+	{
+		// 4 bits of a lane mask as 4 bytes of a selection
+		static const uint32_t expand[16] = {
+			0x00000000, 0x000000FF, 0x0000FF00, 0x0000FFFF,
+			0x00FF0000, 0x00FF00FF, 0x00FFFF00, 0x00FFFFFF,
+			0xFF000000, 0xFF0000FF, 0xFF00FF00, 0xFF00FFFF,
+			0xFFFF0000, 0xFFFF00FF, 0xFFFFFF00, 0xFFFFFFFF
+		};
+
+		static const unsigned bitCount[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+		// without branches, which the random outcomes would mispredict
+		template <typename Value, typename Test>
+		inline void keep(const Value* values, const unsigned char* nulls, size_t row, size_t rows, Test test, unsigned char* selection)
+		{
+			for (; row < rows; ++row)
+				selection[row] &= ~nulls[row] & (unsigned char)-(int)test(values[row]);
+		}
+
+		template <typename Value>
+		inline void addRest(const Value* values, const unsigned char* nulls, const unsigned char* selection, size_t row, size_t rows, Aggregate<Value>& out)
+		{
+			Value sum = 0, min = out.min, max = out.max;
+			unsigned long long count = 0;
+			for (; row < rows; ++row)
+			{
+				// picked by the index; a condition would be compiled into a branch again
+				size_t live = selection[row] & ~nulls[row] & 1;
+				const Value sums[2] = { 0, values[row] };
+				const Value lows[2] = { std::numeric_limits<Value>::max(), values[row] };
+				const Value highs[2] = { std::numeric_limits<Value>::lowest(), values[row] };
+				count += live;
+				sum += sums[live];
+				min = lows[live] < min ? lows[live] : min;
+				max = highs[live] > max ? highs[live] : max;
+			}
+			out.count += count;
+			out.sum += sum;
+			out.min = min;
+			out.max = max;
+		}
+
+		// the rows from row on, one by one
+		template <typename Value>
+		void filterRest(const Value* values, const unsigned char* nulls, size_t row, size_t rows, Compare op, Value operand, unsigned char* selection)
+		{
+			switch (op)
+			{
+			case LT: keep(values, nulls, row, rows, [operand](Value value) { return value < operand; }, selection); break;
+			case LE: keep(values, nulls, row, rows, [operand](Value value) { return value <= operand; }, selection); break;
+			case EQ: keep(values, nulls, row, rows, [operand](Value value) { return value == operand; }, selection); break;
+			case NE: keep(values, nulls, row, rows, [operand](Value value) { return value != operand; }, selection); break;
+			case GE: keep(values, nulls, row, rows, [operand](Value value) { return value >= operand; }, selection); break;
+			case GT: keep(values, nulls, row, rows, [operand](Value value) { return value > operand; }, selection); break;
+			}
+		}
+
+		// selected and not NULL, for `lanes' rows starting at row; the
+		// lanes are 2 or 4
+		inline uint32_t live(const unsigned char* selection, const unsigned char* nulls, size_t row, size_t lanes)
+		{
+			uint32_t sel = 0, null = 0;
+			memcpy(&sel, selection + row, lanes);
+			memcpy(&null, nulls + row, lanes);
+			return sel & ~null;
+		}
+
+		inline void narrow(unsigned char* selection, size_t row, size_t lanes, uint32_t keep)
+		{
+			uint32_t sel = 0;
+			memcpy(&sel, selection + row, lanes);
+			sel &= keep;
+			memcpy(selection + row, &sel, lanes);
+		}
+
+#if defined(DB_SIMD_AVX2) || defined(DB_SIMD_SSE)
+		// the rows done with SIMD; the caller goes through the rest
+		size_t filterInts(const long long* values, const unsigned char* nulls, size_t rows, Compare op, long long operand, unsigned char* selection)
+		{
+			// a > b, b > a or a == b, possibly negated
+			bool equal = op == EQ || op == NE;
+			bool swap = op == LT || op == GE;
+			bool negate = op == LE || op == GE || op == NE;
+			size_t row = 0;
+#if defined(DB_SIMD_AVX2)
+			__m256i b = _mm256_set1_epi64x(operand);
+			for (; row + 4 <= rows; row += 4)
+			{
+				__m256i a = _mm256_loadu_si256((const __m256i*)(values + row));
+				__m256i r = equal ? _mm256_cmpeq_epi64(a, b) : swap ? _mm256_cmpgt_epi64(b, a) : _mm256_cmpgt_epi64(a, b);
+				int bits = _mm256_movemask_pd(_mm256_castsi256_pd(r));
+				if (negate)
+					bits ^= 0xF;
+				narrow(selection, row, 4, live(selection, nulls, row, 4) & expand[bits]);
+			}
+#elif defined(DB_SIMD_SSE)
+			__m128i b = _mm_set1_epi64x(operand);
+			for (; row + 2 <= rows; row += 2)
+			{
+				__m128i a = _mm_loadu_si128((const __m128i*)(values + row));
+				__m128i r = equal ? _mm_cmpeq_epi64(a, b) : swap ? _mm_cmpgt_epi64(b, a) : _mm_cmpgt_epi64(a, b);
+				int bits = _mm_movemask_pd(_mm_castsi128_pd(r));
+				if (negate)
+					bits ^= 0x3;
+				narrow(selection, row, 2, live(selection, nulls, row, 2) & expand[bits]);
+			}
+#endif
+			return row;
+		}
+#else
+		size_t filterInts(const long long*, const unsigned char*, size_t, Compare, long long, unsigned char*)
+		{
+			return 0;
+		}
+#endif
+
+#if defined(DB_SIMD_AVX2)
+		template <int Predicate>
+		size_t filterRealsWith(const double* values, const unsigned char* nulls, size_t rows, double operand, unsigned char* selection)
+		{
+			__m256d b = _mm256_set1_pd(operand);
+			size_t row = 0;
+			for (; row + 4 <= rows; row += 4)
+			{
+				__m256d a = _mm256_loadu_pd(values + row);
+				int bits = _mm256_movemask_pd(_mm256_cmp_pd(a, b, Predicate));
+				narrow(selection, row, 4, live(selection, nulls, row, 4) & expand[bits]);
+			}
+			return row;
+		}
+
+		size_t filterReals(const double* values, const unsigned char* nulls, size_t rows, Compare op, double operand, unsigned char* selection)
+		{
+			// ordered, like the scalar operators, but for NE
+			switch (op)
+			{
+			case LT: return filterRealsWith<_CMP_LT_OQ>(values, nulls, rows, operand, selection);
+			case LE: return filterRealsWith<_CMP_LE_OQ>(values, nulls, rows, operand, selection);
+			case EQ: return filterRealsWith<_CMP_EQ_OQ>(values, nulls, rows, operand, selection);
+			case NE: return filterRealsWith<_CMP_NEQ_UQ>(values, nulls, rows, operand, selection);
+			case GE: return filterRealsWith<_CMP_GE_OQ>(values, nulls, rows, operand, selection);
+			case GT: return filterRealsWith<_CMP_GT_OQ>(values, nulls, rows, operand, selection);
+			}
+			return 0;
+		}
+#elif defined(DB_SIMD_SSE)
+		size_t filterReals(const double* values, const unsigned char* nulls, size_t rows, Compare op, double operand, unsigned char* selection)
+		{
+			__m128d b = _mm_set1_pd(operand);
+			size_t row = 0;
+			for (; row + 2 <= rows; row += 2)
+			{
+				__m128d a = _mm_loadu_pd(values + row);
+				__m128d r;
+				switch (op)
+				{
+				case LT: r = _mm_cmplt_pd(a, b); break;
+				case LE: r = _mm_cmple_pd(a, b); break;
+				case EQ: r = _mm_cmpeq_pd(a, b); break;
+				case NE: r = _mm_cmpneq_pd(a, b); break;
+				case GE: r = _mm_cmpge_pd(a, b); break;
+				default: r = _mm_cmpgt_pd(a, b); break;
+				}
+				int bits = _mm_movemask_pd(r);
+				narrow(selection, row, 2, live(selection, nulls, row, 2) & expand[bits]);
+			}
+			return row;
+		}
+#else
+		size_t filterReals(const double*, const unsigned char*, size_t, Compare, double, unsigned char*)
+		{
+			return 0;
+		}
+#endif
+
+#if defined(DB_SIMD_AVX2) || defined(DB_SIMD_SSE)
+		size_t aggregateInts(const long long* values, const unsigned char* nulls, const unsigned char* selection, size_t rows, IntAggregate& out)
+		{
+			size_t row = 0;
+#if defined(DB_SIMD_AVX2)
+			__m256i sum = _mm256_setzero_si256();
+			__m256i min = _mm256_set1_epi64x(out.min);
+			__m256i max = _mm256_set1_epi64x(out.max);
+			__m256i highest = _mm256_set1_epi64x(std::numeric_limits<long long>::max());
+			__m256i lowest = _mm256_set1_epi64x(std::numeric_limits<long long>::lowest());
+			for (; row + 4 <= rows; row += 4)
+			{
+				uint32_t bytes = live(selection, nulls, row, 4);
+				if (!bytes)
+					continue;
+				__m256i lanes = _mm256_cvtepi8_epi64(_mm_cvtsi32_si128((int)bytes));
+				__m256i a = _mm256_loadu_si256((const __m256i*)(values + row));
+				sum = _mm256_add_epi64(sum, _mm256_and_si256(a, lanes));
+				__m256i low = _mm256_blendv_epi8(highest, a, lanes);
+				min = _mm256_blendv_epi8(min, low, _mm256_cmpgt_epi64(min, low));
+				__m256i high = _mm256_blendv_epi8(lowest, a, lanes);
+				max = _mm256_blendv_epi8(max, high, _mm256_cmpgt_epi64(high, max));
+				out.count += bitCount[_mm256_movemask_pd(_mm256_castsi256_pd(lanes))];
+			}
+			long long sums[4], mins[4], maxs[4];
+			_mm256_storeu_si256((__m256i*)sums, sum);
+			_mm256_storeu_si256((__m256i*)mins, min);
+			_mm256_storeu_si256((__m256i*)maxs, max);
+			for (int i = 0; i < 4; ++i)
+			{
+				out.sum += sums[i];
+				if (mins[i] < out.min) out.min = mins[i];
+				if (maxs[i] > out.max) out.max = maxs[i];
+			}
+#elif defined(DB_SIMD_SSE)
+			__m128i sum = _mm_setzero_si128();
+			__m128i min = _mm_set1_epi64x(out.min);
+			__m128i max = _mm_set1_epi64x(out.max);
+			__m128i highest = _mm_set1_epi64x(std::numeric_limits<long long>::max());
+			__m128i lowest = _mm_set1_epi64x(std::numeric_limits<long long>::lowest());
+			for (; row + 2 <= rows; row += 2)
+			{
+				uint32_t bytes = live(selection, nulls, row, 2);
+				if (!bytes)
+					continue;
+				__m128i lanes = _mm_cvtepi8_epi64(_mm_cvtsi32_si128((int)bytes));
+				__m128i a = _mm_loadu_si128((const __m128i*)(values + row));
+				sum = _mm_add_epi64(sum, _mm_and_si128(a, lanes));
+				__m128i low = _mm_blendv_epi8(highest, a, lanes);
+				min = _mm_blendv_epi8(min, low, _mm_cmpgt_epi64(min, low));
+				__m128i high = _mm_blendv_epi8(lowest, a, lanes);
+				max = _mm_blendv_epi8(max, high, _mm_cmpgt_epi64(high, max));
+				out.count += bitCount[_mm_movemask_pd(_mm_castsi128_pd(lanes))];
+			}
+			long long sums[2], mins[2], maxs[2];
+			_mm_storeu_si128((__m128i*)sums, sum);
+			_mm_storeu_si128((__m128i*)mins, min);
+			_mm_storeu_si128((__m128i*)maxs, max);
+			for (int i = 0; i < 2; ++i)
+			{
+				out.sum += sums[i];
+				if (mins[i] < out.min) out.min = mins[i];
+				if (maxs[i] > out.max) out.max = maxs[i];
+			}
+#endif
+			return row;
+		}
+#else
+		size_t aggregateInts(const long long*, const unsigned char*, const unsigned char*, size_t, IntAggregate&)
+		{
+			return 0;
+		}
+#endif
+
+#if defined(DB_SIMD_AVX2) || defined(DB_SIMD_SSE)
+		size_t aggregateReals(const double* values, const unsigned char* nulls, const unsigned char* selection, size_t rows, RealAggregate& out)
+		{
+			size_t row = 0;
+#if defined(DB_SIMD_AVX2)
+			__m256d sum = _mm256_setzero_pd();
+			__m256d min = _mm256_set1_pd(out.min);
+			__m256d max = _mm256_set1_pd(out.max);
+			__m256d highest = _mm256_set1_pd(std::numeric_limits<double>::max());
+			__m256d lowest = _mm256_set1_pd(std::numeric_limits<double>::lowest());
+			for (; row + 4 <= rows; row += 4)
+			{
+				uint32_t bytes = live(selection, nulls, row, 4);
+				if (!bytes)
+					continue;
+				__m256d lanes = _mm256_castsi256_pd(_mm256_cvtepi8_epi64(_mm_cvtsi32_si128((int)bytes)));
+				__m256d a = _mm256_loadu_pd(values + row);
+				sum = _mm256_add_pd(sum, _mm256_and_pd(a, lanes));
+				min = _mm256_min_pd(min, _mm256_blendv_pd(highest, a, lanes));
+				max = _mm256_max_pd(max, _mm256_blendv_pd(lowest, a, lanes));
+				out.count += bitCount[_mm256_movemask_pd(lanes)];
+			}
+			double sums[4], mins[4], maxs[4];
+			_mm256_storeu_pd(sums, sum);
+			_mm256_storeu_pd(mins, min);
+			_mm256_storeu_pd(maxs, max);
+			for (int i = 0; i < 4; ++i)
+			{
+				out.sum += sums[i];
+				if (mins[i] < out.min) out.min = mins[i];
+				if (maxs[i] > out.max) out.max = maxs[i];
+			}
+#elif defined(DB_SIMD_SSE)
+			__m128d sum = _mm_setzero_pd();
+			__m128d min = _mm_set1_pd(out.min);
+			__m128d max = _mm_set1_pd(out.max);
+			__m128d highest = _mm_set1_pd(std::numeric_limits<double>::max());
+			__m128d lowest = _mm_set1_pd(std::numeric_limits<double>::lowest());
+			for (; row + 2 <= rows; row += 2)
+			{
+				uint32_t bytes = live(selection, nulls, row, 2);
+				if (!bytes)
+					continue;
+				__m128d lanes = _mm_castsi128_pd(_mm_cvtepi8_epi64(_mm_cvtsi32_si128((int)bytes)));
+				__m128d a = _mm_loadu_pd(values + row);
+				sum = _mm_add_pd(sum, _mm_and_pd(a, lanes));
+				min = _mm_min_pd(min, _mm_blendv_pd(highest, a, lanes));
+				max = _mm_max_pd(max, _mm_blendv_pd(lowest, a, lanes));
+				out.count += bitCount[_mm_movemask_pd(lanes)];
+			}
+			double sums[2], mins[2], maxs[2];
+			_mm_storeu_pd(sums, sum);
+			_mm_storeu_pd(mins, min);
+			_mm_storeu_pd(maxs, max);
+			for (int i = 0; i < 2; ++i)
+			{
+				out.sum += sums[i];
+				if (mins[i] < out.min) out.min = mins[i];
+				if (maxs[i] > out.max) out.max = maxs[i];
+			}
+#endif
+			return row;
+		}
+#else
+		size_t aggregateReals(const double*, const unsigned char*, const unsigned char*, size_t, RealAggregate&)
+		{
+			return 0;
+		}
+#endif
+	}
+
+	bool filter(const ColumnBatch& batch, size_t column, Compare op, long long operand, Selection& selection)
+	{
+		if (column >= batch.columns() || selection.size() != batch.rows())
+			return false;
+
+		const BatchColumn& col = batch.column(column);
+		if (col.type == BatchColumn::REAL)
+			return false;
+
+		size_t rows = batch.rows();
+		size_t row = filterInts(col.ints.data(), col.nulls.data(), rows, op, operand, selection.data());
+		filterRest(col.ints.data(), col.nulls.data(), row, rows, op, operand, selection.data());
+		return true;
+	}
+
+	bool filter(const ColumnBatch& batch, size_t column, Compare op, double operand, Selection& selection)
+	{
+		if (column >= batch.columns() || selection.size() != batch.rows())
+			return false;
+
+		const BatchColumn& col = batch.column(column);
+		if (col.type != BatchColumn::REAL)
+			return false;
+
+		size_t rows = batch.rows();
+		size_t row = filterReals(col.reals.data(), col.nulls.data(), rows, op, operand, selection.data());
+		filterRest(col.reals.data(), col.nulls.data(), row, rows, op, operand, selection.data());
+		return true;
+	}
+
+	bool aggregate(const ColumnBatch& batch, size_t column, const Selection& selection, IntAggregate& out)
+	{
+		if (column >= batch.columns() || selection.size() != batch.rows())
+			return false;
+
+		const BatchColumn& col = batch.column(column);
+		if (col.type == BatchColumn::REAL)
+			return false;
+
+		// kept apart from out, which the compiler would reload after each byte read
+		IntAggregate local;
+		size_t rows = batch.rows();
+		size_t row = aggregateInts(col.ints.data(), col.nulls.data(), selection.data(), rows, local);
+		addRest(col.ints.data(), col.nulls.data(), selection.data(), row, rows, local);
+		out.merge(local);
+		return true;
+	}
+
+	bool aggregate(const ColumnBatch& batch, size_t column, const Selection& selection, RealAggregate& out)
+	{
+		if (column >= batch.columns() || selection.size() != batch.rows())
+			return false;
+
+		const BatchColumn& col = batch.column(column);
+		if (col.type != BatchColumn::REAL)
+			return false;
+
+		// kept apart from out, which the compiler would reload after each byte read
+		RealAggregate local;
+		size_t rows = batch.rows();
+		size_t row = aggregateReals(col.reals.data(), col.nulls.data(), selection.data(), rows, local);
+		addRest(col.reals.data(), col.nulls.data(), selection.data(), row, rows, local);
+		out.merge(local);
+		return true;
+	}
+
+	template <typename Value>
+	void GroupBy<Value>::grow()
+	{
+		size_t size = m_slots.empty() ? 64 : m_slots.size() * 2;
+		std::vector<unsigned> slots(size, 0);
+		size_t mask = size - 1;
+		for (size_t index = 0; index < m_groupKeys.size(); ++index)
+		{
+			size_t slot = (size_t)(((unsigned long long)m_groupKeys[index] * 0x9E3779B97F4A7C15ULL) >> 17) & mask;
+			while (slots[slot])
+				slot = (slot + 1) & mask;
+			slots[slot] = (unsigned)index + 1;
+		}
+		m_slots.swap(slots);
+	}
+
+	template <typename Value>
+	Aggregate<Value>& GroupBy<Value>::group(long long key)
+	{
+		// at most half full
+		if ((m_groups.size() + 1) * 2 > m_slots.size())
+			grow();
+
+		size_t mask = m_slots.size() - 1;
+		size_t slot = (size_t)(((unsigned long long)key * 0x9E3779B97F4A7C15ULL) >> 17) & mask;
+		while (m_slots[slot])
+		{
+			unsigned index = m_slots[slot] - 1;
+			if (m_groupKeys[index] == key)
+				return m_groups[index];
+			slot = (slot + 1) & mask;
+		}
+
+		m_slots[slot] = (unsigned)m_groups.size() + 1;
+		m_groupKeys.push_back(key);
+		m_groups.push_back(Aggregate<Value>());
+		return m_groups.back();
+	}
+
+	template <typename Value>
+	static inline Value valueAt(const BatchColumn& col, size_t row);
+
+	template <>
+	inline long long valueAt<long long>(const BatchColumn& col, size_t row) { return col.ints[row]; }
+
+	template <>
+	inline double valueAt<double>(const BatchColumn& col, size_t row) { return col.reals[row]; }
+
+	template <typename Value>
+	bool GroupBy<Value>::add(const ColumnBatch& batch, size_t key, size_t value, const Selection& selection)
+	{
+		if (key >= batch.columns() || value >= batch.columns() || selection.size() != batch.rows())
+			return false;
+
+		const BatchColumn& keys = batch.column(key);
+		const BatchColumn& values = batch.column(value);
+		if (keys.type == BatchColumn::REAL || (values.type == BatchColumn::REAL) != std::is_same<Value, double>::value)
+			return false;
+
+		size_t rows = batch.rows();
+		for (size_t row = 0; row < rows; ++row)
+		{
+			if (!selection[row])
+				continue;
+
+			Aggregate<Value>* target = &m_nullGroup;
+			if (keys.nulls[row])
+				m_hasNulls = true;
+			else
+				target = &group(keys.ints[row]);
+
+			if (!values.nulls[row])
+				target->add(valueAt<Value>(values, row));
+		}
+		return true;
+	}
+
+	template class GroupBy<long long>;
+	template class GroupBy<double>;
+}
@@ -25,8 +25,11 @@
 #include "pch.h"
 #include <db/conn.hpp>
 #include <db/driver.hpp>
+#include <db/writer.hpp>
 #include <utils.hpp>
 #include <filesystem.hpp>
+#include <stdio.h>
+#include <cmath>
 
 namespace db
 {
@@ -73,6 +76,51 @@ namespace db
 		return driver->open(path, props);
 	}
 
+	bool Binder<double>::bind(const StatementPtr& s, int arg, double value)
+	{
+		// "inf" and "nan" are no numbers to the server
+		if (!std::isfinite(value))
+			return false;
+
+		char buffer[64];
+		int length = snprintf(buffer, sizeof(buffer), "%.17g", value);
+		if (length < 0 || (size_t)length >= sizeof(buffer))
+			return false;
+		return s->bindText(arg, buffer, length);
+	}
+
+	bool Binder<Decimal>::bind(const StatementPtr& s, int arg, const Decimal& value)
+	{
+		char buffer[64];
+		size_t length = value.format(buffer, sizeof(buffer));
+		if (!length)
+			return false;
+		return s->bindText(arg, buffer, length);
+	}
+
+	StatementPtr prepareInsert(const ConnectionPtr& conn, const char* prefix, size_t args, size_t rows)
+	{
+		if (!conn || !prefix || !args || !rows)
+			return nullptr;
+
+		std::string row = "(";
+		for (size_t i = 0; i < args; ++i)
+			row += i ? ", ?" : "?";
+		row += ")";
+
+		std::string sql = prefix;
+		sql.reserve(sql.length() + rows * (row.length() + 2) + 1);
+		sql += " ";
+		for (size_t i = 0; i < rows; ++i)
+		{
+			if (i)
+				sql += ", ";
+			sql += row;
+		}
+
+		return conn->prepare(sql.c_str());
+	}
+
 	//there is a problem with VC and global objects in LIBs...
 	namespace mysql
 	{
@@ -80,11 +128,46 @@ namespace db
 		void shutdown_driver();
 	}
 
+	namespace sharded
+	{
+		bool startup_driver();
+		void shutdown_driver();
+	}
+
+	namespace faulty
+	{
+		bool startup_driver();
+		void shutdown_driver();
+	}
+
+	namespace mux
+	{
+		bool startup_driver();
+		void shutdown_driver();
+	}
+
+	namespace record
+	{
+		bool startup_driver();
+		void shutdown_driver();
+	}
+
+	namespace traced
+	{
+		bool startup_driver();
+		void shutdown_driver();
+	}
+
 	static struct {
 		bool (*startup)();
 		void (*shutdown)();
 	} info [] = {
-		{ mysql::startup_driver, mysql::shutdown_driver }
+		{ mysql::startup_driver, mysql::shutdown_driver },
+		{ sharded::startup_driver, sharded::shutdown_driver },
+		{ faulty::startup_driver, faulty::shutdown_driver },
+		{ mux::startup_driver, mux::shutdown_driver },
+		{ record::startup_driver, record::shutdown_driver },
+		{ traced::startup_driver, traced::shutdown_driver }
 	};
 	static size_t succeeded = array_size(info);
 
@@ -103,6 +186,8 @@ namespace db
 
 	environment::~environment()
 	{
+		WriteBehind::closeAll();
+		Tracer::stop();
 		for (size_t i = succeeded; i > 0; --i)
 			info[i-1].shutdown();
 	}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include <db/conn.hpp>
+#include <limits.h>
+
+namespace db
+{
+	static const long long powers[] = {
+		1LL,
+		10LL,
+		100LL,
+		1000LL,
+		10000LL,
+		100000LL,
+		1000000LL,
+		10000000LL,
+		100000000LL,
+		1000000000LL,
+		10000000000LL,
+		100000000000LL,
+		1000000000000LL,
+		10000000000000LL,
+		100000000000000LL,
+		1000000000000000LL,
+		10000000000000000LL,
+		100000000000000000LL,
+		1000000000000000000LL
+	};
+
+	double Decimal::toDouble() const
+	{
+		if (scale < 0)
+		{
+			double value = (double)unscaled;
+			for (int i = scale; i < 0; ++i)
+				value *= 10;
+			return value;
+		}
+		if ((size_t)scale < array_size(powers))
+			return (double)unscaled / (double)powers[scale];
+		double value = (double)unscaled;
+		for (int i = 0; i < scale; ++i)
+			value /= 10;
+		return value;
+	}
+
+	bool Decimal::rescale(int target, long long& out) const
+	{
+		if (target < 0 || scale < 0)
+			return false;
+
+		if (target >= scale)
+		{
+			size_t shift = target - scale;
+			if (shift >= array_size(powers))
+			{
+				if (unscaled)
+					return false;
+				out = 0;
+				return true;
+			}
+			long long factor = powers[shift];
+			if (unscaled > LLONG_MAX / factor || unscaled < LLONG_MIN / factor)
+				return false;
+			out = unscaled * factor;
+			return true;
+		}
+
+		size_t shift = scale - target;
+		if (shift >= array_size(powers))
+		{
+			out = 0;
+			return true;
+		}
+		long long factor = powers[shift];
+		long long quotient = unscaled / factor;
+		long long remainder = unscaled % factor;
+		if (remainder >= factor - remainder)
+			++quotient;
+		else if (-remainder >= factor + remainder)
+			--quotient;
+		out = quotient;
+		return true;
+	}
+
+	bool Decimal::parse(const char* text, size_t length, Decimal& out)
+	{
+		const char* ptr = text;
+		const char* end = text + length;
+		while (ptr != end && (*ptr == ' ' || *ptr == '\t'))
+			++ptr;
+
+		bool negative = false;
+		if (ptr != end && (*ptr == '-' || *ptr == '+'))
+			negative = *ptr++ == '-';
+
+		// accumulated as a negative number, which has the larger range
+		long long value = 0;
+		int scale = 0;
+		bool digits = false;
+		bool fraction = false;
+		bool full = false;
+		for (; ptr != end; ++ptr)
+		{
+			char c = *ptr;
+			if (c == '.' && !fraction)
+			{
+				fraction = true;
+				continue;
+			}
+			if (c < '0' || c > '9')
+				break;
+
+			digits = true;
+			if (full)
+			{
+				if (!fraction)
+					return false; // too many integer digits
+				continue;
+			}
+
+			int digit = c - '0';
+			if (value < (LLONG_MIN + digit) / 10)
+			{
+				if (!fraction)
+					return false;
+
+				// the rest of the fraction is dropped, rounded half away
+				// from zero on its first digit, as rescale() does
+				if (digit >= 5)
+				{
+					if (value == LLONG_MIN)
+						return false;
+					--value;
+				}
+				full = true;
+				continue;
+			}
+
+			value = value * 10 - digit;
+			if (fraction)
+				++scale;
+		}
+
+		if (!digits || (ptr != end && *ptr))
+			return false;
+
+		if (!negative)
+		{
+			if (value == LLONG_MIN)
+				return false;
+			value = -value;
+		}
+
+		out.unscaled = value;
+		out.scale = scale;
+		return true;
+	}
+
+	size_t Decimal::format(char* buffer, size_t size) const
+	{
+		// digits, least significant first
+		char digits[40];
+		size_t count = 0;
+		unsigned long long magnitude = unscaled < 0 ? 0ULL - (unsigned long long)unscaled : (unsigned long long)unscaled;
+		do
+		{
+			digits[count++] = (char)('0' + magnitude % 10);
+			magnitude /= 10;
+		} while (magnitude);
+
+		size_t fraction = scale > 0 ? scale : 0;
+		size_t zeros = scale < 0 ? -scale : 0;
+		while (count <= fraction && count < sizeof(digits))
+			digits[count++] = '0';
+
+		size_t length = (unscaled < 0 ? 1 : 0) + count + zeros + (fraction ? 1 : 0);
+		if (count <= fraction || length >= size)
+			return 0;
+
+		char* out = buffer;
+		if (unscaled < 0)
+			*out++ = '-';
+		for (size_t i = count; i > 0; --i)
+		{
+			if (i == fraction)
+				*out++ = '.';
+			*out++ = digits[i - 1];
+		}
+		for (size_t i = 0; i < zeros; ++i)
+			*out++ = '0';
+		*out = 0;
+		return length;
+	}
+}
@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include <db/hedge.hpp>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+
+namespace db
+{
+	namespace
+	{
+		long long now()
+		{
+			using namespace std::chrono;
+			return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+		}
+
+		struct Attempt
+		{
+			StatementPtr stmt;
+			CursorPtr cursor;
+			bool started;
+			bool done;
+			bool censored; // stopped by the cancel, the latency is a lower bound
+			long error;
+			std::string message;
+			long long latency;
+		};
+
+		struct Race
+		{
+			std::string sql;
+			HedgedQuery::Binder binder;
+			std::mutex mutex;
+			std::condition_variable finished;
+			Attempt attempts[2];
+			int winner;
+			bool cancelled;
+
+			Race(const std::string& sql, const HedgedQuery::Binder& binder)
+				: sql(sql)
+				, binder(binder)
+				, winner(-1)
+				, cancelled(false)
+			{
+				for (auto&& attempt : attempts)
+				{
+					attempt.started = attempt.done = attempt.censored = false;
+					attempt.error = 0;
+					attempt.latency = 0;
+				}
+			}
+
+			bool settled()
+			{
+				return winner >= 0 || ((!attempts[0].started || attempts[0].done) && (!attempts[1].started || attempts[1].done));
+			}
+		};
+		typedef std::shared_ptr<Race> RacePtr;
+
+		void run(const RacePtr& race, int index, const ConnectionPtr& conn, StatementPtr stmt)
+		{
+			long long start = now();
+			long error = 0;
+			std::string message;
+			CursorPtr cursor;
+
+			if (!stmt)
+				stmt = conn->prepare(race->sql.c_str());
+			if (!stmt)
+			{
+				error = conn->errorCode();
+				message = conn->errorMessage();
+			}
+			else
+			{
+				bool cancelled;
+				{
+					std::lock_guard<std::mutex> lock(race->mutex);
+					race->attempts[index].stmt = stmt;
+					cancelled = race->cancelled;
+				}
+
+				if (cancelled)
+				{
+					error = error::CANCELLED;
+					message = "Statement was cancelled";
+				}
+				else if (race->binder && !race->binder(stmt))
+				{
+					error = stmt->errorCode();
+					message = stmt->errorMessage();
+				}
+				else
+				{
+					cursor = stmt->query();
+					if (!cursor)
+					{
+						error = stmt->errorCode();
+						message = stmt->errorMessage();
+					}
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(race->mutex);
+			Attempt& attempt = race->attempts[index];
+			attempt.done = true;
+			attempt.error = error;
+			attempt.message = message;
+			attempt.latency = now() - start;
+			attempt.censored = race->cancelled;
+			if (cursor && race->winner < 0)
+			{
+				attempt.cursor = cursor;
+				race->winner = index;
+			}
+			race->finished.notify_all();
+		}
+
+		bool launch(const RacePtr& race, int index, const ConnectionPtr& conn, const StatementPtr& stmt, std::thread& thread)
+		{
+			if (!conn)
+				return false;
+			try {
+				thread = std::thread(run, race, index, conn, stmt);
+			} catch (std::system_error&) { return false; }
+			race->attempts[index].started = true;
+			return true;
+		}
+	}
+
+	HedgedQuery::HedgedQuery(const std::string& sql, long long initialDelay, size_t window)
+		: m_sql(sql)
+		, m_initialDelay(initialDelay)
+		, m_nextLatency(0)
+		, m_error(0)
+	{
+		m_latencies.reserve(window ? window : 1);
+		HedgeStats empty = {};
+		m_stats = empty;
+		m_stats.delay = initialDelay;
+	}
+
+	long long HedgedQuery::delay()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_latencies.size() < 20)
+			return m_initialDelay;
+
+		std::vector<long long> sorted(m_latencies);
+		auto p95 = sorted.begin() + (sorted.size() * 95) / 100;
+		std::nth_element(sorted.begin(), p95, sorted.end());
+		return m_stats.delay = *p95;
+	}
+
+	void HedgedQuery::record(long long latency)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_latencies.size() < m_latencies.capacity())
+			m_latencies.push_back(latency);
+		else
+		{
+			m_latencies[m_nextLatency] = latency;
+			m_nextLatency = (m_nextLatency + 1) % m_latencies.size();
+		}
+	}
+
+	HedgeStats HedgedQuery::stats()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_stats;
+	}
+
+	StatementPtr HedgedQuery::prepared(const ConnectionPtr& conn)
+	{
+		// a statement still used by a cursor of an earlier call cannot
+		// run again without breaking that cursor
+		for (auto&& prepared : m_prepared)
+		{
+			if (conn && prepared.stmt && prepared.stmt.use_count() == 1 && prepared.conn.lock() == conn)
+				return prepared.stmt;
+		}
+		return nullptr;
+	}
+
+	CursorPtr HedgedQuery::query(const ConnectionPtr& first, const ConnectionPtr& second)
+	{
+		m_error = 0;
+		m_message.clear();
+
+		RacePtr race;
+		try {
+			race = std::make_shared<Race>(m_sql, m_binder);
+		} catch (std::bad_alloc&) { return nullptr; }
+
+		long long wait = delay();
+		bool hedged = false;
+		std::thread threads[2];
+		StatementPtr stmts[2] = { prepared(first), prepared(second) };
+		if (stmts[0] && stmts[0] == stmts[1])
+			stmts[1].reset(); // the same connection twice
+
+		std::unique_lock<std::mutex> lock(race->mutex);
+		if (!launch(race, 0, first, stmts[0], threads[0]))
+		{
+			hedged = launch(race, 1, second, stmts[1], threads[1]);
+		}
+		else if (!race->finished.wait_for(lock, std::chrono::milliseconds(wait), [&race] { return race->attempts[0].done; })
+			|| race->winner < 0)
+		{
+			// too slow, or failed: ask the other one
+			hedged = launch(race, 1, second, stmts[1], threads[1]);
+		}
+		stmts[0].reset();
+		stmts[1].reset();
+
+		race->finished.wait(lock, [&race] { return race->settled(); });
+
+		// the loser uses its connection until it stops; the caller may
+		// use it again as soon as the query returns
+		int winner = race->winner;
+		race->cancelled = true;
+		if (winner >= 0)
+		{
+			// a cancel, which comes before the statement has started
+			// running, is lost; it is sent again until the loser stops
+			Attempt& other = race->attempts[1 - winner];
+			while (other.started && !other.done)
+			{
+				StatementPtr loser = other.stmt;
+				lock.unlock();
+				bool stopped = loser && loser->cancel();
+				loser.reset();
+				lock.lock();
+				if (stopped)
+					break;
+				race->finished.wait_for(lock, std::chrono::milliseconds(5), [&other] { return other.done; });
+			}
+		}
+		lock.unlock();
+
+		for (auto&& thread : threads)
+		{
+			if (thread.joinable())
+				thread.join();
+		}
+
+		const ConnectionPtr* conns[2] = { &first, &second };
+		for (int i = 0; i < 2; ++i)
+		{
+			const Attempt& attempt = race->attempts[i];
+			if (!attempt.started)
+				continue;
+			m_prepared[i].conn = *conns[i];
+			m_prepared[i].stmt = !attempt.error || attempt.error == error::CANCELLED ? attempt.stmt : nullptr;
+		}
+
+		CursorPtr cursor;
+		if (winner >= 0)
+		{
+			cursor = race->attempts[winner].cursor;
+			race->attempts[winner].cursor.reset();
+			record(race->attempts[winner].latency);
+
+			// the slower answer counts, too; cut short by the cancel, it
+			// still took at least as long
+			const Attempt& other = race->attempts[1 - winner];
+			if (other.done && (other.censored || !other.error))
+				record(other.latency);
+		}
+		else
+		{
+			int last = race->attempts[1].started && race->attempts[1].error ? 1 : 0;
+			const Attempt& attempt = race->attempts[last];
+			m_error = attempt.error ? attempt.error : (long)error::SHARD_UNAVAILABLE;
+			m_message = attempt.started ? attempt.message : "No connection";
+		}
+
+		std::lock_guard<std::mutex> guard(m_mutex);
+		++m_stats.queries;
+		if (hedged)
+			++m_stats.hedged;
+		if (hedged && winner == 1)
+			++m_stats.hedgeWins;
+		if (winner < 0)
+			++m_stats.failed;
+
+		return cursor;
+	}
+}
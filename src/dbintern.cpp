@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include <db/intern.hpp>
+#include <string.h>
+
+namespace db
+{
+	size_t StringPool::Hash::operator()(const Key& key) const
+	{
+		// FNV-1a
+		unsigned long long hash = 14695981039346656037ULL;
+		for (size_t i = 0; i < key.length; ++i)
+		{
+			hash ^= (unsigned char)key.data[i];
+			hash *= 1099511628211ULL;
+		}
+		return (size_t)hash;
+	}
+
+	bool StringPool::Equal::operator()(const Key& left, const Key& right) const
+	{
+		return left.length == right.length && !memcmp(left.data, right.data, left.length);
+	}
+
+	StringPool::StringPool(size_t blockSize)
+		: m_blockSize(blockSize < 256 ? 256 : blockSize)
+		, m_used(0)
+		, m_reserved(0)
+	{
+		InternStats empty = {};
+		m_stats = empty;
+	}
+
+	char* StringPool::allocate(size_t size)
+	{
+		// keep the length prefixes aligned
+		size = (size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+
+		if (m_blocks.empty() || m_used + size > m_blockSize)
+		{
+			// long texts get a block of their own, keeping the current one
+			size_t blockSize = size > m_blockSize / 4 ? size : m_blockSize;
+			std::unique_ptr<char[]> block(new (std::nothrow) char[blockSize]);
+			if (!block)
+				return nullptr;
+
+			char* ptr = block.get();
+			m_reserved += blockSize;
+			if (blockSize != m_blockSize)
+			{
+				m_blocks.insert(m_blocks.empty() ? m_blocks.end() : m_blocks.end() - 1, std::move(block));
+				if (m_blocks.size() == 1)
+					m_used = m_blockSize; // no room for the short texts yet
+				return ptr;
+			}
+
+			m_blocks.push_back(std::move(block));
+			m_used = 0;
+		}
+
+		char* ptr = m_blocks.back().get() + m_used;
+		m_used += size;
+		return ptr;
+	}
+
+	Interned StringPool::intern(const char* text, size_t length)
+	{
+		if (!text)
+			return Interned();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		++m_stats.values;
+		m_stats.stringBytes += sizeof(std::string);
+		if (length > 15) // past the small string buffer of the common implementations
+			m_stats.stringBytes += length + 1;
+
+		Key key = { text, length };
+		auto it = m_index.find(key);
+		if (it != m_index.end())
+			return Interned(it->data);
+
+		char* ptr = allocate(sizeof(size_t) + length + 1);
+		if (!ptr)
+			return Interned();
+
+		*(size_t*)ptr = length;
+		ptr += sizeof(size_t);
+		memcpy(ptr, text, length);
+		ptr[length] = 0;
+
+		try {
+			key.data = ptr;
+			m_index.insert(key);
+		} catch (std::bad_alloc&) {}
+
+		++m_stats.unique;
+		return Interned(ptr);
+	}
+
+	Interned StringPool::intern(const char* text)
+	{
+		return intern(text, text ? strlen(text) : 0);
+	}
+
+	InternStats StringPool::stats()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		InternStats stats = m_stats;
+		stats.poolBytes = m_stats.values * sizeof(Interned) + m_reserved
+			+ m_index.bucket_count() * sizeof(void*)
+			+ m_index.size() * (sizeof(Key) + 2 * sizeof(void*));
+		return stats;
+	}
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include <db/memory.hpp>
+#include <map>
+#include <mutex>
+
+namespace db
+{
+	MemoryBudget::MemoryBudget(const MemoryLimits& limits, const MemoryBudgetPtr& parent)
+		: m_parent(parent)
+		, m_soft(limits.soft)
+		, m_hard(limits.hard)
+		, m_keep(limits.keep)
+		, m_used(0)
+		, m_peak(0)
+		, m_refused(0)
+		, m_spilled(0)
+		, m_shrunk(0)
+	{
+	}
+
+	const MemoryBudgetPtr& MemoryBudget::global()
+	{
+		static MemoryBudgetPtr budget = std::make_shared<MemoryBudget>(MemoryLimits(), nullptr);
+		return budget;
+	}
+
+	MemoryBudgetPtr MemoryBudget::named(const std::string& name, const MemoryLimits& limits)
+	{
+		static std::mutex mutex;
+		static std::map<std::string, std::weak_ptr<MemoryBudget>> budgets;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		auto budget = budgets[name].lock();
+		if (!budget)
+		{
+			budget = std::make_shared<MemoryBudget>(limits);
+			budgets[name] = budget;
+		}
+		return budget;
+	}
+
+	void MemoryBudget::setLimits(const MemoryLimits& limits)
+	{
+		m_soft.store(limits.soft, std::memory_order_relaxed);
+		m_hard.store(limits.hard, std::memory_order_relaxed);
+		m_keep.store(limits.keep, std::memory_order_relaxed);
+	}
+
+	bool MemoryBudget::reserve(size_t bytes)
+	{
+		if (!bytes)
+			return true;
+
+		// charged first and taken back on failure; two racing reservations
+		// may both be refused, never both let through
+		size_t hard = m_hard.load(std::memory_order_relaxed);
+		size_t used = m_used.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+		if (hard && used > hard)
+		{
+			m_used.fetch_sub(bytes, std::memory_order_relaxed);
+			m_refused.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		// counted as refused by the parent, which was over its limit
+		if (m_parent && !m_parent->reserve(bytes))
+		{
+			m_used.fetch_sub(bytes, std::memory_order_relaxed);
+			return false;
+		}
+
+		size_t peak = m_peak.load(std::memory_order_relaxed);
+		while (used > peak && !m_peak.compare_exchange_weak(peak, used, std::memory_order_relaxed))
+			;
+		return true;
+	}
+
+	void MemoryBudget::release(size_t bytes)
+	{
+		if (!bytes)
+			return;
+		m_used.fetch_sub(bytes, std::memory_order_relaxed);
+		if (m_parent)
+			m_parent->release(bytes);
+	}
+
+	bool MemoryBudget::pressured() const
+	{
+		size_t soft = m_soft.load(std::memory_order_relaxed);
+		if (soft && m_used.load(std::memory_order_relaxed) > soft)
+			return true;
+		return m_parent && m_parent->pressured();
+	}
+
+	size_t MemoryBudget::keep() const
+	{
+		size_t keep = m_keep.load(std::memory_order_relaxed);
+		if (m_parent)
+		{
+			size_t above = m_parent->keep();
+			if (above < keep)
+				keep = above;
+		}
+		return keep;
+	}
+
+	void MemoryBudget::spilled()
+	{
+		m_spilled.fetch_add(1, std::memory_order_relaxed);
+		if (m_parent)
+			m_parent->spilled();
+	}
+
+	void MemoryBudget::shrunk()
+	{
+		m_shrunk.fetch_add(1, std::memory_order_relaxed);
+		if (m_parent)
+			m_parent->shrunk();
+	}
+
+	MemoryStats MemoryBudget::stats() const
+	{
+		MemoryStats stats = {};
+		stats.used = m_used.load(std::memory_order_relaxed);
+		stats.peak = m_peak.load(std::memory_order_relaxed);
+		stats.refused = m_refused.load(std::memory_order_relaxed);
+		stats.spilled = m_spilled.load(std::memory_order_relaxed);
+		stats.shrunk = m_shrunk.load(std::memory_order_relaxed);
+		return stats;
+	}
+}
@@ -0,0 +1,392 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include <db/pipeline.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace db
+{
+	void RowChunk::reserve(size_t rows)
+	{
+		m_cells.reserve(rows * m_columns);
+	}
+
+	void RowChunk::addRow()
+	{
+		RowCell empty = {};
+		m_cells.resize(m_cells.size() + m_columns, empty);
+		++m_rows;
+	}
+
+	void RowChunk::store(RowCell& cell, const void* data, size_t size)
+	{
+		cell.offset = m_data.size();
+		cell.size = size;
+		cell.flags |= RowCell::SIZE | RowCell::DATA;
+		m_data.insert(m_data.end(), (const char*)data, (const char*)data + size);
+		m_data.push_back(0);
+	}
+
+	RowCell* RowRecorder::current(int column)
+	{
+		if (!m_chunk || !m_chunk->rows() || column < 0 || (size_t)column >= m_chunk->columns())
+			return nullptr;
+		return &m_chunk->cell(m_chunk->rows() - 1, column);
+	}
+
+	// the column as text, in raw mode; false, if not in raw mode
+	bool RowRecorder::recordRaw(int column)
+	{
+		if (!m_raw)
+			return false;
+
+		RowCell* cell = current(column);
+		if (!cell || (cell->flags & (RowCell::DATA | RowCell::NULLNESS)))
+			return true;
+
+		const char* value = m_source->getText(column);
+		if (!value)
+		{
+			cell->null = true;
+			cell->flags |= RowCell::NULLNESS;
+			return true;
+		}
+		m_chunk->store(*cell, value, strlen(value));
+		cell->flags |= RowCell::RAW;
+		return true;
+	}
+
+	bool RowRecorder::next()
+	{
+		if (!m_source->next())
+			return false;
+		if (m_chunk)
+			m_chunk->addRow();
+		return true;
+	}
+
+	int RowRecorder::getInt(int column)
+	{
+		if (recordRaw(column))
+			return 0;
+
+		int value = m_source->getInt(column);
+		RowCell* cell = current(column);
+		if (cell)
+		{
+			cell->value = value;
+			cell->flags |= RowCell::VALUE;
+		}
+		return value;
+	}
+
+	long RowRecorder::getLong(int column)
+	{
+		if (recordRaw(column))
+			return 0;
+
+		long value = m_source->getLong(column);
+		RowCell* cell = current(column);
+		if (cell)
+		{
+			cell->value = value;
+			cell->flags |= RowCell::VALUE;
+		}
+		return value;
+	}
+
+	long long RowRecorder::getLongLong(int column)
+	{
+		if (recordRaw(column))
+			return 0;
+
+		long long value = m_source->getLongLong(column);
+		RowCell* cell = current(column);
+		if (cell)
+		{
+			cell->value = value;
+			cell->flags |= RowCell::VALUE;
+		}
+		return value;
+	}
+
+	double RowRecorder::getDouble(int column)
+	{
+		if (recordRaw(column))
+			return 0;
+
+		double value = m_source->getDouble(column);
+		RowCell* cell = current(column);
+		if (cell)
+		{
+			cell->real = value;
+			cell->flags |= RowCell::REAL;
+		}
+		return value;
+	}
+
+	float RowRecorder::getFloat(int column)
+	{
+		if (recordRaw(column))
+			return 0;
+
+		float value = m_source->getFloat(column);
+		RowCell* cell = current(column);
+		if (cell)
+		{
+			cell->real = value;
+			cell->flags |= RowCell::REAL;
+		}
+		return value;
+	}
+
+	Decimal RowRecorder::getDecimal(int column)
+	{
+		Decimal value;
+		readDecimal(column, value);
+		return value;
+	}
+
+	bool RowRecorder::readDecimal(int column, Decimal& value)
+	{
+		value = Decimal();
+		if (recordRaw(column))
+			return true;
+
+		// a value, which could not be read, is not recorded
+		if (!m_source->readDecimal(column, value))
+			return false;
+		RowCell* cell = current(column);
+		if (cell)
+		{
+			cell->decimal = value;
+			cell->flags |= RowCell::DECIMAL;
+		}
+		return true;
+	}
+
+	tyme::time_t RowRecorder::getTimestamp(int column)
+	{
+		if (recordRaw(column))
+			return 0;
+
+		tyme::time_t value = m_source->getTimestamp(column);
+		RowCell* cell = current(column);
+		if (cell)
+		{
+			cell->value = value;
+			cell->flags |= RowCell::VALUE;
+		}
+		return value;
+	}
+
+	const char* RowRecorder::getText(int column)
+	{
+		const char* value = m_source->getText(column);
+		RowCell* cell = current(column);
+		if (cell && value && !(cell->flags & RowCell::DATA))
+			m_chunk->store(*cell, value, strlen(value));
+		return value;
+	}
+
+	size_t RowRecorder::getBlobSize(int column)
+	{
+		size_t value = m_source->getBlobSize(column);
+		RowCell* cell = current(column);
+		if (cell && !(cell->flags & RowCell::DATA))
+		{
+			cell->size = value;
+			cell->flags |= RowCell::SIZE;
+		}
+		return value;
+	}
+
+	const void* RowRecorder::getBlob(int column)
+	{
+		size_t size = m_source->getBlobSize(column);
+		const void* value = m_source->getBlob(column);
+		RowCell* cell = current(column);
+		if (cell && value && !(cell->flags & RowCell::DATA))
+			m_chunk->store(*cell, value, size);
+		return value;
+	}
+
+	bool RowRecorder::isNull(int column)
+	{
+		bool value = m_source->isNull(column);
+		RowCell* cell = current(column);
+		if (cell)
+		{
+			cell->null = value;
+			cell->flags |= RowCell::NULLNESS;
+		}
+		return value;
+	}
+
+	const RowCell* ChunkCursor::current(int column, unsigned flag)
+	{
+		if (m_row >= m_chunk->rows() || column < 0 || (size_t)column >= m_chunk->columns())
+			return nullptr;
+		const RowCell& cell = m_chunk->cell(m_row, column);
+		if (!(cell.flags & flag))
+			return nullptr;
+		return &cell;
+	}
+
+	bool ChunkCursor::next()
+	{
+		if (m_row != (size_t)-1 && m_row >= m_chunk->rows())
+			return false;
+		++m_row;
+		return m_row < m_chunk->rows();
+	}
+
+	bool ChunkCursor::seek(size_t row)
+	{
+		if (row >= m_chunk->rows())
+			return false;
+		m_row = row;
+		return true;
+	}
+
+	long long ChunkCursor::getLongLong(int column)
+	{
+		const RowCell* cell = current(column, RowCell::VALUE);
+		if (cell)
+			return cell->value;
+		cell = current(column, RowCell::RAW);
+		return cell ? strtoll(m_chunk->data(*cell), nullptr, 10) : 0;
+	}
+
+	double ChunkCursor::getDouble(int column)
+	{
+		const RowCell* cell = current(column, RowCell::REAL);
+		if (cell)
+			return cell->real;
+		cell = current(column, RowCell::RAW);
+		return cell ? strtod(m_chunk->data(*cell), nullptr) : 0;
+	}
+
+	Decimal ChunkCursor::getDecimal(int column)
+	{
+		Decimal ret;
+		readDecimal(column, ret);
+		return ret;
+	}
+
+	bool ChunkCursor::readDecimal(int column, Decimal& value)
+	{
+		value = Decimal();
+		const RowCell* cell = current(column, RowCell::DECIMAL);
+		if (cell)
+		{
+			value = cell->decimal;
+			return true;
+		}
+
+		cell = current(column, RowCell::RAW);
+		if (!cell)
+			return true;
+		if (!Decimal::parse(m_chunk->data(*cell), cell->size, value))
+		{
+			value = Decimal();
+			return false;
+		}
+		return true;
+	}
+
+	tyme::time_t ChunkCursor::getTimestamp(int column)
+	{
+		const RowCell* cell = current(column, RowCell::VALUE);
+		if (cell)
+			return (tyme::time_t)cell->value;
+		cell = current(column, RowCell::RAW);
+		if (!cell)
+			return 0;
+
+		tyme::tm_t tm = {};
+		if (sscanf(m_chunk->data(*cell), "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) < 3)
+			return 0;
+		tm.tm_year -= 1900;
+		tm.tm_mon  -= 1;
+		return tyme::mktime(tm);
+	}
+
+	const char* ChunkCursor::getText(int column)
+	{
+		const RowCell* cell = current(column, RowCell::DATA);
+		return cell ? m_chunk->data(*cell) : nullptr;
+	}
+
+	size_t ChunkCursor::getBlobSize(int column)
+	{
+		const RowCell* cell = current(column, RowCell::SIZE);
+		return cell ? cell->size : 0;
+	}
+
+	bool ChunkCursor::isNull(int column)
+	{
+		const RowCell* cell = current(column, RowCell::NULLNESS);
+		if (cell)
+			return cell->null;
+		return !current(column, RowCell::VALUE | RowCell::DATA | RowCell::REAL | RowCell::DECIMAL);
+	}
+
+	bool ChunkQueue::push(size_t seq, const RowChunkPtr& chunk)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_popped.wait(lock, [this] { return m_closed || m_items.size() < m_limit; });
+		if (m_closed)
+			return false;
+
+		Item item = { seq, chunk };
+		m_items.push_back(item);
+		m_pushed.notify_one();
+		return true;
+	}
+
+	bool ChunkQueue::pop(Item& item)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_pushed.wait(lock, [this] { return m_closed || !m_items.empty(); });
+		if (m_items.empty())
+			return false;
+
+		item = m_items.front();
+		m_items.pop_front();
+		m_popped.notify_one();
+		return true;
+	}
+
+	void ChunkQueue::close()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closed = true;
+		m_pushed.notify_all();
+		m_popped.notify_all();
+	}
+}
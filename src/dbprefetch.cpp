@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include <db/prefetch.hpp>
+
+namespace db
+{
+	PrefetchCursor::PrefetchCursor(const CursorPtr& source, const Capture& capture, const PrefetchOptions& options)
+		: m_source(source)
+		, m_queue(options.batches ? options.batches : 1)
+		, m_stopping(false)
+		, m_error(0)
+	{
+		m_thread = std::thread(&PrefetchCursor::fetch, this, capture, options.batchRows ? options.batchRows : 1);
+	}
+
+	PrefetchCursor::~PrefetchCursor()
+	{
+		m_stopping = true;
+		m_queue.close();
+		if (m_thread.joinable())
+			m_thread.join();
+	}
+
+	void PrefetchCursor::fetch(Capture capture, size_t batchRows)
+	{
+		try {
+			fetchAll(capture, batchRows);
+		}
+		catch (std::bad_alloc&) { fail(error::MEMORY_LIMIT, "Out of memory while prefetching"); }
+		catch (std::exception& e) { fail(error::CANCELLED, e.what()); }
+		m_queue.close();
+	}
+
+	void PrefetchCursor::fetchAll(const Capture& capture, size_t batchRows)
+	{
+		auto recorder = std::make_shared<RowRecorder>(m_source);
+		CursorPtr recording = recorder;
+		size_t columns = m_source->columnCount();
+		size_t seq = 0;
+		bool more = true;
+		while (more)
+		{
+			auto chunk = std::make_shared<RowChunk>(columns);
+			chunk->reserve(batchRows);
+			recorder->attach(chunk);
+			while (chunk->rows() < batchRows && !m_stopping && (more = recorder->next()))
+			{
+				if (capture)
+					capture(recording);
+			}
+
+			// a failed push means the reader is gone
+			if (m_stopping || (chunk->rows() && !m_queue.push(seq++, chunk)))
+				break;
+		}
+		recorder->attach(nullptr);
+
+		// the rows fetched so far are read first, then the error
+		StatementPtr stmt = m_source->getStatement();
+		if (!more && !m_stopping && stmt && stmt->errorCode())
+			fail(stmt->errorCode(), stmt->errorMessage());
+	}
+
+	void PrefetchCursor::fail(long code, const char* message)
+	{
+		m_message = message ? message : "";
+		m_error = code;
+	}
+
+	bool PrefetchCursor::next()
+	{
+		if (m_current && m_current->next())
+			return true;
+
+		// the previous batch is released here, making room for the helper
+		m_current.reset();
+
+		ChunkQueue::Item item;
+		while (m_queue.pop(item))
+		{
+			m_current = std::make_shared<ChunkCursor>(item.chunk, m_source);
+			if (m_current->next())
+				return true;
+		}
+
+		m_current.reset();
+		return false;
+	}
+}
@@ -0,0 +1,478 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include <db/replay.hpp>
+#include <filesystem.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+
+namespace db
+{
+	namespace
+	{
+		struct Call
+		{
+			trace::Event event;
+			int64_t time;
+			uint32_t stmt;
+			uint8_t kind;   // type of the value, option, stream, read to the end
+			int64_t first;  // low limit, arg, value, rows
+			int64_t second; // high limit, result
+			std::string text;
+			bool ok;
+		};
+
+		struct Session
+		{
+			std::vector<Call> calls;
+		};
+
+		class Reader
+		{
+			const std::string& m_data;
+			size_t m_pos;
+		public:
+			explicit Reader(const std::string& data): m_data(data), m_pos(0) {}
+			bool eof() const { return m_pos == m_data.size(); }
+			bool skip(size_t size)
+			{
+				if (m_data.size() - m_pos < size)
+					return false;
+				m_pos += size;
+				return true;
+			}
+			template <typename Type>
+			bool get(Type& value)
+			{
+				if (m_data.size() - m_pos < sizeof(value))
+					return false;
+				memcpy(&value, m_data.data() + m_pos, sizeof(value));
+				m_pos += sizeof(value);
+				return true;
+			}
+			bool getText(std::string& value)
+			{
+				uint32_t size;
+				if (!get(size) || m_data.size() - m_pos < size)
+					return false;
+				value.assign(m_data.data() + m_pos, size);
+				m_pos += size;
+				return true;
+			}
+			bool getCall(Call& call)
+			{
+				uint8_t ok;
+				int64_t duration;
+				if (!get(ok) || !get(duration))
+					return false;
+				call.ok = !!ok;
+				return true;
+			}
+		};
+
+		bool parse(Reader& in, uint32_t& session, Call& call)
+		{
+			uint8_t event;
+			if (!in.get(event) || !in.get(session) || !in.get(call.time))
+				return false;
+
+			call.event = (trace::Event)event;
+			call.stmt = 0;
+			call.kind = 0;
+			call.first = call.second = 0;
+			call.ok = true;
+			call.text.clear();
+
+			switch (call.event)
+			{
+			case trace::OPEN:
+			case trace::CLOSE:
+				return true;
+			case trace::PREPARE:
+				return in.get(call.stmt) && in.get(call.first) && in.get(call.second) && in.getText(call.text) && in.getCall(call);
+			case trace::DIRECT:
+				return in.get(call.stmt) && in.get(call.kind) && in.getText(call.text) && in.getCall(call);
+			case trace::BIND:
+			{
+				uint32_t arg;
+				if (!in.get(call.stmt) || !in.get(arg) || !in.get(call.kind))
+					return false;
+				call.second = arg;
+				if (call.kind == trace::TEXT || call.kind == trace::BLOB)
+					return in.getText(call.text);
+				return in.get(call.first);
+			}
+			case trace::OPTION:
+				return in.get(call.stmt) && in.get(call.kind) && in.get(call.first);
+			case trace::EXECUTE:
+			case trace::QUERY:
+			case trace::RESULTS:
+				return in.get(call.stmt) && in.getCall(call);
+			case trace::FETCHED:
+			{
+				uint32_t result;
+				int64_t duration;
+				if (!in.get(call.stmt) || !in.get(result) || !in.get(call.first) || !in.get(call.kind) || !in.get(duration))
+					return false;
+				call.second = result;
+				return true;
+			}
+			case trace::EXEC:
+				return in.getText(call.text) && in.getCall(call);
+			case trace::BEGIN:
+			case trace::COMMIT:
+			case trace::ROLLBACK:
+			case trace::RECONNECT:
+				return in.getCall(call);
+			}
+			return false;
+		}
+
+		bool load(const filesystem::path& path, std::map<uint32_t, Session>& sessions, int64_t& start)
+		{
+			std::ifstream file(path.native(), std::ios::binary);
+			if (!file.is_open())
+				return false;
+			std::ostringstream contents;
+			contents << file.rdbuf();
+			std::string data = contents.str();
+
+			Reader in(data);
+			char magic[sizeof(trace::MAGIC)];
+			uint32_t version, byteOrder;
+			if (!in.get(magic) || memcmp(magic, trace::MAGIC, sizeof(magic)) ||
+				!in.get(version) || version != trace::VERSION ||
+				!in.get(byteOrder) || byteOrder != trace::BYTE_ORDER_MARK)
+				return false;
+
+			start = -1;
+			while (!in.eof())
+			{
+				uint32_t session;
+				Call call;
+				if (!parse(in, session, call))
+					break; // a trace of a crashed process may end mid-record
+
+				if (start < 0 || call.time < start)
+					start = call.time;
+				sessions[session].calls.push_back(std::move(call));
+			}
+			return true;
+		}
+
+		struct Samples
+		{
+			std::vector<long long> values;
+			unsigned long long errors;
+			Samples(): errors(0) {}
+			void add(long long value, bool ok)
+			{
+				values.push_back(value);
+				if (!ok)
+					++errors;
+			}
+			void merge(const Samples& other)
+			{
+				values.insert(values.end(), other.values.begin(), other.values.end());
+				errors += other.errors;
+			}
+			LatencyStats stats()
+			{
+				LatencyStats stats = {};
+				stats.count = values.size();
+				stats.errors = errors;
+				if (values.empty())
+					return stats;
+
+				std::sort(values.begin(), values.end());
+				auto at = [this](size_t percent) { return values[(values.size() - 1) * percent / 100]; };
+				stats.p50 = at(50);
+				stats.p90 = at(90);
+				stats.p99 = at(99);
+				stats.max = values.back();
+				long double total = 0;
+				for (auto value : values)
+					total += value;
+				stats.mean = (double)(total / values.size());
+				return stats;
+			}
+		};
+
+		struct Worker
+		{
+			Samples queries;
+			Samples executes;
+			Samples transactions;
+			unsigned long long mismatches;
+			size_t failed;
+			Worker(): mismatches(0), failed(0) {}
+		};
+
+		typedef std::chrono::steady_clock Clock;
+
+		class Player
+		{
+			const filesystem::path& m_target;
+			const ReplayOptions& m_options;
+			Clock::time_point m_started;
+			int64_t m_start;
+		public:
+			Player(const filesystem::path& target, const ReplayOptions& options, int64_t start)
+				: m_target(target)
+				, m_options(options)
+				, m_started(Clock::now())
+				, m_start(start)
+			{
+			}
+
+			void wait(int64_t time)
+			{
+				if (m_options.speed <= 0)
+					return;
+				auto offset = std::chrono::microseconds((long long)((time - m_start) / m_options.speed));
+				std::this_thread::sleep_until(m_started + offset);
+			}
+
+			static long long since(Clock::time_point start)
+			{
+				return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+			}
+
+			static bool bind(const StatementPtr& stmt, const Call& call)
+			{
+				int arg = (int)call.second;
+				switch (call.kind)
+				{
+				case trace::NUL: return stmt->bindNull(arg);
+				case trace::INTEGER: return stmt->bind(arg, (long long)call.first);
+				case trace::TEXT: return stmt->bindText(arg, call.text.data(), call.text.size());
+				case trace::BLOB: return stmt->bind(arg, call.text.data(), call.text.size());
+				case trace::TIME: return stmt->bindTime(arg, (tyme::time_t)call.first);
+				}
+				return false;
+			}
+
+			static unsigned long long drain(const CursorPtr& cursor)
+			{
+				unsigned long long rows = 0;
+				while (cursor->next())
+					++rows;
+				return rows;
+			}
+
+			void play(const Session& session, Worker& worker)
+			{
+				ConnectionPtr conn = Connection::open(m_target);
+				if (!conn)
+				{
+					++worker.failed;
+					return;
+				}
+
+				std::map<uint32_t, StatementPtr> statements;
+				// rows of the last query() or of each results() statement
+				std::map<uint32_t, std::vector<unsigned long long>> fetched;
+				for (auto&& call : session.calls)
+				{
+					wait(call.time);
+
+					StatementPtr stmt;
+					if (call.stmt)
+					{
+						auto it = statements.find(call.stmt);
+						if (it != statements.end())
+							stmt = it->second;
+					}
+
+					auto start = Clock::now();
+					bool ok = true;
+					Samples* samples = nullptr;
+					switch (call.event)
+					{
+					case trace::OPEN:
+					case trace::CLOSE:
+						continue;
+					case trace::PREPARE:
+						stmt = call.first >= 0 ?
+							conn->prepare(call.text.c_str(), (long)call.first, (long)call.second) :
+							conn->prepare(call.text.c_str());
+						ok = !!stmt;
+						if (stmt)
+							statements[call.stmt] = stmt;
+						break;
+					case trace::DIRECT:
+						stmt = conn->direct(call.text.c_str(), !!call.kind);
+						ok = !!stmt;
+						if (stmt)
+							statements[call.stmt] = stmt;
+						break;
+					case trace::BIND:
+						if (stmt)
+							bind(stmt, call);
+						continue;
+					case trace::OPTION:
+						if (stmt && call.kind == trace::BUFFERED)
+							stmt->setBuffered(!!call.first);
+						else if (stmt && call.kind == trace::TIMEOUT)
+							stmt->setTimeout((long)call.first);
+						continue;
+					case trace::EXECUTE:
+						ok = stmt && stmt->execute();
+						samples = &worker.executes;
+						break;
+					case trace::QUERY:
+					{
+						CursorPtr cursor = stmt ? stmt->query() : nullptr;
+						ok = !!cursor;
+						std::vector<unsigned long long>& rows = fetched[call.stmt];
+						rows.assign(1, cursor ? drain(cursor) : 0);
+						samples = &worker.queries;
+						break;
+					}
+					case trace::FETCHED:
+					{
+						const std::vector<unsigned long long>& rows = fetched[call.stmt];
+						unsigned long long replayed = (size_t)call.second < rows.size() ? rows[(size_t)call.second] : 0;
+						unsigned long long recorded = (unsigned long long)call.first;
+						// a cursor left early only tells, there were at least as many rows
+						if (call.kind ? replayed != recorded : replayed < recorded)
+							++worker.mismatches;
+						continue;
+					}
+					case trace::RESULTS:
+					{
+						ResultsPtr results = stmt ? stmt->results() : nullptr;
+						ok = !!results;
+						std::vector<unsigned long long>& rows = fetched[call.stmt];
+						rows.assign(1, 0);
+						if (results)
+						{
+							while (results->next())
+							{
+								CursorPtr cursor = results->cursor();
+								rows.push_back(cursor ? drain(cursor) : 0);
+							}
+						}
+						samples = &worker.executes;
+						break;
+					}
+					case trace::EXEC:
+						ok = conn->exec(call.text.c_str());
+						samples = &worker.executes;
+						break;
+					case trace::BEGIN:
+						ok = conn->beginTransaction();
+						samples = &worker.transactions;
+						break;
+					case trace::COMMIT:
+						ok = conn->commitTransaction();
+						samples = &worker.transactions;
+						break;
+					case trace::ROLLBACK:
+						ok = conn->rollbackTransaction();
+						samples = &worker.transactions;
+						break;
+					case trace::RECONNECT:
+						ok = conn->reconnect();
+						break;
+					}
+
+					if (samples)
+						samples->add(since(start), ok);
+					if (ok != call.ok)
+						++worker.mismatches;
+				}
+			}
+
+			long long elapsed() const { return since(m_started); }
+		};
+	}
+
+	bool Replay::run(const filesystem::path& trace, const filesystem::path& target, const ReplayOptions& options, ReplayStats& stats)
+	{
+		std::map<uint32_t, Session> sessions;
+		int64_t start = 0;
+		if (!load(trace, sessions, start))
+			return false;
+
+		// the sessions start in the recorded order
+		std::vector<const Session*> order;
+		order.reserve(sessions.size());
+		for (auto&& pair : sessions)
+		{
+			if (!pair.second.calls.empty())
+				order.push_back(&pair.second);
+		}
+		std::stable_sort(order.begin(), order.end(), [](const Session* left, const Session* right) {
+			return left->calls.front().time < right->calls.front().time;
+		});
+
+		size_t concurrency = options.concurrency ? options.concurrency : 1;
+		if (concurrency > order.size())
+			concurrency = order.size();
+
+		Player player(target, options, start);
+		std::atomic<size_t> next(0);
+		std::vector<Worker> workers(concurrency);
+		std::vector<std::thread> threads;
+		threads.reserve(concurrency);
+		for (size_t i = 0; i < concurrency; ++i)
+		{
+			Worker& worker = workers[i];
+			threads.push_back(std::thread([&order, &next, &player, &worker] {
+				size_t index;
+				while ((index = next++) < order.size())
+					player.play(*order[index], worker);
+			}));
+		}
+		for (auto&& thread : threads)
+			thread.join();
+
+		Samples queries, executes, transactions;
+		stats = ReplayStats();
+		stats.sessions = order.size();
+		for (auto&& worker : workers)
+		{
+			queries.merge(worker.queries);
+			executes.merge(worker.executes);
+			transactions.merge(worker.transactions);
+			stats.mismatches += worker.mismatches;
+			stats.failedSessions += worker.failed;
+		}
+		stats.duration = player.elapsed();
+		stats.queries = queries.stats();
+		stats.executes = executes.stats();
+		stats.transactions = transactions.stats();
+		return true;
+	}
+}
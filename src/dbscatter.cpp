@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include <db/scatter.hpp>
+#include <string.h>
+#include <thread>
+
+namespace db
+{
+	namespace
+	{
+		struct Shard
+		{
+			CursorPtr cursor;
+			bool hasRow;
+			long error;
+			std::string message;
+
+			// a cursor, which fails, has no more rows, too
+			void next()
+			{
+				hasRow = cursor->next();
+				if (hasRow)
+					return;
+
+				StatementPtr stmt = cursor->getStatement();
+				if (stmt && stmt->errorCode())
+				{
+					error = stmt->errorCode();
+					message = stmt->errorMessage();
+				}
+			}
+		};
+
+		class MergedCursor: public ScatterCursor
+		{
+			std::vector<Shard> m_shards;
+			std::vector<MergeKey> m_keys;
+			std::vector<size_t> m_heap;
+			CursorPtr m_current;
+			size_t m_index;
+			bool m_started;
+
+			int compare(const CursorPtr& lhs, const CursorPtr& rhs) const
+			{
+				for (auto&& key : m_keys)
+				{
+					int result = 0;
+					bool lnull = lhs->isNull(key.column);
+					bool rnull = rhs->isNull(key.column);
+					if (lnull || rnull)
+						result = lnull == rnull ? 0 : (lnull ? -1 : 1); // NULLs first, as in MySQL
+					else if (key.kind == MergeKey::TEXT)
+					{
+						// a text that cannot be read sorts as a NULL would
+						const char* l = lhs->getText(key.column);
+						const char* r = rhs->getText(key.column);
+						if (l && r)
+							result = strcmp(l, r);
+						else
+							result = !l == !r ? 0 : (l ? 1 : -1);
+					}
+					else
+					{
+						long long l = key.kind == MergeKey::INTEGER ? lhs->getLongLong(key.column) : (long long)lhs->getTimestamp(key.column);
+						long long r = key.kind == MergeKey::INTEGER ? rhs->getLongLong(key.column) : (long long)rhs->getTimestamp(key.column);
+						result = l < r ? -1 : (l > r ? 1 : 0);
+					}
+
+					if (result)
+						return key.descending ? -result : result;
+				}
+				return 0;
+			}
+
+			// std::*_heap keeps the largest on top; the order of the
+			// connections breaks the ties to keep the merge stable
+			bool later(size_t lhs, size_t rhs) const
+			{
+				int result = compare(m_shards[lhs].cursor, m_shards[rhs].cursor);
+				return result ? result > 0 : lhs > rhs;
+			}
+
+			bool nextConcat()
+			{
+				while (m_index < m_shards.size())
+				{
+					Shard& shard = m_shards[m_index];
+					if (m_started && m_current == shard.cursor)
+						shard.next();
+					m_started = true;
+
+					if (shard.hasRow)
+					{
+						m_current = shard.cursor;
+						return true;
+					}
+					m_current.reset();
+					++m_index;
+				}
+				return false;
+			}
+
+			bool nextMerge()
+			{
+				auto cmp = [this](size_t lhs, size_t rhs) { return later(lhs, rhs); };
+				if (!m_started)
+				{
+					m_started = true;
+					for (size_t i = 0; i < m_shards.size(); ++i)
+						if (m_shards[i].hasRow)
+							m_heap.push_back(i);
+					std::make_heap(m_heap.begin(), m_heap.end(), cmp);
+				}
+				else if (m_current)
+				{
+					Shard& shard = m_shards[m_index];
+					shard.next();
+					if (shard.hasRow)
+					{
+						m_heap.push_back(m_index);
+						std::push_heap(m_heap.begin(), m_heap.end(), cmp);
+					}
+				}
+
+				m_current.reset();
+				if (m_heap.empty())
+					return false;
+
+				std::pop_heap(m_heap.begin(), m_heap.end(), cmp);
+				m_index = m_heap.back();
+				m_heap.pop_back();
+				m_current = m_shards[m_index].cursor;
+				return true;
+			}
+
+		public:
+			MergedCursor(std::vector<Shard>& shards, const std::vector<MergeKey>& keys)
+				: m_keys(keys)
+				, m_index(0)
+				, m_started(false)
+			{
+				m_shards.swap(shards);
+				m_heap.reserve(m_shards.size());
+			}
+
+			bool next() override { return m_keys.empty() ? nextConcat() : nextMerge(); }
+			size_t columnCount() override { return m_shards.empty() ? 0 : m_shards[0].cursor->columnCount(); }
+			int getInt(int column) override { return m_current ? m_current->getInt(column) : 0; }
+			long getLong(int column) override { return m_current ? m_current->getLong(column) : 0; }
+			long long getLongLong(int column) override { return m_current ? m_current->getLongLong(column) : 0; }
+			double getDouble(int column) override { return m_current ? m_current->getDouble(column) : 0; }
+			float getFloat(int column) override { return m_current ? m_current->getFloat(column) : 0; }
+			Decimal getDecimal(int column) override { return m_current ? m_current->getDecimal(column) : Decimal(); }
+			bool readDecimal(int column, Decimal& value) override { value = Decimal(); return m_current ? m_current->readDecimal(column, value) : false; }
+			tyme::time_t getTimestamp(int column) override { return m_current ? m_current->getTimestamp(column) : 0; }
+			const char* getText(int column) override { return m_current ? m_current->getText(column) : nullptr; }
+			size_t getBlobSize(int column) override { return m_current ? m_current->getBlobSize(column) : 0; }
+			const void* getBlob(int column) override { return m_current ? m_current->getBlob(column) : nullptr; }
+			bool isNull(int column) override { return m_current ? m_current->isNull(column) : true; }
+			ConnectionPtr getConnection() const override { return m_current ? m_current->getConnection() : nullptr; }
+			StatementPtr getStatement() const override { return m_current ? m_current->getStatement() : nullptr; }
+
+			std::vector<size_t> failed() const override
+			{
+				std::vector<size_t> out;
+				for (size_t i = 0; i < m_shards.size(); ++i)
+					if (m_shards[i].error)
+						out.push_back(i);
+				return out;
+			}
+
+			const char* errorMessage() override
+			{
+				for (auto&& shard : m_shards)
+					if (shard.error)
+						return shard.message.c_str();
+				return "";
+			}
+
+			long errorCode() override
+			{
+				for (auto&& shard : m_shards)
+					if (shard.error)
+						return shard.error;
+				return 0;
+			}
+		};
+	}
+
+	ScatterCursorPtr Scatter::query(const std::vector<ConnectionPtr>& conns)
+	{
+		m_error = 0;
+		m_message.clear();
+
+		std::vector<Shard> shards(conns.size());
+		auto run = [this, &conns, &shards](size_t i)
+		{
+			Shard& shard = shards[i];
+			shard.hasRow = false;
+			shard.error = 0;
+
+			const ConnectionPtr& conn = conns[i];
+			if (!conn)
+			{
+				shard.error = error::SHARD_UNAVAILABLE;
+				shard.message = "No connection";
+				return;
+			}
+
+			StatementPtr stmt = conn->prepare(m_sql.c_str());
+			if (!stmt)
+			{
+				shard.error = conn->errorCode();
+				shard.message = conn->errorMessage();
+				return;
+			}
+
+			if (m_binder && !m_binder(stmt))
+			{
+				shard.error = stmt->errorCode();
+				shard.message = stmt->errorMessage();
+				return;
+			}
+
+			shard.cursor = stmt->query();
+			if (!shard.cursor)
+			{
+				shard.error = stmt->errorCode();
+				shard.message = stmt->errorMessage();
+				return;
+			}
+
+			// the first row is the slowest, fetch it while the others wait, too
+			shard.next();
+		};
+
+		std::vector<std::thread> threads;
+		try {
+			threads.reserve(conns.size());
+			for (size_t i = 1; i < conns.size(); ++i)
+				threads.push_back(std::thread(run, i));
+		} catch (std::system_error&) {
+			m_error = error::SHARD_UNAVAILABLE;
+			m_message = "Cannot start the query threads";
+		}
+
+		if (!conns.empty() && !m_error)
+			run(0);
+
+		for (auto&& thread : threads)
+			thread.join();
+
+		if (m_error)
+			return nullptr;
+
+		for (size_t i = 0; i < shards.size(); ++i)
+		{
+			if (!shards[i].cursor || shards[i].error)
+			{
+				m_error = shards[i].error ? shards[i].error : (long)error::SHARD_UNAVAILABLE;
+				m_message = "[" + std::to_string(i) + "] " + shards[i].message;
+				return nullptr;
+			}
+		}
+
+		try {
+			return std::make_shared<MergedCursor>(shards, m_keys);
+		} catch (std::bad_alloc&) { return nullptr; }
+	}
+}
@@ -0,0 +1,755 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include <db/snapshot.hpp>
+#include <filesystem.hpp>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace db
+{
+	namespace
+	{
+		const char MAGIC[8] = { 'D', 'B', 'S', 'N', 'A', 'P', 0, 0 };
+		const uint32_t VERSION = 2;
+		const uint32_t BYTE_ORDER_MARK = 0x01020304;
+		const unsigned char NULL_VALUE = 0x80; // with RowCell::NULLNESS
+		const size_t BATCH = 4096;
+
+		// The rows are stored in segments of segmentRows, as they are
+		// fetched; the directory at the end holds an entry for every
+		// column of every segment.
+		struct Header
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t byteOrder;
+			uint64_t columns;
+			uint64_t rows;
+			int64_t created;
+			uint64_t tagSize;
+			uint64_t segmentRows;
+			uint64_t directoryOffset;
+		};
+
+		// arrays of a single column in a segment, one item per row; the
+		// offsets are counted from the start of the file, 0 for absent
+		struct ColumnEntry
+		{
+			uint64_t flags;    // unsigned char: RowCell flags and NULL_VALUE
+			uint64_t values;   // int64_t
+			uint64_t reals;    // double
+			uint64_t decimals; // DecimalCell
+			uint64_t texts;    // TextCell, pointing into the data
+		};
+
+		struct DecimalCell
+		{
+			int64_t unscaled;
+			int32_t scale;
+			int32_t reserved;
+		};
+
+		struct TextCell
+		{
+			uint64_t offset; // from the start of the file, followed by a zero
+			uint64_t size;
+		};
+
+		uint64_t align(uint64_t pos) { return (pos + 7) & ~(uint64_t)7; }
+
+		class MappedFile
+		{
+			const char* m_data;
+			uint64_t m_size;
+#ifdef _WIN32
+			HANDLE m_file;
+			HANDLE m_mapping;
+#endif
+		public:
+			MappedFile()
+				: m_data(nullptr)
+				, m_size(0)
+#ifdef _WIN32
+				, m_file(INVALID_HANDLE_VALUE)
+				, m_mapping(nullptr)
+#endif
+			{
+			}
+			~MappedFile();
+			bool open(const filesystem::path& path);
+			uint64_t size() const { return m_size; }
+
+			// null, if the array does not fit in the file
+			template <typename T>
+			const T* at(uint64_t offset, uint64_t count) const
+			{
+				if (offset > m_size || count > (m_size - offset) / sizeof(T))
+					return nullptr;
+				return (const T*)(m_data + offset);
+			}
+		};
+
+#ifdef _WIN32
+		MappedFile::~MappedFile()
+		{
+			if (m_data)
+				UnmapViewOfFile(m_data);
+			if (m_mapping)
+				CloseHandle(m_mapping);
+			if (m_file != INVALID_HANDLE_VALUE)
+				CloseHandle(m_file);
+		}
+
+		bool MappedFile::open(const filesystem::path& path)
+		{
+			m_file = CreateFileW(path.native().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (m_file == INVALID_HANDLE_VALUE)
+				return false;
+
+			LARGE_INTEGER size;
+			if (!GetFileSizeEx(m_file, &size) || !size.QuadPart)
+				return false;
+
+			m_mapping = CreateFileMapping(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (!m_mapping)
+				return false;
+
+			m_data = (const char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+			m_size = size.QuadPart;
+			return m_data != nullptr;
+		}
+#else
+		MappedFile::~MappedFile()
+		{
+			if (m_data)
+				munmap((void*)m_data, m_size);
+		}
+
+		bool MappedFile::open(const filesystem::path& path)
+		{
+			int fd = ::open(path.native().c_str(), O_RDONLY);
+			if (fd < 0)
+				return false;
+
+			struct stat st;
+			if (fstat(fd, &st) != 0 || !st.st_size)
+			{
+				close(fd);
+				return false;
+			}
+
+			// the mapping outlives the descriptor
+			void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			if (data == MAP_FAILED)
+				return false;
+
+			m_data = (const char*)data;
+			m_size = st.st_size;
+			return true;
+		}
+#endif
+		typedef std::shared_ptr<MappedFile> MappedFilePtr;
+
+		class SnapshotCursor: public Cursor
+		{
+		public:
+			struct Column
+			{
+				const unsigned char* flags;
+				const int64_t* values;
+				const double* reals;
+				const DecimalCell* decimals;
+				const TextCell* texts;
+			};
+		private:
+			MappedFilePtr m_file;
+			std::vector<Column> m_columns; // segment after segment
+			size_t m_columnCount;
+			uint64_t m_segmentRows;
+			uint64_t m_rows;
+			uint64_t m_row;
+			const Column* m_segment; // the columns of the current row
+			uint64_t m_index;        // the current row in its segment
+
+			bool locate()
+			{
+				if (m_row >= m_rows)
+					return false;
+				m_segment = &m_columns[(size_t)(m_row / m_segmentRows) * m_columnCount];
+				m_index = m_row % m_segmentRows;
+				return true;
+			}
+
+			const Column* current(int column, unsigned flag) const
+			{
+				if (m_row >= m_rows || column < 0 || (size_t)column >= m_columnCount)
+					return nullptr;
+				const Column& col = m_segment[column];
+				if (!(col.flags[m_index] & flag))
+					return nullptr;
+				return &col;
+			}
+		public:
+			SnapshotCursor(const MappedFilePtr& file, std::vector<Column>& columns, size_t columnCount, uint64_t segmentRows, uint64_t rows)
+				: m_file(file)
+				, m_columnCount(columnCount)
+				, m_segmentRows(segmentRows)
+				, m_rows(rows)
+				, m_row((uint64_t)-1)
+				, m_segment(nullptr)
+				, m_index(0)
+			{
+				m_columns.swap(columns);
+			}
+
+			bool next() override
+			{
+				if (m_row != (uint64_t)-1 && m_row >= m_rows)
+					return false;
+				++m_row;
+				return locate();
+			}
+
+			size_t columnCount() override { return m_columnCount; }
+			int getInt(int column) override { return (int)getLongLong(column); }
+			long getLong(int column) override { return (long)getLongLong(column); }
+			long long getLongLong(int column) override
+			{
+				const Column* col = current(column, RowCell::VALUE);
+				return col ? col->values[m_index] : 0;
+			}
+			double getDouble(int column) override
+			{
+				const Column* col = current(column, RowCell::REAL);
+				return col ? col->reals[m_index] : 0;
+			}
+			float getFloat(int column) override { return (float)getDouble(column); }
+			Decimal getDecimal(int column) override
+			{
+				const Column* col = current(column, RowCell::DECIMAL);
+				return col ? Decimal(col->decimals[m_index].unscaled, col->decimals[m_index].scale) : Decimal();
+			}
+			tyme::time_t getTimestamp(int column) override { return (tyme::time_t)getLongLong(column); }
+			const char* getText(int column) override
+			{
+				const Column* col = current(column, RowCell::DATA);
+				if (!col)
+					return nullptr;
+				const TextCell& text = col->texts[m_index];
+				if (text.offset >= m_file->size() || text.size >= m_file->size() - text.offset)
+					return nullptr;
+				return m_file->at<char>(text.offset, 0);
+			}
+			size_t getBlobSize(int column) override
+			{
+				const Column* col = current(column, RowCell::SIZE);
+				return col ? (size_t)col->texts[m_index].size : 0;
+			}
+			const void* getBlob(int column) override { return getText(column); }
+			bool isNull(int column) override
+			{
+				const Column* col = current(column, RowCell::NULLNESS);
+				if (col)
+					return (col->flags[m_index] & NULL_VALUE) != 0;
+				return !current(column, RowCell::VALUE | RowCell::DATA | RowCell::REAL | RowCell::DECIMAL);
+			}
+			ConnectionPtr getConnection() const override { return nullptr; }
+			StatementPtr getStatement() const override { return nullptr; }
+			size_t rowCount() override { return (size_t)m_rows; }
+			size_t bookmark() override { return m_row < m_rows ? (size_t)m_row : npos; }
+			bool seek(size_t row) override
+			{
+				if (row >= m_rows)
+					return false;
+				m_row = row;
+				return locate();
+			}
+			bool rewind() override { m_row = (uint64_t)-1; return true; }
+		};
+
+		// the whole file is never kept in memory; sync() makes it durable
+		// before it replaces the previous one
+		class Writer
+		{
+#ifdef _WIN32
+			HANDLE m_file;
+#else
+			int m_fd;
+#endif
+			uint64_t m_pos;
+			bool m_good;
+
+			bool put(const void* data, size_t size);
+		public:
+			Writer();
+			~Writer() { close(); }
+			bool open(const filesystem::path& path);
+			bool good() const { return m_good; }
+			uint64_t pos() const { return m_pos; }
+			bool sync();
+			void close();
+			// overwrites the beginning of the file, e.g. the header
+			void rewrite(const void* data, size_t size);
+
+			void write(const void* data, size_t size)
+			{
+				if (m_good && size)
+					m_good = put(data, size);
+				m_pos += size;
+			}
+			template <typename T>
+			void write(const std::vector<T>& items)
+			{
+				if (!items.empty())
+					write(&items[0], items.size() * sizeof(T));
+			}
+			void pad(uint64_t pos)
+			{
+				static const char zeros[8] = {};
+				while (m_pos < pos)
+					write(zeros, pos - m_pos < sizeof(zeros) ? (size_t)(pos - m_pos) : sizeof(zeros));
+			}
+		};
+
+#ifdef _WIN32
+		Writer::Writer()
+			: m_file(INVALID_HANDLE_VALUE)
+			, m_pos(0)
+			, m_good(false)
+		{
+		}
+
+		bool Writer::open(const filesystem::path& path)
+		{
+			m_file = CreateFileW(path.native().c_str(), GENERIC_WRITE, 0, nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr);
+			return m_good = m_file != INVALID_HANDLE_VALUE;
+		}
+
+		bool Writer::put(const void* data, size_t size)
+		{
+			const char* ptr = (const char*)data;
+			while (size)
+			{
+				DWORD chunk = size > 0x40000000 ? 0x40000000 : (DWORD)size;
+				DWORD written = 0;
+				if (!WriteFile(m_file, ptr, chunk, &written, nullptr) || !written)
+					return false;
+				ptr += written;
+				size -= written;
+			}
+			return true;
+		}
+
+		void Writer::rewrite(const void* data, size_t size)
+		{
+			LARGE_INTEGER start = {}, end;
+			end.QuadPart = (LONGLONG)m_pos;
+			if (m_good)
+				m_good = SetFilePointerEx(m_file, start, nullptr, FILE_BEGIN) && put(data, size) && SetFilePointerEx(m_file, end, nullptr, FILE_BEGIN);
+		}
+
+		bool Writer::sync()
+		{
+			return m_good && FlushFileBuffers(m_file);
+		}
+
+		void Writer::close()
+		{
+			if (m_file != INVALID_HANDLE_VALUE)
+				CloseHandle(m_file);
+			m_file = INVALID_HANDLE_VALUE;
+		}
+
+		bool replace(const filesystem::path& temp, const filesystem::path& path)
+		{
+			return MoveFileExW(temp.native().c_str(), path.native().c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+		}
+
+		void discard(const filesystem::path& temp)
+		{
+			DeleteFileW(temp.native().c_str());
+		}
+#else
+		Writer::Writer()
+			: m_fd(-1)
+			, m_pos(0)
+			, m_good(false)
+		{
+		}
+
+		bool Writer::open(const filesystem::path& path)
+		{
+			m_fd = ::open(path.native().c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+			return m_good = m_fd >= 0;
+		}
+
+		bool Writer::put(const void* data, size_t size)
+		{
+			const char* ptr = (const char*)data;
+			while (size)
+			{
+				ssize_t written = ::write(m_fd, ptr, size);
+				if (written < 0 && errno == EINTR)
+					continue;
+				if (written <= 0)
+					return false;
+				ptr += written;
+				size -= written;
+			}
+			return true;
+		}
+
+		void Writer::rewrite(const void* data, size_t size)
+		{
+			if (m_good)
+				m_good = pwrite(m_fd, data, size, 0) == (ssize_t)size;
+		}
+
+		bool Writer::sync()
+		{
+			return m_good && fsync(m_fd) == 0;
+		}
+
+		void Writer::close()
+		{
+			if (m_fd >= 0)
+				::close(m_fd);
+			m_fd = -1;
+		}
+
+		bool replace(const filesystem::path& temp, const filesystem::path& path)
+		{
+			if (rename(temp.native().c_str(), path.native().c_str()) != 0)
+				return false;
+
+			// the new directory entry, too
+			filesystem::path dir = path.parent_path();
+			int fd = ::open(dir.empty() ? "." : dir.native().c_str(), O_RDONLY);
+			if (fd >= 0)
+			{
+				fsync(fd);
+				::close(fd);
+			}
+			return true;
+		}
+
+		void discard(const filesystem::path& temp)
+		{
+			unlink(temp.native().c_str());
+		}
+#endif
+
+		// next to the target, one per writer, even in other processes
+		filesystem::path temporary(const filesystem::path& path)
+		{
+			static std::atomic<unsigned> counter(0);
+#ifdef _WIN32
+			unsigned long pid = GetCurrentProcessId();
+#else
+			unsigned long pid = (unsigned long)getpid();
+#endif
+			char suffix[48];
+			snprintf(suffix, sizeof(suffix), ".%lu.%u.tmp", pid, ++counter);
+			return filesystem::path(path.string() + suffix);
+		}
+
+		// the texts of the segment first, then the arrays of each column
+		void writeSegment(Writer& out, const RowChunk& chunk, std::vector<ColumnEntry>& directory)
+		{
+			size_t rows = chunk.rows();
+			size_t columns = chunk.columns();
+			std::vector<unsigned> kinds(columns, 0);
+			std::vector<uint64_t> offsets(rows * columns, 0);
+			for (size_t row = 0; row < rows; ++row)
+			{
+				for (size_t col = 0; col < columns; ++col)
+				{
+					const RowCell& cell = chunk.cell(row, col);
+					kinds[col] |= cell.flags;
+					if (cell.flags & RowCell::DATA)
+					{
+						offsets[row * columns + col] = out.pos();
+						out.write(chunk.data(cell), cell.size + 1);
+					}
+				}
+			}
+			out.pad(align(out.pos()));
+
+			for (size_t col = 0; col < columns; ++col)
+			{
+				ColumnEntry entry = {};
+
+				std::vector<unsigned char> flags(rows);
+				for (size_t row = 0; row < rows; ++row)
+				{
+					const RowCell& cell = chunk.cell(row, col);
+					flags[row] = (unsigned char)cell.flags;
+					if ((cell.flags & RowCell::NULLNESS) && cell.null)
+						flags[row] |= NULL_VALUE;
+				}
+				entry.flags = out.pos();
+				out.write(flags);
+				out.pad(align(out.pos()));
+
+				// only the arrays, which were recorded, are stored
+				if (kinds[col] & RowCell::VALUE)
+				{
+					std::vector<int64_t> values(rows);
+					for (size_t row = 0; row < rows; ++row)
+						values[row] = chunk.cell(row, col).value;
+					entry.values = out.pos();
+					out.write(values);
+				}
+				if (kinds[col] & RowCell::REAL)
+				{
+					std::vector<double> reals(rows);
+					for (size_t row = 0; row < rows; ++row)
+						reals[row] = chunk.cell(row, col).real;
+					entry.reals = out.pos();
+					out.write(reals);
+				}
+				if (kinds[col] & RowCell::DECIMAL)
+				{
+					std::vector<DecimalCell> decimals(rows);
+					for (size_t row = 0; row < rows; ++row)
+					{
+						const Decimal& value = chunk.cell(row, col).decimal;
+						DecimalCell cell = { value.unscaled, value.scale, 0 };
+						decimals[row] = cell;
+					}
+					entry.decimals = out.pos();
+					out.write(decimals);
+				}
+				if (kinds[col] & (RowCell::SIZE | RowCell::DATA))
+				{
+					std::vector<TextCell> texts(rows);
+					for (size_t row = 0; row < rows; ++row)
+					{
+						TextCell item = { offsets[row * columns + col], chunk.cell(row, col).size };
+						texts[row] = item;
+					}
+					entry.texts = out.pos();
+					out.write(texts);
+				}
+
+				directory.push_back(entry);
+			}
+		}
+
+		bool readHeader(const MappedFile& file, const Header*& header, const char*& tag)
+		{
+			header = file.at<Header>(0, 1);
+			if (!header || memcmp(header->magic, MAGIC, sizeof(MAGIC)) || header->version != VERSION || header->byteOrder != BYTE_ORDER_MARK)
+				return false;
+			tag = file.at<char>(sizeof(Header), header->tagSize);
+			return tag != nullptr;
+		}
+	}
+
+	bool Snapshot::write(const filesystem::path& path, const std::string& tag, const CursorPtr& c, const Capture& capture)
+	{
+		if (!c)
+			return false;
+
+		size_t columns = c->columnCount();
+		filesystem::path temp = temporary(path);
+		Writer out;
+		if (!out.open(temp))
+			return false;
+
+		// the magic goes in with the rest of the header, after the rows
+		Header header = {};
+		header.version = VERSION;
+		header.byteOrder = BYTE_ORDER_MARK;
+		header.columns = columns;
+		header.created = time(nullptr);
+		header.tagSize = tag.size();
+		header.segmentRows = BATCH;
+		out.write(&header, sizeof(header));
+		out.write(tag.data(), tag.size());
+		out.pad(align(out.pos()));
+
+		std::vector<ColumnEntry> directory;
+		uint64_t rows = 0;
+		try {
+			auto recorder = std::make_shared<RowRecorder>(c);
+			CursorPtr recording = recorder;
+			bool more = true;
+			while (more && out.good())
+			{
+				auto chunk = std::make_shared<RowChunk>(columns);
+				chunk->reserve(BATCH);
+				recorder->attach(chunk);
+				while (chunk->rows() < BATCH && (more = recorder->next()))
+				{
+					if (capture)
+						capture(recording);
+				}
+				recorder->attach(nullptr);
+
+				if (!chunk->rows())
+					break;
+				rows += chunk->rows();
+				writeSegment(out, *chunk, directory);
+			}
+		} catch (std::bad_alloc&) {
+			out.close();
+			discard(temp);
+			return false;
+		}
+
+		// a cursor, which failed, would leave a snapshot cut short
+		StatementPtr stmt = c->getStatement();
+		if (stmt && stmt->errorCode())
+		{
+			out.close();
+			discard(temp);
+			return false;
+		}
+
+		header.rows = rows;
+		header.directoryOffset = out.pos();
+		out.write(directory);
+		memcpy(header.magic, MAGIC, sizeof(MAGIC));
+		out.rewrite(&header, sizeof(header));
+
+		bool written = out.sync();
+		out.close();
+		if (!written || !replace(temp, path))
+		{
+			discard(temp);
+			return false;
+		}
+		return true;
+	}
+
+	CursorPtr Snapshot::open(const filesystem::path& path, const std::string& tag, long long maxAge)
+	{
+		try {
+			auto file = std::make_shared<MappedFile>();
+			if (!file->open(path))
+				return nullptr;
+
+			const Header* header;
+			const char* stored;
+			if (!readHeader(*file, header, stored))
+				return nullptr;
+
+			if (header->tagSize != tag.size() || memcmp(stored, tag.data(), tag.size()))
+				return nullptr;
+
+			if (maxAge > 0 && time(nullptr) - header->created > maxAge)
+				return nullptr;
+
+			uint64_t rows = header->rows;
+			uint64_t segmentRows = header->segmentRows;
+			if (rows && !segmentRows)
+				return nullptr;
+
+			uint64_t segments = rows ? (rows - 1) / segmentRows + 1 : 0;
+			size_t count = (size_t)header->columns;
+			if (count != header->columns || (count && segments > file->size() / count))
+				return nullptr;
+
+			const ColumnEntry* directory = file->at<ColumnEntry>(header->directoryOffset, segments * count);
+			if (!directory)
+				return nullptr;
+
+			std::vector<SnapshotCursor::Column> columns((size_t)(segments * count));
+			for (uint64_t segment = 0; segment < segments; ++segment)
+			{
+				uint64_t first = segment * segmentRows;
+				uint64_t length = rows - first < segmentRows ? rows - first : segmentRows;
+				for (size_t col = 0; col < count; ++col)
+				{
+					const ColumnEntry& entry = directory[segment * count + col];
+					SnapshotCursor::Column& column = columns[(size_t)(segment * count) + col];
+					column.flags = file->at<unsigned char>(entry.flags, length);
+					column.values = entry.values ? file->at<int64_t>(entry.values, length) : nullptr;
+					column.reals = entry.reals ? file->at<double>(entry.reals, length) : nullptr;
+					column.decimals = entry.decimals ? file->at<DecimalCell>(entry.decimals, length) : nullptr;
+					column.texts = entry.texts ? file->at<TextCell>(entry.texts, length) : nullptr;
+
+					if (!column.flags ||
+						(entry.values && !column.values) ||
+						(entry.reals && !column.reals) ||
+						(entry.decimals && !column.decimals) ||
+						(entry.texts && !column.texts))
+						return nullptr;
+
+					// a cell cannot claim an array, which was not stored
+					unsigned missing = 0;
+					if (!column.values) missing |= RowCell::VALUE;
+					if (!column.reals) missing |= RowCell::REAL;
+					if (!column.decimals) missing |= RowCell::DECIMAL;
+					if (!column.texts) missing |= RowCell::SIZE | RowCell::DATA;
+					if (!missing)
+						continue;
+					for (uint64_t row = 0; row < length; ++row)
+					{
+						if (column.flags[row] & missing)
+							return nullptr;
+					}
+				}
+			}
+
+			return std::make_shared<SnapshotCursor>(file, columns, count, segmentRows, rows);
+		} catch (std::bad_alloc&) { return nullptr; }
+	}
+
+	bool Snapshot::info(const filesystem::path& path, SnapshotInfo& info)
+	{
+		MappedFile file;
+		if (!file.open(path))
+			return false;
+
+		const Header* header;
+		const char* tag;
+		if (!readHeader(file, header, tag))
+			return false;
+
+		info.version = header->version;
+		info.columns = (size_t)header->columns;
+		info.rows = header->rows;
+		info.created = header->created;
+		info.tag.assign(tag, (size_t)header->tagSize);
+		return true;
+	}
+}
@@ -0,0 +1,444 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include <db/tracing.hpp>
+#include <filesystem.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+
+namespace db
+{
+	std::atomic<bool> Tracer::s_enabled(false);
+
+	namespace
+	{
+		struct SpanRecord
+		{
+			unsigned long long traceId;
+			unsigned long long spanId;
+			unsigned long long parentId;
+			const char* name; // a string literal, read by the exporter
+			long long start;
+			long long duration;
+			long long value;
+			unsigned thread;
+			char detail[96];
+		};
+
+		// bounded MPMC ring after D. Vyukov; the exporter is the only consumer
+		class Ring
+		{
+			struct Cell
+			{
+				std::atomic<size_t> sequence;
+				SpanRecord span;
+			};
+
+			std::unique_ptr<Cell[]> m_cells;
+			size_t m_mask;
+			std::atomic<size_t> m_enqueue;
+			size_t m_dequeue;
+		public:
+			explicit Ring(size_t capacity)
+				: m_cells(new Cell[capacity])
+				, m_mask(capacity - 1)
+				, m_enqueue(0)
+				, m_dequeue(0)
+			{
+				for (size_t i = 0; i < capacity; ++i)
+					m_cells[i].sequence.store(i, std::memory_order_relaxed);
+			}
+
+			bool push(const SpanRecord& span)
+			{
+				size_t pos = m_enqueue.load(std::memory_order_relaxed);
+				for (;;)
+				{
+					Cell& cell = m_cells[pos & m_mask];
+					size_t sequence = cell.sequence.load(std::memory_order_acquire);
+					intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+					if (!diff)
+					{
+						if (m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						{
+							cell.span = span;
+							cell.sequence.store(pos + 1, std::memory_order_release);
+							return true;
+						}
+					}
+					else if (diff < 0)
+						return false; // full
+					else
+						pos = m_enqueue.load(std::memory_order_relaxed);
+				}
+			}
+
+			bool pop(SpanRecord& span)
+			{
+				Cell& cell = m_cells[m_dequeue & m_mask];
+				size_t sequence = cell.sequence.load(std::memory_order_acquire);
+				if ((intptr_t)sequence - (intptr_t)(m_dequeue + 1) < 0)
+					return false;
+				span = cell.span;
+				cell.sequence.store(m_dequeue + m_mask + 1, std::memory_order_release);
+				++m_dequeue;
+				return true;
+			}
+		};
+
+		struct State
+		{
+			Ring ring;
+			TracerOptions options;
+			std::ofstream out;
+			long long epoch; // system time of steady 0, in us
+			bool first;
+			std::mutex mutex;
+			std::condition_variable wake;
+			bool stopping;
+			std::thread exporter;
+			std::atomic<unsigned long long> recorded;
+			std::atomic<unsigned long long> dropped;
+			std::atomic<unsigned long long> exported;
+
+			State(size_t capacity, const TracerOptions& options)
+				: ring(capacity)
+				, options(options)
+				, epoch(0)
+				, first(true)
+				, stopping(false)
+				, recorded(0)
+				, dropped(0)
+				, exported(0)
+			{
+			}
+		};
+		typedef std::shared_ptr<State> StatePtr;
+
+		StatePtr s_state;
+		std::mutex s_control;
+		thread_local TraceContext t_context = { 0, 0, false };
+
+		unsigned long long mix(unsigned long long value)
+		{
+			// splitmix64
+			value += 0x9E3779B97F4A7C15ULL;
+			value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+			return value ^ (value >> 31);
+		}
+
+		unsigned long long nextId()
+		{
+			static std::atomic<unsigned long long> counter(
+				(unsigned long long)std::chrono::system_clock::now().time_since_epoch().count());
+			unsigned long long id;
+			do
+				id = mix(counter.fetch_add(1, std::memory_order_relaxed));
+			while (!id);
+			return id;
+		}
+
+		unsigned threadNumber()
+		{
+			static std::atomic<unsigned> counter(0);
+			thread_local unsigned number = ++counter;
+			return number;
+		}
+
+		void escape(std::string& out, const char* text)
+		{
+			for (; *text; ++text)
+			{
+				unsigned char c = *text;
+				if (c == '"' || c == '\\')
+				{
+					out += '\\';
+					out += c;
+				}
+				else if (c < 0x20)
+				{
+					char code[8];
+					snprintf(code, sizeof(code), "\\u%04x", c);
+					out += code;
+				}
+				else
+					out += c;
+			}
+		}
+
+		void format(const State& state, const SpanRecord& span, std::string& out)
+		{
+			char buffer[256];
+			long long start = state.epoch + span.start;
+			if (state.options.format == TracerOptions::CHROME_TRACE)
+			{
+				out += state.first ? "" : ",\n";
+				out += "{\"name\":\"";
+				escape(out, span.name);
+				snprintf(buffer, sizeof(buffer),
+					"\",\"cat\":\"db\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%u,\"args\":{\"trace\":\"%016llx\",\"span\":\"%016llx\",\"parent\":\"%016llx\"",
+					start, span.duration, (int)_getpid(), span.thread, span.traceId, span.spanId, span.parentId);
+				out += buffer;
+			}
+			else
+			{
+				snprintf(buffer, sizeof(buffer),
+					"{\"trace\":\"%016llx\",\"span\":\"%016llx\",\"parent\":\"%016llx\",\"start\":%lld,\"duration\":%lld,\"thread\":%u,\"name\":\"",
+					span.traceId, span.spanId, span.parentId, start, span.duration, span.thread);
+				out += buffer;
+				escape(out, span.name);
+				out += "\"";
+			}
+
+			if (span.value >= 0)
+			{
+				snprintf(buffer, sizeof(buffer), ",\"value\":%lld", span.value);
+				out += buffer;
+			}
+			if (*span.detail)
+			{
+				out += ",\"detail\":\"";
+				escape(out, span.detail);
+				out += "\"";
+			}
+			out += state.options.format == TracerOptions::CHROME_TRACE ? "}}" : "}\n";
+		}
+
+		void drain(State& state)
+		{
+			std::string out;
+			SpanRecord span;
+			while (state.ring.pop(span))
+			{
+				format(state, span, out);
+				state.first = false;
+				state.exported.fetch_add(1, std::memory_order_relaxed);
+			}
+			if (!out.empty())
+			{
+				state.out.write(out.data(), out.size());
+				state.out.flush();
+			}
+		}
+
+		void run(State* state)
+		{
+			std::unique_lock<std::mutex> lock(state->mutex);
+			while (!state->stopping)
+			{
+				state->wake.wait_for(lock, std::chrono::milliseconds(state->options.interval));
+				lock.unlock();
+				drain(*state);
+				lock.lock();
+			}
+		}
+	}
+
+	bool Tracer::start(const filesystem::path& file, const TracerOptions& options)
+	{
+		std::lock_guard<std::mutex> control(s_control);
+		if (std::atomic_load(&s_state))
+			return false;
+
+		size_t capacity = 2;
+		while (capacity < options.capacity)
+			capacity <<= 1;
+
+		StatePtr state;
+		try {
+			state = std::make_shared<State>(capacity, options);
+		} catch (std::bad_alloc&) { return false; }
+
+		state->out.open(file.native(), std::ios::out | std::ios::trunc | std::ios::binary);
+		if (!state->out.is_open())
+			return false;
+		if (options.format == TracerOptions::CHROME_TRACE)
+			state->out << "[\n";
+
+		using namespace std::chrono;
+		long long system = duration_cast<microseconds>(system_clock::now().time_since_epoch()).count();
+		state->epoch = system - Span::now();
+
+		try {
+			state->exporter = std::thread(run, state.get());
+		} catch (std::exception&) { return false; }
+
+		std::atomic_store(&s_state, state);
+		s_enabled.store(true);
+		return true;
+	}
+
+	void Tracer::stop()
+	{
+		std::lock_guard<std::mutex> control(s_control);
+		StatePtr state = std::atomic_load(&s_state);
+		if (!state)
+			return;
+
+		s_enabled.store(false);
+		std::atomic_store(&s_state, StatePtr());
+		{
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->stopping = true;
+			state->wake.notify_one();
+		}
+		state->exporter.join();
+
+		// the spans, which started before the tracer was disabled
+		drain(*state);
+		if (state->options.format == TracerOptions::CHROME_TRACE)
+			state->out << "\n]\n";
+		state->out.close();
+	}
+
+	TracerStats Tracer::stats()
+	{
+		TracerStats stats = {};
+		StatePtr state = std::atomic_load(&s_state);
+		if (state)
+		{
+			stats.recorded = state->recorded.load();
+			stats.dropped = state->dropped.load();
+			stats.exported = state->exported.load();
+		}
+		return stats;
+	}
+
+	TraceContext Tracer::root()
+	{
+		TraceContext context = { nextId(), nextId(), false };
+		StatePtr state = enabled() ? std::atomic_load(&s_state) : StatePtr();
+		if (state)
+		{
+			double draw = (double)(mix(context.traceId) >> 11) / (double)(1ULL << 53);
+			context.sampled = draw < state->options.sampling;
+		}
+		return context;
+	}
+
+	TraceContext Tracer::current()
+	{
+		return t_context;
+	}
+
+	Tracer::Scope::Scope(const TraceContext& context)
+		: m_previous(t_context)
+	{
+		t_context = context;
+	}
+
+	Tracer::Scope::~Scope()
+	{
+		t_context = m_previous;
+	}
+
+	long long Span::now()
+	{
+		using namespace std::chrono;
+		return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	void Span::begin()
+	{
+		TraceContext& context = t_context;
+		if (!context.traceId || !context.sampled)
+			return;
+
+		m_traceId = context.traceId;
+		m_parentId = context.spanId;
+		m_spanId = nextId();
+		m_start = now();
+		m_active = true;
+
+		// the spans started inside this one are its children
+		context.spanId = m_spanId;
+	}
+
+	static void push(unsigned long long traceId, unsigned long long spanId, unsigned long long parentId, const char* name, long long start, long long duration, long long value, const char* detail)
+	{
+		StatePtr state = std::atomic_load(&s_state);
+		if (!state)
+			return;
+
+		SpanRecord span;
+		span.traceId = traceId;
+		span.spanId = spanId;
+		span.parentId = parentId;
+		span.name = name ? name : "";
+		span.start = start;
+		span.duration = duration;
+		span.value = value;
+		span.thread = threadNumber();
+		size_t length = 0;
+		if (detail)
+		{
+			while (length < sizeof(span.detail) - 1 && detail[length])
+				++length;
+			// a UTF-8 character, which does not fit whole, is left out
+			if (detail[length])
+			{
+				while (length && ((unsigned char)detail[length] & 0xC0) == 0x80)
+					--length;
+			}
+			memcpy(span.detail, detail, length);
+		}
+		span.detail[length] = 0;
+
+		if (state->ring.push(span))
+			state->recorded.fetch_add(1, std::memory_order_relaxed);
+		else
+			state->dropped.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void Span::end()
+	{
+		if (!m_active)
+			return;
+		m_active = false;
+
+		TraceContext& context = t_context;
+		if (context.spanId == m_spanId)
+			context.spanId = m_parentId;
+
+		push(m_traceId, m_spanId, m_parentId, m_name, m_start, now() - m_start, m_value, m_detail);
+	}
+
+	void Span::record(const char* name, long long start, long long duration, long long value, const char* detail)
+	{
+		if (!Tracer::enabled())
+			return;
+
+		const TraceContext& context = t_context;
+		if (!context.traceId || !context.sampled)
+			return;
+
+		push(context.traceId, nextId(), context.spanId, name, start, duration, value, detail);
+	}
+}
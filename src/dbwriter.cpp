@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include <db/writer.hpp>
+#include <chrono>
+#include <sstream>
+
+extern "C" void flog(const char* file, int line, const char* fmt, ...);
+#define WRITER_LOG(...) ::flog(__FILE__, __LINE__, __VA_ARGS__)
+
+namespace db
+{
+	static long long now()
+	{
+		using namespace std::chrono;
+		return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	WriteRow& WriteRow::push(Cell::Kind kind, long long value, const void* data, size_t size)
+	{
+		Cell cell = { kind, value, m_data.size(), size };
+		if (data)
+			m_data.append((const char*)data, size);
+		m_cells.push_back(cell);
+		return *this;
+	}
+
+	bool WriteRow::bind(const StatementPtr& stmt, int first) const
+	{
+		int arg = first;
+		for (auto&& cell : m_cells)
+		{
+			bool ret = false;
+			switch (cell.kind)
+			{
+			case Cell::NUL: ret = stmt->bindNull(arg); break;
+			case Cell::INTEGER: ret = stmt->bind(arg, cell.value); break;
+			case Cell::TEXT: ret = stmt->bindTextRef(arg, m_data.data() + cell.offset, cell.size); break;
+			case Cell::BLOB: ret = stmt->bindBlobRef(arg, m_data.data() + cell.offset, cell.size); break;
+			case Cell::TIME: ret = stmt->bindTime(arg, (tyme::time_t)cell.value); break;
+			}
+			if (!ret)
+				return false;
+			++arg;
+		}
+		return true;
+	}
+
+	static std::mutex& registryMutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	static std::vector< std::weak_ptr<WriteBehind> >& registry()
+	{
+		static std::vector< std::weak_ptr<WriteBehind> > writers;
+		return writers;
+	}
+
+	WriteBehind::WriteBehind(const ConnectionPtr& conn, const std::string& table, const std::vector<std::string>& columns, const WriterOptions& options)
+		: m_conn(conn)
+		, m_columns(columns.size())
+		, m_options(options)
+		, m_head(&m_stub)
+		, m_tail(&m_stub)
+		, m_depth(0)
+		, m_blocked(0)
+		, m_closed(false)
+		, m_accepted(0)
+		, m_dropped(0)
+		, m_flushRequested(0)
+		, m_flushServed(0)
+		, m_stopped(false)
+		, m_written(0)
+		, m_failed(0)
+		, m_flushes(0)
+		, m_flushTotal(0)
+		, m_flushMax(0)
+		, m_error(0)
+	{
+		// the server takes at most 65535 arguments in a statement
+		size_t maxRows = m_columns ? 65535 / m_columns : 1;
+		if (!m_options.batchRows)
+			m_options.batchRows = 1;
+		if (maxRows && m_options.batchRows > maxRows)
+			m_options.batchRows = maxRows;
+		if (m_options.capacity < m_options.batchRows)
+			m_options.capacity = m_options.batchRows;
+
+		std::ostringstream s;
+		s << "INSERT INTO " << table << " (";
+		bool first = true;
+		for (auto&& column : columns)
+		{
+			if (first) first = false;
+			else s << ", ";
+			s << column;
+		}
+		s << ") VALUES";
+		m_insert = s.str();
+	}
+
+	WriteBehind::~WriteBehind()
+	{
+		close();
+
+		Node* node = m_tail;
+		while (node)
+		{
+			Node* next = node->next.load();
+			if (node != &m_stub)
+				delete node;
+			node = next;
+		}
+	}
+
+	WriteBehindPtr WriteBehind::create(const ConnectionPtr& conn, const std::string& table, const std::vector<std::string>& columns, const WriterOptions& options)
+	{
+		if (!conn || columns.empty())
+			return nullptr;
+
+		try {
+			auto writer = std::make_shared<WriteBehind>(conn, table, columns, options);
+			writer->m_thread = std::thread(&WriteBehind::run, writer.get());
+
+			std::lock_guard<std::mutex> lock(registryMutex());
+			auto& writers = registry();
+			for (auto it = writers.begin(); it != writers.end();)
+			{
+				if (it->expired())
+					it = writers.erase(it);
+				else
+					++it;
+			}
+			writers.push_back(writer);
+			return writer;
+		} catch (std::exception&) { return nullptr; }
+	}
+
+	void WriteBehind::closeAll()
+	{
+		std::vector< std::weak_ptr<WriteBehind> > writers;
+		{
+			std::lock_guard<std::mutex> lock(registryMutex());
+			writers.swap(registry());
+		}
+
+		for (auto&& weak : writers)
+		{
+			auto writer = weak.lock();
+			if (writer)
+				writer->close();
+		}
+	}
+
+	bool WriteBehind::push(Node* node)
+	{
+		for (;;)
+		{
+			if (m_closed.load())
+				return false;
+
+			size_t depth = m_depth.fetch_add(1);
+			if (depth < m_options.capacity)
+			{
+				Node* prev = m_head.exchange(node);
+				prev->next.store(node);
+
+				if (depth + 1 == m_options.batchRows)
+				{
+					{ std::lock_guard<std::mutex> lock(m_mutex); }
+					m_wake.notify_one();
+				}
+				return true;
+			}
+			m_depth.fetch_sub(1);
+
+			if (m_options.overflow == WriterOptions::DROP)
+				return false;
+
+			++m_blocked;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_wake.notify_one();
+				m_space.wait(lock, [this] { return m_closed.load() || m_depth.load() < m_options.capacity; });
+			}
+			--m_blocked;
+		}
+	}
+
+	bool WriteBehind::pop(WriteRow& row)
+	{
+		Node* tail = m_tail;
+		Node* next = tail->next.load();
+		if (!next)
+			return false;
+
+		// the popped node stays as the new stub
+		row = std::move(next->row);
+		m_tail = next;
+		if (tail != &m_stub)
+			delete tail;
+		m_depth.fetch_sub(1);
+		return true;
+	}
+
+	// after the flusher has stopped, under m_mutex
+	void WriteBehind::dropQueued()
+	{
+		WriteRow row;
+		while (pop(row))
+			++m_dropped;
+	}
+
+	bool WriteBehind::write(WriteRow&& row)
+	{
+		if (row.size() != m_columns)
+			return false;
+
+		Node* node = new (std::nothrow) Node();
+		if (!node)
+		{
+			++m_dropped;
+			return false;
+		}
+		node->row = std::move(row);
+
+		if (!push(node))
+		{
+			delete node;
+			++m_dropped;
+			return false;
+		}
+		++m_accepted;
+
+		// the flusher may have left before the node was linked; close()
+		// drops the rows linked before it stops the writer, this drops
+		// the later ones
+		if (m_closed.load())
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_stopped)
+				dropQueued();
+		}
+		return true;
+	}
+
+	bool WriteBehind::insert(const std::vector<WriteRow>& batch, StatementPtr& stmt)
+	{
+		if (batch.size() == m_options.batchRows)
+		{
+			if (!m_full)
+				m_full = prepareInsert(m_conn, m_insert.c_str(), m_columns, batch.size());
+			stmt = m_full;
+		}
+		else
+			stmt = prepareInsert(m_conn, m_insert.c_str(), m_columns, batch.size());
+
+		if (!stmt)
+			return false;
+
+		int arg = 0;
+		for (auto&& row : batch)
+		{
+			if (!row.bind(stmt, arg))
+				return false;
+			arg += (int)m_columns;
+		}
+		return stmt->execute();
+	}
+
+	void WriteBehind::flush(std::vector<WriteRow>& batch)
+	{
+		long long start = now();
+		StatementPtr stmt;
+		bool ret = insert(batch, stmt);
+		if (!ret && !m_conn->isStillAlive())
+		{
+			// the server went away, the batch gets one more chance
+			// over a new connection
+			m_full.reset();
+			if (m_conn->reconnect())
+				ret = insert(batch, stmt);
+		}
+
+		long long spent = now() - start;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		++m_flushes;
+		m_flushTotal += spent;
+		if (spent > m_flushMax)
+			m_flushMax = spent;
+
+		if (ret)
+		{
+			m_written += batch.size();
+			return;
+		}
+
+		m_failed += batch.size();
+		ErrorReporter* source = stmt ? (ErrorReporter*)stmt.get() : m_conn.get();
+		m_error = source->errorCode();
+		m_message = source->errorMessage() ? source->errorMessage() : "";
+		WRITER_LOG("[WriteBehind] %u row(s) lost: %s", (unsigned)batch.size(), m_message.c_str());
+
+		m_full.reset();
+	}
+
+	void WriteBehind::run()
+	{
+		std::vector<WriteRow> batch;
+		batch.reserve(m_options.batchRows);
+
+		for (;;)
+		{
+			unsigned long long requested;
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_wake.wait_for(lock, std::chrono::milliseconds(m_options.interval), [this] {
+					return m_closed.load() || m_flushRequested != m_flushServed || m_blocked.load() || m_depth.load() >= m_options.batchRows;
+				});
+				requested = m_flushRequested;
+			}
+
+			WriteRow row;
+			while (pop(row))
+			{
+				batch.push_back(std::move(row));
+				if (batch.size() == m_options.batchRows)
+				{
+					flush(batch);
+					batch.clear();
+					if (m_blocked.load())
+					{
+						std::lock_guard<std::mutex> lock(m_mutex);
+						m_space.notify_all();
+					}
+				}
+			}
+
+			if (!batch.empty())
+			{
+				flush(batch);
+				batch.clear();
+			}
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_flushServed = requested;
+			m_space.notify_all();
+			m_drained.notify_all();
+			if (m_closed.load() && !m_depth.load())
+				break;
+		}
+	}
+
+	void WriteBehind::flush()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_stopped)
+			return;
+		unsigned long long ticket = ++m_flushRequested;
+		m_wake.notify_one();
+		m_drained.wait(lock, [&] { return m_stopped || m_flushServed >= ticket; });
+	}
+
+	void WriteBehind::close()
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (m_closed.exchange(true))
+			{
+				// somebody else is closing it already
+				if (m_thread.get_id() != std::this_thread::get_id())
+					m_drained.wait(lock, [this] { return m_stopped; });
+				return;
+			}
+			m_wake.notify_one();
+			m_space.notify_all();
+		}
+
+		if (m_thread.joinable() && m_thread.get_id() != std::this_thread::get_id())
+			m_thread.join();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		// accepted by a write(), which passed the check of m_closed while
+		// the flusher was leaving
+		dropQueued();
+		m_stopped = true;
+		m_drained.notify_all();
+		m_full.reset();
+	}
+
+	WriterStats WriteBehind::stats()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		WriterStats stats = {};
+		stats.depth = m_depth.load();
+		stats.accepted = m_accepted.load();
+		stats.dropped = m_dropped.load();
+		stats.written = m_written;
+		stats.failed = m_failed;
+		stats.flushes = m_flushes;
+		stats.flushTotal = m_flushTotal;
+		stats.flushMax = m_flushMax;
+		return stats;
+	}
+}
@@ -0,0 +1,367 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include "faulty.hpp"
+#include <utils.hpp>
+#include <chrono>
+#include <stdlib.h>
+#include <thread>
+
+extern "C" void flog(const char* file, int line, const char* fmt, ...);
+#define FAULTY_LOG(...) ::flog(__FILE__, __LINE__, __VA_ARGS__)
+
+namespace db { namespace faulty {
+	bool startup_driver()
+	{
+		REGISTER_DRIVER("faulty", db::faulty::FaultyDriver);
+		return true;
+	}
+
+	void shutdown_driver()
+	{
+	}
+
+	static filesystem::path resolve(const filesystem::path& ini_path, const std::string& file)
+	{
+		if (!file.empty() && (file[0] == '/' || file[0] == '\\' || (file.length() > 1 && file[1] == ':')))
+			return file;
+		return ini_path.parent_path() / file;
+	}
+
+	static bool readNumber(const Driver::Props& props, const std::string& name, long long& value)
+	{
+		std::string prop;
+		if (!Driver::getProp(props, name, prop))
+			return true;
+
+		char* end;
+		value = strtoll(prop.c_str(), &end, 10);
+		return !prop.empty() && !*end && value >= 0;
+	}
+
+	static bool readRate(const Driver::Props& props, const std::string& name, double& value)
+	{
+		std::string prop;
+		if (!Driver::getProp(props, name, prop))
+			return true;
+
+		char* end;
+		value = strtod(prop.c_str(), &end);
+		return !prop.empty() && !*end && value >= 0 && value <= 1;
+	}
+
+	static const char* INJECTED_ERROR = "Injected failure";
+	static const char* INJECTED_DISCONNECT = "Injected disconnect";
+	// what the mysql client reports for a lost connection, CR_SERVER_LOST;
+	// the callers reconnecting on it should see a real disconnect
+	static const long SERVER_LOST = 2013;
+
+	ConnectionPtr FaultyDriver::open(const filesystem::path& ini_path, const Props& props)
+	{
+		std::string target;
+		if (!getProp(props, "target", target) || target.empty())
+		{
+			FAULTY_LOG("[Faulty] invalid configuration: missing `target'");
+			return nullptr;
+		}
+
+		Config config = {};
+		long long seed = 1;
+		static const struct {
+			const char* name;
+			long long Config::* value;
+		} numbers[] = {
+			{ "delay", &Config::delay },
+			{ "jitter", &Config::jitter },
+			{ "tail", &Config::tail },
+			{ "row_delay", &Config::rowDelay }
+		};
+		static const struct {
+			const char* name;
+			double Config::* value;
+		} rates[] = {
+			{ "tail_rate", &Config::tailRate },
+			{ "error_rate", &Config::errorRate },
+			{ "disconnect_rate", &Config::disconnectRate },
+			{ "fetch_error_rate", &Config::fetchErrorRate }
+		};
+
+		bool valid = readNumber(props, "seed", seed);
+		for (size_t i = 0; valid && i < array_size(numbers); ++i)
+		{
+			valid = readNumber(props, numbers[i].name, config.*numbers[i].value);
+			if (!valid)
+				FAULTY_LOG("[Faulty] invalid configuration: bad `%s'", numbers[i].name);
+		}
+		for (size_t i = 0; valid && i < array_size(rates); ++i)
+		{
+			valid = readRate(props, rates[i].name, config.*rates[i].value);
+			if (!valid)
+				FAULTY_LOG("[Faulty] invalid configuration: bad `%s'", rates[i].name);
+		}
+		if (!valid)
+			return nullptr;
+		config.seed = seed;
+
+		ConnectionPtr conn = Connection::open(resolve(ini_path, target));
+		if (!conn)
+			return nullptr;
+
+		// the n-th connection of a file gets the same faults in each run
+		unsigned long long session;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			session = m_sessions[ini_path.string()]++;
+		}
+
+		try {
+			auto dice = std::make_shared<Dice>(config, session);
+			return std::make_shared<FaultyConnection>(conn, dice);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	bool Dice::roll(double rate)
+	{
+		if (rate <= 0)
+			return false;
+		return std::uniform_real_distribution<double>(0.0, 1.0)(m_random) < rate;
+	}
+
+	Dice::Outcome Dice::call()
+	{
+		long long delay = 0;
+		Outcome outcome = PASS;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_lost)
+				return DISCONNECT;
+
+			// always the same number of draws, whatever the outcome
+			delay = m_config.delay * 1000;
+			if (m_config.jitter)
+				delay += std::uniform_int_distribution<long long>(0, m_config.jitter * 1000)(m_random);
+			bool tail = roll(m_config.tailRate);
+			double tailDelay = m_config.tail ? std::exponential_distribution<double>(1.0 / (m_config.tail * 1000))(m_random) : 0;
+			if (tail)
+				delay += (long long)tailDelay;
+
+			bool disconnect = roll(m_config.disconnectRate);
+			bool fail = roll(m_config.errorRate);
+			if (disconnect)
+			{
+				m_lost = true;
+				outcome = DISCONNECT;
+			}
+			else if (fail)
+				outcome = FAIL;
+		}
+
+		if (delay)
+			std::this_thread::sleep_for(std::chrono::microseconds(delay));
+		return outcome;
+	}
+
+	bool Dice::row()
+	{
+		bool fail;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			fail = m_lost || roll(m_config.fetchErrorRate);
+		}
+		if (m_config.rowDelay)
+			std::this_thread::sleep_for(std::chrono::microseconds(m_config.rowDelay));
+		return !fail;
+	}
+
+	bool Dice::lost()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_lost;
+	}
+
+	void Dice::reconnected()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_lost = false;
+	}
+
+	bool FaultyConnection::allowed()
+	{
+		m_error = 0;
+		m_message = nullptr;
+		switch (m_dice->call())
+		{
+		case Dice::PASS:
+			return true;
+		case Dice::FAIL:
+			m_error = error::INJECTED;
+			m_message = INJECTED_ERROR;
+			return false;
+		case Dice::DISCONNECT:
+			m_error = SERVER_LOST;
+			m_message = INJECTED_DISCONNECT;
+			return false;
+		}
+		return false;
+	}
+
+	// preparing needs the server, too
+	bool FaultyConnection::connected()
+	{
+		m_error = 0;
+		m_message = nullptr;
+		if (!m_dice->lost())
+			return true;
+		m_error = SERVER_LOST;
+		m_message = INJECTED_DISCONNECT;
+		return false;
+	}
+
+	bool FaultyConnection::exec(const char* sql)
+	{
+		return allowed() && m_conn->exec(sql);
+	}
+
+	StatementPtr FaultyConnection::prepare(const char* sql)
+	{
+		if (!connected())
+			return nullptr;
+		StatementPtr stmt = m_conn->prepare(sql);
+		if (!stmt)
+			return nullptr;
+		try {
+			return std::make_shared<FaultyStatement>(stmt, shared_from_this(), m_dice);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	StatementPtr FaultyConnection::prepare(const char* sql, long lowLimit, long hiLimit)
+	{
+		if (!connected())
+			return nullptr;
+		StatementPtr stmt = m_conn->prepare(sql, lowLimit, hiLimit);
+		if (!stmt)
+			return nullptr;
+		try {
+			return std::make_shared<FaultyStatement>(stmt, shared_from_this(), m_dice);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	StatementPtr FaultyConnection::direct(const char* sql, bool stream)
+	{
+		if (!connected())
+			return nullptr;
+		StatementPtr stmt = m_conn->direct(sql, stream);
+		if (!stmt)
+			return nullptr;
+		try {
+			return std::make_shared<FaultyStatement>(stmt, shared_from_this(), m_dice);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	bool FaultyConnection::reconnect()
+	{
+		m_error = 0;
+		if (!m_conn->reconnect())
+			return false;
+		m_dice->reconnected();
+		return true;
+	}
+
+	bool FaultyStatement::allowed()
+	{
+		m_error = 0;
+		m_message = nullptr;
+		switch (m_dice->call())
+		{
+		case Dice::PASS:
+			return true;
+		case Dice::FAIL:
+			return fail(error::INJECTED, INJECTED_ERROR);
+		case Dice::DISCONNECT:
+			return fail(SERVER_LOST, INJECTED_DISCONNECT);
+		}
+		return false;
+	}
+
+	bool FaultyStatement::execute()
+	{
+		return allowed() && m_stmt->execute();
+	}
+
+	CursorPtr FaultyStatement::query()
+	{
+		if (!allowed())
+			return nullptr;
+
+		CursorPtr cursor = m_stmt->query();
+		if (!cursor)
+			return nullptr;
+
+		try {
+			return std::make_shared<FaultyCursor>(cursor, shared_from_this(), m_dice);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	ResultsPtr FaultyStatement::results()
+	{
+		if (!allowed())
+			return nullptr;
+
+		ResultsPtr results = m_stmt->results();
+		if (!results)
+			return nullptr;
+
+		try {
+			return std::make_shared<FaultyResults>(results, shared_from_this(), m_dice);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	bool FaultyCursor::next()
+	{
+		if (m_failed)
+			return false;
+		if (!m_dice->row())
+		{
+			m_failed = true;
+			if (m_dice->lost())
+				m_parent->fail(SERVER_LOST, INJECTED_DISCONNECT);
+			else
+				m_parent->fail(error::INJECTED, INJECTED_ERROR);
+			return false;
+		}
+		return m_cursor->next();
+	}
+
+	CursorPtr FaultyResults::cursor()
+	{
+		CursorPtr cursor = m_results->cursor();
+		if (!cursor)
+			return nullptr;
+
+		try {
+			return std::make_shared<FaultyCursor>(cursor, m_parent, m_dice);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+}}
@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __FAULTY_HPP__
+#define __FAULTY_HPP__
+
+#include <db/conn.hpp>
+#include <db/driver.hpp>
+#include <filesystem.hpp>
+#include <mutex>
+#include <random>
+
+namespace db
+{
+	namespace faulty
+	{
+		// Wraps the connection named by `target', slowing it down and
+		// breaking it at the rates given:
+		//
+		//   driver=faulty
+		//   target=orders.ini    (relative to this file)
+		//   seed=1               (the same seed, the same faults in the same order)
+		//   delay=0              (ms added to each execute, query, results and exec)
+		//   jitter=0             (ms, at most, added on top of it, uniformly)
+		//   tail_rate=0          (share of the calls hit by a tail latency...)
+		//   tail=0               (...with this mean, in ms, exponentially)
+		//   row_delay=0          (us added to each next())
+		//   error_rate=0         (share of the calls failing with error::INJECTED)
+		//   disconnect_rate=0    (share of the calls losing the connection until reconnect(),
+		//                         failing with 2013, CR_SERVER_LOST of the mysql client)
+		//   fetch_error_rate=0   (share of the rows, at which the cursor ends early)
+		struct Config
+		{
+			unsigned long long seed;
+			long long delay;
+			long long jitter;
+			double tailRate;
+			long long tail;
+			long long rowDelay;
+			double errorRate;
+			double disconnectRate;
+			double fetchErrorRate;
+		};
+
+		// what happens to the next call; shared by a connection with its
+		// statements and cursors
+		class Dice
+		{
+			std::mutex m_mutex;
+			Config m_config;
+			std::mt19937_64 m_random;
+			bool m_lost;
+			bool roll(double rate);
+		public:
+			enum Outcome
+			{
+				PASS,
+				FAIL,
+				DISCONNECT
+			};
+
+			Dice(const Config& config, unsigned long long session)
+				: m_config(config)
+				, m_random(config.seed * 1000003ULL + session)
+				, m_lost(false)
+			{
+			}
+
+			// sleeps for the drawn latency; DISCONNECT, while the
+			// connection is lost
+			Outcome call();
+			// sleeps for the row delay; false, if the fetch is to fail
+			bool row();
+			bool lost();
+			void reconnected();
+		};
+		typedef std::shared_ptr<Dice> DicePtr;
+
+		class FaultyConnection: public Connection, public std::enable_shared_from_this<FaultyConnection>
+		{
+			ConnectionPtr m_conn;
+			DicePtr m_dice;
+			long m_error;
+			const char* m_message;
+		public:
+			FaultyConnection(const ConnectionPtr& conn, const DicePtr& dice)
+				: m_conn(conn)
+				, m_dice(dice)
+				, m_error(0)
+				, m_message(nullptr)
+			{
+			}
+			// false with the error set, if the call is not to reach the target
+			bool allowed();
+			// false with the error set, while the connection is lost
+			bool connected();
+
+			bool isStillAlive() override { return !m_dice->lost() && m_conn->isStillAlive(); }
+			bool beginTransaction() override { return allowed() && m_conn->beginTransaction(); }
+			bool rollbackTransaction() override { return allowed() && m_conn->rollbackTransaction(); }
+			bool commitTransaction() override { return allowed() && m_conn->commitTransaction(); }
+			bool exec(const char* sql) override;
+			StatementPtr prepare(const char* sql) override;
+			StatementPtr prepare(const char* sql, long lowLimit, long hiLimit) override;
+			StatementPtr direct(const char* sql, bool stream) override;
+			bool reconnect() override;
+			std::string getURI() const override { return m_conn->getURI(); }
+			MemoryBudgetPtr memory() const override { return m_conn->memory(); }
+			const char* errorMessage() override { return m_error ? m_message : m_conn->errorMessage(); }
+			long errorCode() override { return m_error ? m_error : m_conn->errorCode(); }
+		};
+		typedef std::shared_ptr<FaultyConnection> FaultyConnectionPtr;
+
+		class FaultyStatement: public Statement, public std::enable_shared_from_this<FaultyStatement>
+		{
+			StatementPtr m_stmt;
+			FaultyConnectionPtr m_conn;
+			DicePtr m_dice;
+			long m_error;
+			const char* m_message;
+			bool allowed();
+		public:
+			FaultyStatement(const StatementPtr& stmt, const FaultyConnectionPtr& conn, const DicePtr& dice)
+				: m_stmt(stmt)
+				, m_conn(conn)
+				, m_dice(dice)
+				, m_error(0)
+				, m_message(nullptr)
+			{
+			}
+			bool fail(long code, const char* message) { m_error = code; m_message = message; return false; }
+
+			bool bind(int arg, int value) override { return m_stmt->bind(arg, value); }
+			bool bind(int arg, short value) override { return m_stmt->bind(arg, value); }
+			bool bind(int arg, long value) override { return m_stmt->bind(arg, value); }
+			bool bind(int arg, long long value) override { return m_stmt->bind(arg, value); }
+			bool bind(int arg, const char* value) override { return m_stmt->bind(arg, value); }
+			bool bind(int arg, const void* value, size_t size) override { return m_stmt->bind(arg, value, size); }
+			bool bindText(int arg, const char* value, size_t length) override { return m_stmt->bindText(arg, value, length); }
+			bool bindTextRef(int arg, const char* value, size_t length) override { return m_stmt->bindTextRef(arg, value, length); }
+			bool bindBlobRef(int arg, const void* value, size_t size) override { return m_stmt->bindBlobRef(arg, value, size); }
+			bool bindTime(int arg, tyme::time_t value) override { return m_stmt->bindTime(arg, value); }
+			bool bindNull(int arg) override { return m_stmt->bindNull(arg); }
+			void setBuffered(bool buffered) override { m_stmt->setBuffered(buffered); }
+			void setTimeout(long milliseconds) override { m_stmt->setTimeout(milliseconds); }
+			bool execute() override;
+			CursorPtr query() override;
+			ResultsPtr results() override;
+			bool cancel() override { return m_stmt->cancel(); }
+			ConnectionPtr getConnection() const override { return m_conn; }
+			const char* errorMessage() override { return m_error ? m_message : m_stmt->errorMessage(); }
+			long errorCode() override { return m_error ? m_error : m_stmt->errorCode(); }
+		};
+		typedef std::shared_ptr<FaultyStatement> FaultyStatementPtr;
+
+		// a failed fetch ends the rows early and leaves the error in the
+		// statement
+		class FaultyCursor: public Cursor
+		{
+			CursorPtr m_cursor;
+			FaultyStatementPtr m_parent;
+			DicePtr m_dice;
+			bool m_failed;
+		public:
+			FaultyCursor(const CursorPtr& cursor, const FaultyStatementPtr& parent, const DicePtr& dice)
+				: m_cursor(cursor)
+				, m_parent(parent)
+				, m_dice(dice)
+				, m_failed(false)
+			{
+			}
+			bool next() override;
+			size_t columnCount() override { return m_cursor->columnCount(); }
+			int getInt(int column) override { return m_cursor->getInt(column); }
+			long getLong(int column) override { return m_cursor->getLong(column); }
+			long long getLongLong(int column) override { return m_cursor->getLongLong(column); }
+			double getDouble(int column) override { return m_cursor->getDouble(column); }
+			float getFloat(int column) override { return m_cursor->getFloat(column); }
+			Decimal getDecimal(int column) override { return m_cursor->getDecimal(column); }
+			bool readDecimal(int column, Decimal& value) override { return m_cursor->readDecimal(column, value); }
+			tyme::time_t getTimestamp(int column) override { return m_cursor->getTimestamp(column); }
+			const char* getText(int column) override { return m_cursor->getText(column); }
+			size_t getBlobSize(int column) override { return m_cursor->getBlobSize(column); }
+			const void* getBlob(int column) override { return m_cursor->getBlob(column); }
+			bool isNull(int column) override { return m_cursor->isNull(column); }
+			ConnectionPtr getConnection() const override { return m_parent->getConnection(); }
+			StatementPtr getStatement() const override { return m_parent; }
+			size_t rowCount() override { return m_cursor->rowCount(); }
+			size_t bookmark() override { return m_cursor->bookmark(); }
+			bool seek(size_t row) override { return !m_failed && m_cursor->seek(row); }
+			bool rewind() override { return !m_failed && m_cursor->rewind(); }
+		};
+
+		class FaultyResults: public Results
+		{
+			ResultsPtr m_results;
+			FaultyStatementPtr m_parent;
+			DicePtr m_dice;
+		public:
+			FaultyResults(const ResultsPtr& results, const FaultyStatementPtr& parent, const DicePtr& dice)
+				: m_results(results)
+				, m_parent(parent)
+				, m_dice(dice)
+			{
+			}
+			bool next() override { return m_results->next(); }
+			CursorPtr cursor() override;
+			long long affectedRows() override { return m_results->affectedRows(); }
+			const char* errorMessage() override { return m_results->errorMessage(); }
+			long errorCode() override { return m_results->errorCode(); }
+		};
+
+		class FaultyDriver: public Driver
+		{
+			std::mutex m_mutex;
+			std::map<std::string, unsigned long long> m_sessions;
+		public:
+			ConnectionPtr open(const filesystem::path& ini_path, const Props& props);
+		};
+	}
+}
+
+#endif //__FAULTY_HPP__
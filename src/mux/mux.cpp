@@ -0,0 +1,751 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include "mux.hpp"
+#include <utils.hpp>
+#include <chrono>
+#include <sstream>
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern "C" void flog(const char* file, int line, const char* fmt, ...);
+#define MUX_LOG(...) ::flog(__FILE__, __LINE__, __VA_ARGS__)
+
+namespace db { namespace mux {
+	bool startup_driver()
+	{
+		REGISTER_DRIVER("mux", db::mux::MuxDriver);
+		return true;
+	}
+
+	void shutdown_driver()
+	{
+	}
+
+	static filesystem::path resolve(const filesystem::path& ini_path, const std::string& file)
+	{
+		if (!file.empty() && (file[0] == '/' || file[0] == '\\' || (file.length() > 1 && file[1] == ':')))
+			return file;
+		return ini_path.parent_path() / file;
+	}
+
+	static long long now()
+	{
+		using namespace std::chrono;
+		return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	// physical statements kept per connection, before the cache is dropped
+	static const size_t MAX_STATEMENTS = 64;
+
+	ConnectionPtr MuxDriver::open(const filesystem::path& ini_path, const Props& props)
+	{
+		std::string target;
+		if (!getProp(props, "target", target) || target.empty())
+		{
+			MUX_LOG("[Mux] invalid configuration: missing `target'");
+			return nullptr;
+		}
+
+		std::string value;
+		long long connections = 4;
+		if (getProp(props, "connections", value))
+			connections = strtoll(value.c_str(), nullptr, 10);
+		long long wait = 0;
+		if (getProp(props, "wait", value))
+			wait = strtoll(value.c_str(), nullptr, 10);
+
+		if (connections < 1 || wait < 0)
+		{
+			MUX_LOG("[Mux] invalid configuration: bad `connections' or `wait'");
+			return nullptr;
+		}
+
+		try {
+			MuxPtr mux = Mux::named(ini_path, resolve(ini_path, target), (size_t)connections, wait);
+			if (!mux)
+				return nullptr;
+			return std::make_shared<Session>(ini_path, mux);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	Lease::~Lease()
+	{
+		mux->release(physical);
+	}
+
+	MuxPtr Mux::named(const filesystem::path& ini, const filesystem::path& target, size_t limit, long long maxWait)
+	{
+		static std::mutex mutex;
+		static std::map<std::string, std::weak_ptr<Mux>> muxes;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		auto& slot = muxes[ini.string()];
+		MuxPtr mux = slot.lock();
+		if (!mux)
+		{
+			mux = std::make_shared<Mux>(target, limit, maxWait);
+			slot = mux;
+		}
+		return mux;
+	}
+
+	LeasePtr Mux::acquire(long& error, const char*& message)
+	{
+		Span span("pool.wait");
+		long long start = now();
+		PhysicalPtr physical;
+		bool create = false;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			if (!m_idle.empty() && m_waiting.empty())
+			{
+				physical = m_idle.front();
+				m_idle.pop_front();
+			}
+			else if (m_open < m_limit)
+			{
+				++m_open;
+				create = true;
+			}
+			else
+			{
+				// first come, first served
+				Waiter waiter;
+				m_waiting.push_back(&waiter);
+				auto served = [&waiter] { return waiter.physical || waiter.create; };
+				if (m_maxWait)
+					waiter.ready.wait_for(lock, std::chrono::milliseconds(m_maxWait), served);
+				else
+					waiter.ready.wait(lock, served);
+
+				physical = waiter.physical;
+				create = waiter.create;
+				if (!physical && !create)
+				{
+					for (auto it = m_waiting.begin(); it != m_waiting.end(); ++it)
+					{
+						if (*it == &waiter)
+						{
+							m_waiting.erase(it);
+							break;
+						}
+					}
+					error = error::OVERLOADED;
+					message = "No connection was freed in time";
+					return nullptr;
+				}
+			}
+
+			long long waited = now() - start;
+			++m_calls;
+			m_waitTotal += waited;
+			if (waited > m_waitMax)
+				m_waitMax = waited;
+		}
+
+		if (create)
+		{
+			ConnectionPtr conn = Connection::open(m_target);
+			try {
+				if (conn)
+				{
+					physical = std::make_shared<Physical>();
+					physical->conn = conn;
+				}
+			} catch (std::bad_alloc&) {}
+
+			if (!physical)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (m_waiting.empty())
+					--m_open;
+				else
+				{
+					// the next in line tries to open one instead
+					Waiter* waiter = m_waiting.front();
+					m_waiting.pop_front();
+					waiter->create = true;
+					waiter->ready.notify_one();
+				}
+				error = error::SHARD_UNAVAILABLE;
+				message = "Cannot open the physical connection";
+				return nullptr;
+			}
+		}
+
+		try {
+			return std::make_shared<Lease>(shared_from_this(), physical);
+		} catch (std::bad_alloc&) {
+			release(physical);
+			error = error::OVERLOADED;
+			message = "Out of memory";
+			return nullptr;
+		}
+	}
+
+	void Mux::release(const PhysicalPtr& physical)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_waiting.empty())
+		{
+			Waiter* waiter = m_waiting.front();
+			m_waiting.pop_front();
+			waiter->physical = physical;
+			waiter->ready.notify_one();
+			return;
+		}
+		m_idle.push_back(physical);
+	}
+
+	void Mux::sessionOpened()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		++m_sessions;
+	}
+
+	void Mux::sessionClosed()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		--m_sessions;
+	}
+
+	void Mux::pinned(bool pinned)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (pinned)
+			++m_pinned;
+		else
+			--m_pinned;
+	}
+
+	MuxStats Mux::stats()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		MuxStats stats = {};
+		stats.sessions = m_sessions;
+		stats.connections = m_open;
+		stats.pinned = m_pinned;
+		stats.waiting = m_waiting.size();
+		stats.calls = m_calls;
+		stats.waitTotal = m_waitTotal;
+		stats.waitMax = m_waitMax;
+		return stats;
+	}
+
+	Session::~Session()
+	{
+		if (m_pinned)
+		{
+			Physical& physical = *m_pinned->physical;
+			if (m_transaction)
+				physical.conn->rollbackTransaction();
+			if (m_statePin)
+			{
+				// do not hand the session state over to the next user
+				physical.clear();
+				physical.conn->reconnect();
+			}
+			m_mux->pinned(false);
+			m_pinned.reset();
+		}
+		m_mux->sessionClosed();
+	}
+
+	LeasePtr Session::lease(long& error, std::string& message)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_pinned)
+				return m_pinned;
+		}
+
+		const char* msg = nullptr;
+		LeasePtr lease = m_mux->acquire(error, msg);
+		if (!lease)
+			message = msg ? msg : "";
+		return lease;
+	}
+
+	bool Session::pin()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_userPin = true;
+		if (m_pinned)
+			return true;
+
+		const char* message = nullptr;
+		m_pinned = m_mux->acquire(m_error, message);
+		if (!m_pinned)
+		{
+			m_userPin = false;
+			return fail(m_error, message);
+		}
+		m_mux->pinned(true);
+		return true;
+	}
+
+	void Session::unpinIfFree()
+	{
+		if (!m_pinned || m_userPin || m_statePin || m_transaction)
+			return;
+		m_pinned.reset();
+		m_mux->pinned(false);
+	}
+
+	void Session::unpin()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		// the session state stays with the connection it was set on
+		m_userPin = false;
+		unpinIfFree();
+	}
+
+	static bool startsWith(const char* sql, const char* prefix)
+	{
+		for (; *prefix; ++sql, ++prefix)
+		{
+			if (toupper((unsigned char)*sql) != *prefix)
+				return false;
+		}
+		return true;
+	}
+
+	bool Session::changesState(const char* sql)
+	{
+		while (*sql == ' ' || *sql == '\t' || *sql == '\r' || *sql == '\n' || *sql == '(')
+			++sql;
+
+		static const char* prefixes[] = {
+			"SET ",
+			"USE ",
+			"LOCK ",
+			"CREATE TEMPORARY ",
+			"PREPARE "
+		};
+		for (size_t i = 0; i < array_size(prefixes); ++i)
+		{
+			if (startsWith(sql, prefixes[i]))
+				return true;
+		}
+		return false;
+	}
+
+	bool Session::isStillAlive()
+	{
+		long error = 0;
+		std::string message;
+		LeasePtr lease = this->lease(error, message);
+		if (!lease)
+			return fail(error, message.c_str());
+		return lease->physical->conn->isStillAlive();
+	}
+
+	bool Session::beginTransaction()
+	{
+		bool userPin;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			userPin = m_userPin;
+		}
+		if (!pin())
+			return false;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		// pin() above is not the caller's
+		m_userPin = userPin;
+		if (!m_pinned->physical->conn->beginTransaction())
+		{
+			fail(*m_pinned->physical->conn);
+			unpinIfFree();
+			return false;
+		}
+		m_transaction = true;
+		return true;
+	}
+
+	bool Session::rollbackTransaction()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_transaction || !m_pinned)
+			return false;
+
+		m_transaction = false;
+		bool ret = m_pinned->physical->conn->rollbackTransaction();
+		if (!ret)
+			fail(*m_pinned->physical->conn);
+		unpinIfFree();
+		return ret;
+	}
+
+	bool Session::commitTransaction()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_transaction || !m_pinned)
+			return false;
+
+		m_transaction = false;
+		bool ret = m_pinned->physical->conn->commitTransaction();
+		if (!ret)
+			fail(*m_pinned->physical->conn);
+		unpinIfFree();
+		return ret;
+	}
+
+	bool Session::exec(const char* sql)
+	{
+		if (!sql)
+			return false;
+
+		if (changesState(sql))
+		{
+			bool userPin;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				userPin = m_userPin;
+			}
+			if (!pin())
+				return false;
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_userPin = userPin;
+			m_statePin = true;
+		}
+
+		long error = 0;
+		std::string message;
+		LeasePtr lease = this->lease(error, message);
+		if (!lease)
+			return fail(error, message.c_str());
+
+		if (!lease->physical->conn->exec(sql))
+			return fail(*lease->physical->conn);
+		return true;
+	}
+
+	StatementPtr Session::prepare(const char* sql)
+	{
+		if (!sql)
+			return nullptr;
+		try {
+			return std::make_shared<MuxStatement>(shared_from_this(), sql, false, false);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	StatementPtr Session::prepare(const char* sql, long lowLimit, long hiLimit)
+	{
+		std::ostringstream s;
+		s << sql << " LIMIT " << lowLimit << ", " << hiLimit;
+		return prepare(s.str().c_str());
+	}
+
+	StatementPtr Session::direct(const char* sql, bool stream)
+	{
+		if (!sql)
+			return nullptr;
+		try {
+			return std::make_shared<MuxStatement>(shared_from_this(), sql, true, stream);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	bool Session::reconnect()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_pinned)
+			return true; // each call takes a working connection anyway
+
+		// the session state and the transaction are gone
+		m_statePin = false;
+		m_transaction = false;
+		m_pinned->physical->clear();
+		bool ret = m_pinned->physical->conn->reconnect();
+		unpinIfFree();
+		return ret;
+	}
+
+	namespace
+	{
+		// keeps the physical connection until the rows are read; while the
+		// physical statement is held here, the cache does not hand it out
+		class MuxCursor: public Cursor
+		{
+			CursorPtr m_cursor;
+			LeasePtr m_lease;
+			StatementPtr m_stmt;
+			StatementPtr m_parent;
+		public:
+			MuxCursor(const CursorPtr& cursor, const LeasePtr& lease, const StatementPtr& stmt, const StatementPtr& parent)
+				: m_cursor(cursor)
+				, m_lease(lease)
+				, m_stmt(stmt)
+				, m_parent(parent)
+			{
+			}
+			~MuxCursor()
+			{
+				// the cursor goes before the connection returns to the pool
+				m_cursor.reset();
+			}
+			bool next() override { return m_cursor->next(); }
+			size_t columnCount() override { return m_cursor->columnCount(); }
+			int getInt(int column) override { return m_cursor->getInt(column); }
+			long getLong(int column) override { return m_cursor->getLong(column); }
+			long long getLongLong(int column) override { return m_cursor->getLongLong(column); }
+			double getDouble(int column) override { return m_cursor->getDouble(column); }
+			float getFloat(int column) override { return m_cursor->getFloat(column); }
+			Decimal getDecimal(int column) override { return m_cursor->getDecimal(column); }
+			bool readDecimal(int column, Decimal& value) override { return m_cursor->readDecimal(column, value); }
+			tyme::time_t getTimestamp(int column) override { return m_cursor->getTimestamp(column); }
+			const char* getText(int column) override { return m_cursor->getText(column); }
+			size_t getBlobSize(int column) override { return m_cursor->getBlobSize(column); }
+			const void* getBlob(int column) override { return m_cursor->getBlob(column); }
+			bool isNull(int column) override { return m_cursor->isNull(column); }
+			ConnectionPtr getConnection() const override { return m_parent->getConnection(); }
+			StatementPtr getStatement() const override { return m_parent; }
+			size_t rowCount() override { return m_cursor->rowCount(); }
+			size_t bookmark() override { return m_cursor->bookmark(); }
+			bool seek(size_t row) override { return m_cursor->seek(row); }
+			bool rewind() override { return m_cursor->rewind(); }
+		};
+
+		class MuxResults: public Results
+		{
+			ResultsPtr m_results;
+			LeasePtr m_lease;
+			StatementPtr m_stmt;
+			StatementPtr m_parent;
+		public:
+			MuxResults(const ResultsPtr& results, const LeasePtr& lease, const StatementPtr& stmt, const StatementPtr& parent)
+				: m_results(results)
+				, m_lease(lease)
+				, m_stmt(stmt)
+				, m_parent(parent)
+			{
+			}
+			~MuxResults()
+			{
+				m_results.reset();
+			}
+			bool next() override { return m_results->next(); }
+			CursorPtr cursor() override
+			{
+				CursorPtr cursor = m_results->cursor();
+				if (!cursor)
+					return nullptr;
+				try {
+					return std::make_shared<MuxCursor>(cursor, m_lease, m_stmt, m_parent);
+				} catch (std::bad_alloc&) { return nullptr; }
+			}
+			long long affectedRows() override { return m_results->affectedRows(); }
+			const char* errorMessage() override { return m_results->errorMessage(); }
+			long errorCode() override { return m_results->errorCode(); }
+		};
+	}
+
+	bool MuxStatement::record(int arg, const Binding& binding)
+	{
+		if (arg < 0)
+			return false;
+		try {
+			if ((size_t)arg >= m_bindings.size())
+				m_bindings.resize(arg + 1);
+			m_bindings[arg] = binding;
+		} catch (std::bad_alloc&) { return false; }
+		return true;
+	}
+
+	bool MuxStatement::bind(int arg, const char* value)
+	{
+		if (!value)
+			return bindNull(arg);
+		return bindText(arg, value, strlen(value));
+	}
+
+	bool MuxStatement::bindText(int arg, const char* value, size_t length)
+	{
+		if (!value)
+			return bindNull(arg);
+		std::string copy(value, length);
+		return record(arg, [=](const StatementPtr& s) { return s->bindText(arg, copy.data(), copy.length()); });
+	}
+
+	bool MuxStatement::bind(int arg, const void* value, size_t size)
+	{
+		if (!value)
+			return bindNull(arg);
+		std::string copy((const char*)value, size);
+		return record(arg, [=](const StatementPtr& s) { return s->bind(arg, copy.data(), copy.length()); });
+	}
+
+	StatementPtr MuxStatement::physical(const LeasePtr& lease)
+	{
+		Physical& physical = *lease->physical;
+		if (m_direct)
+		{
+			StatementPtr stmt = physical.conn->direct(m_sql.c_str(), m_stream);
+			if (!stmt)
+				fail(*physical.conn);
+			return stmt;
+		}
+
+		// a pinned connection may be shared by several threads, and by
+		// the cursors of statements with the same SQL; a statement, which
+		// is held by anyone else than the cache, is still in use
+		std::lock_guard<std::mutex> lock(physical.lock);
+		auto it = physical.statements.find(m_sql);
+		if (it != physical.statements.end() && it->second.stmt.use_count() > 1)
+		{
+			StatementPtr stmt = physical.conn->prepare(m_sql.c_str());
+			if (!stmt)
+				fail(*physical.conn);
+			return stmt;
+		}
+
+		if (it == physical.statements.end())
+		{
+			StatementPtr stmt = physical.conn->prepare(m_sql.c_str());
+			if (!stmt)
+			{
+				fail(*physical.conn);
+				return nullptr;
+			}
+
+			try {
+				if (physical.statements.size() >= MAX_STATEMENTS)
+					physical.statements.clear();
+				CachedStatement cached = { stmt, 0 };
+				it = physical.statements.insert(std::make_pair(m_sql, cached)).first;
+			} catch (std::bad_alloc&) { return stmt; }
+		}
+
+		// arguments left over from the previous user are cleared
+		CachedStatement& cached = it->second;
+		for (size_t arg = m_bindings.size(); arg < cached.args; ++arg)
+			cached.stmt->bindNull((int)arg);
+		cached.args = m_bindings.size();
+		return cached.stmt;
+	}
+
+	LeasePtr MuxStatement::start(StatementPtr& stmt)
+	{
+		m_error = 0;
+		m_message.clear();
+
+		LeasePtr lease = m_session->lease(m_error, m_message);
+		if (!lease)
+			return nullptr;
+
+		stmt = physical(lease);
+		if (!stmt)
+			return nullptr;
+
+		stmt->setBuffered(m_buffered);
+		stmt->setTimeout(m_timeout);
+		for (size_t arg = 0; arg < m_bindings.size(); ++arg)
+		{
+			bool bound = m_bindings[arg] ? m_bindings[arg](stmt) : stmt->bindNull((int)arg);
+			if (!bound)
+			{
+				fail(*stmt);
+				return nullptr;
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(m_runningLock);
+		m_running = stmt;
+		return lease;
+	}
+
+	void MuxStatement::stop()
+	{
+		std::lock_guard<std::mutex> lock(m_runningLock);
+		m_running.reset();
+	}
+
+	bool MuxStatement::execute()
+	{
+		StatementPtr stmt;
+		LeasePtr lease = start(stmt);
+		if (!lease)
+			return false;
+
+		bool ret = stmt->execute();
+		stop();
+		if (!ret)
+			return fail(*stmt);
+		return true;
+	}
+
+	CursorPtr MuxStatement::query()
+	{
+		StatementPtr stmt;
+		LeasePtr lease = start(stmt);
+		if (!lease)
+			return nullptr;
+
+		CursorPtr cursor = stmt->query();
+		stop();
+		if (!cursor)
+		{
+			fail(*stmt);
+			return nullptr;
+		}
+
+		try {
+			return std::make_shared<MuxCursor>(cursor, lease, stmt, shared_from_this());
+		} catch (std::bad_alloc&) { return nullptr; }
+	}
+
+	ResultsPtr MuxStatement::results()
+	{
+		StatementPtr stmt;
+		LeasePtr lease = start(stmt);
+		if (!lease)
+			return nullptr;
+
+		ResultsPtr results = stmt->results();
+		stop();
+		if (!results)
+		{
+			fail(*stmt);
+			return nullptr;
+		}
+
+		try {
+			return std::make_shared<MuxResults>(results, lease, stmt, shared_from_this());
+		} catch (std::bad_alloc&) { return nullptr; }
+	}
+
+	bool MuxStatement::cancel()
+	{
+		StatementPtr running;
+		{
+			std::lock_guard<std::mutex> lock(m_runningLock);
+			running = m_running;
+		}
+		return running && running->cancel();
+	}
+}}
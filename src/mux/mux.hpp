@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __MUX_HPP__
+#define __MUX_HPP__
+
+#include <db/mux.hpp>
+#include <db/driver.hpp>
+#include <filesystem.hpp>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+
+namespace db
+{
+	namespace mux
+	{
+		struct CachedStatement
+		{
+			StatementPtr stmt;
+			size_t args; // bound by the last user
+		};
+
+		// the calls of a pinned session may come from several threads
+		struct Physical
+		{
+			ConnectionPtr conn;
+			std::mutex lock; // guards the statements
+			std::map<std::string, CachedStatement> statements;
+			void clear()
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				statements.clear();
+			}
+		};
+		typedef std::shared_ptr<Physical> PhysicalPtr;
+
+		class Mux;
+		typedef std::shared_ptr<Mux> MuxPtr;
+
+		// a physical connection borrowed from the mux, returned when the
+		// last holder lets it go
+		struct Lease
+		{
+			MuxPtr mux;
+			PhysicalPtr physical;
+			Lease(const MuxPtr& mux, const PhysicalPtr& physical): mux(mux), physical(physical) {}
+			~Lease();
+		};
+		typedef std::shared_ptr<Lease> LeasePtr;
+
+		class Mux: public std::enable_shared_from_this<Mux>
+		{
+			struct Waiter
+			{
+				std::condition_variable ready;
+				PhysicalPtr physical;
+				bool create; // handed the slot of a connection, which failed to open
+				Waiter(): create(false) {}
+			};
+
+			filesystem::path m_target;
+			size_t m_limit;
+			long long m_maxWait;
+			std::mutex m_mutex;
+			std::list<PhysicalPtr> m_idle;
+			std::deque<Waiter*> m_waiting;
+			size_t m_open;
+			size_t m_sessions;
+			size_t m_pinned;
+			unsigned long long m_calls;
+			long long m_waitTotal;
+			long long m_waitMax;
+
+			friend struct Lease;
+			void release(const PhysicalPtr& physical);
+		public:
+			Mux(const filesystem::path& target, size_t limit, long long maxWait)
+				: m_target(target)
+				, m_limit(limit ? limit : 1)
+				, m_maxWait(maxWait)
+				, m_open(0)
+				, m_sessions(0)
+				, m_pinned(0)
+				, m_calls(0)
+				, m_waitTotal(0)
+				, m_waitMax(0)
+			{
+			}
+			static MuxPtr named(const filesystem::path& ini, const filesystem::path& target, size_t limit, long long maxWait);
+
+			// null with error set, if there was none free in time
+			LeasePtr acquire(long& error, const char*& message);
+			void sessionOpened();
+			void sessionClosed();
+			void pinned(bool pinned);
+			MuxStats stats();
+			std::string getURI() const { return m_target.string(); }
+		};
+
+		class Session;
+		typedef std::shared_ptr<Session> SessionPtr;
+
+		class Session: public MultiplexedConnection, public std::enable_shared_from_this<Session>
+		{
+			filesystem::path m_path;
+			MuxPtr m_mux;
+			std::mutex m_mutex;
+			LeasePtr m_pinned;
+			bool m_userPin;
+			bool m_statePin;
+			bool m_transaction;
+			long m_error;
+			std::string m_message;
+			bool fail(long code, const char* message) { m_error = code; m_message = message ? message : ""; return false; }
+			bool fail(ErrorReporter& source) { return fail(source.errorCode(), source.errorMessage()); }
+			void unpinIfFree();
+			static bool changesState(const char* sql);
+		public:
+			Session(const filesystem::path& path, const MuxPtr& mux)
+				: m_path(path)
+				, m_mux(mux)
+				, m_userPin(false)
+				, m_statePin(false)
+				, m_transaction(false)
+				, m_error(0)
+			{
+				m_mux->sessionOpened();
+			}
+			~Session();
+
+			// the pinned connection, or a free one for a single call
+			LeasePtr lease(long& error, std::string& message);
+
+			bool pin() override;
+			void unpin() override;
+			MuxStats stats() override { return m_mux->stats(); }
+
+			bool isStillAlive() override;
+			bool beginTransaction() override;
+			bool rollbackTransaction() override;
+			bool commitTransaction() override;
+			bool exec(const char* sql) override;
+			StatementPtr prepare(const char* sql) override;
+			StatementPtr prepare(const char* sql, long lowLimit, long hiLimit) override;
+			StatementPtr direct(const char* sql, bool stream) override;
+			bool reconnect() override;
+			std::string getURI() const override { return "mux:" + m_path.string(); }
+			const char* errorMessage() override { return m_message.c_str(); }
+			long errorCode() override { return m_error; }
+		};
+
+		// Keeps the bind calls and replays them on the physical statement
+		// of each call
+		class MuxStatement: public Statement, public std::enable_shared_from_this<MuxStatement>
+		{
+			typedef std::function<bool (const StatementPtr&)> Binding;
+
+			SessionPtr m_session;
+			std::string m_sql;
+			bool m_direct;
+			bool m_stream;
+			bool m_buffered;
+			long m_timeout;
+			std::vector<Binding> m_bindings;
+			std::mutex m_runningLock;
+			StatementPtr m_running;
+			long m_error;
+			std::string m_message;
+
+			bool fail(long code, const char* message) { m_error = code; m_message = message ? message : ""; return false; }
+			bool fail(ErrorReporter& source) { return fail(source.errorCode(), source.errorMessage()); }
+			bool record(int arg, const Binding& binding);
+			StatementPtr physical(const LeasePtr& lease);
+			LeasePtr start(StatementPtr& stmt);
+			void stop();
+		public:
+			MuxStatement(const SessionPtr& session, const char* sql, bool direct, bool stream)
+				: m_session(session)
+				, m_sql(sql)
+				, m_direct(direct)
+				, m_stream(stream)
+				, m_buffered(false)
+				, m_timeout(0)
+				, m_error(0)
+			{
+			}
+			bool bind(int arg, int value) override { return record(arg, [=](const StatementPtr& s) { return s->bind(arg, value); }); }
+			bool bind(int arg, short value) override { return record(arg, [=](const StatementPtr& s) { return s->bind(arg, value); }); }
+			bool bind(int arg, long value) override { return record(arg, [=](const StatementPtr& s) { return s->bind(arg, value); }); }
+			bool bind(int arg, long long value) override { return record(arg, [=](const StatementPtr& s) { return s->bind(arg, value); }); }
+			bool bind(int arg, const char* value) override;
+			bool bind(int arg, const void* value, size_t size) override;
+			bool bindText(int arg, const char* value, size_t length) override;
+			bool bindTextRef(int arg, const char* value, size_t length) override { return record(arg, [=](const StatementPtr& s) { return s->bindTextRef(arg, value, length); }); }
+			bool bindBlobRef(int arg, const void* value, size_t size) override { return record(arg, [=](const StatementPtr& s) { return s->bindBlobRef(arg, value, size); }); }
+			bool bindTime(int arg, tyme::time_t value) override { return record(arg, [=](const StatementPtr& s) { return s->bindTime(arg, value); }); }
+			bool bindNull(int arg) override { return record(arg, [=](const StatementPtr& s) { return s->bindNull(arg); }); }
+			void setBuffered(bool buffered) override { m_buffered = buffered; }
+			void setTimeout(long milliseconds) override { m_timeout = milliseconds; }
+			bool execute() override;
+			CursorPtr query() override;
+			ResultsPtr results() override;
+			bool cancel() override;
+			ConnectionPtr getConnection() const override { return m_session; }
+			const char* errorMessage() override { return m_message.c_str(); }
+			long errorCode() override { return m_error; }
+		};
+
+		class MuxDriver: public Driver
+		{
+			ConnectionPtr open(const filesystem::path& ini_path, const Props& props);
+		};
+	}
+}
+
+#endif //__MUX_HPP__
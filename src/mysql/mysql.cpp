@@ -24,21 +24,331 @@
 
 #include "pch.h"
 #include "mysql.hpp"
+#include <db/batch.hpp>
+#include <db/pipeline.hpp>
 #include <utils.hpp>
 #include <sstream>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+
+#ifndef ER_QUERY_TIMEOUT
+#define ER_QUERY_TIMEOUT 3024 // MySQL 5.7.8 and newer
+#endif
 
 extern "C" void flog(const char* file, int line, const char* fmt, ...);
 #define MYSQL_LOG(...) ::flog(__FILE__, __LINE__, __VA_ARGS__)
 
 namespace db { namespace mysql {
+	static const char* MEMORY_LIMIT_MESSAGE = "Memory limit exceeded";
+
+	class Keepalive
+	{
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::list< std::weak_ptr<MySQLConnection> > m_conns;
+		std::thread m_thread;
+		bool m_running;
+
+		void run()
+		{
+			mysql_thread_init();
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (m_running)
+			{
+				m_wake.wait_for(lock, std::chrono::seconds(1));
+				if (!m_running)
+					break;
+
+				std::vector<MySQLConnectionPtr> conns;
+				for (auto it = m_conns.begin(); it != m_conns.end();)
+				{
+					auto conn = it->lock();
+					if (!conn)
+					{
+						it = m_conns.erase(it);
+						continue;
+					}
+					conns.push_back(conn);
+					++it;
+				}
+
+				lock.unlock();
+				for (auto&& conn : conns)
+					conn->maintain();
+				conns.clear();
+				lock.lock();
+			}
+
+			mysql_thread_end();
+		}
+	public:
+		Keepalive(): m_running(false) {}
+
+		bool start()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_thread.joinable())
+				return m_running; // started by another environment
+			m_running = true;
+			try {
+				m_thread = std::thread([this] { run(); });
+			} catch (std::system_error&) { m_running = false; }
+			return m_running;
+		}
+
+		void stop()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_running = false;
+				m_wake.notify_all();
+			}
+			if (m_thread.joinable())
+				m_thread.join();
+			m_conns.clear();
+		}
+
+		void add(const MySQLConnectionPtr& conn)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_conns.push_back(conn);
+		}
+	};
+
+	static Keepalive keepalive;
+
+	// Kills the queries running past their deadline. The KILL QUERY goes
+	// through a side connection, one per configuration file.
+	class Watchdog
+	{
+	public:
+		struct Watch
+		{
+			MySQLConnection* conn;
+			unsigned long thread_id;
+			long long deadline;
+			bool fired;
+			bool killing;
+		};
+	private:
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::condition_variable m_killed;
+		std::multimap<long long, Watch*> m_watches;
+		std::mutex m_killersLock; // opening a side connection must not stop the other watches
+		std::map<std::string, MySQLConnectionPtr> m_killers;
+		std::thread m_thread;
+		bool m_running;
+
+		void run()
+		{
+			mysql_thread_init();
+
+			std::unique_lock<std::mutex> lock(m_mutex);
+			while (m_running)
+			{
+				if (m_watches.empty())
+				{
+					m_wake.wait(lock);
+					continue;
+				}
+
+				auto first = m_watches.begin();
+				if (first->first > now())
+				{
+					m_wake.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::milliseconds(first->first)));
+					continue;
+				}
+
+				Watch* watch = first->second;
+				m_watches.erase(first);
+				watch->fired = true;
+				watch->killing = true;
+
+				// remove() waits for the kill: the call cannot finish and
+				// start another query, before this one is killed
+				filesystem::path path = watch->conn->path();
+				unsigned long thread_id = watch->thread_id;
+				lock.unlock();
+				kill(path, thread_id);
+				lock.lock();
+				watch->killing = false;
+				m_killed.notify_all();
+			}
+
+			std::lock_guard<std::mutex> guard(m_killersLock);
+			m_killers.clear();
+			mysql_thread_end();
+		}
+	public:
+		Watchdog(): m_running(false) {}
+
+		// neither under m_mutex nor under a connection lock
+		bool kill(const filesystem::path& path, unsigned long thread_id)
+		{
+			std::lock_guard<std::mutex> guard(m_killersLock);
+			auto& killer = m_killers[path.string()];
+			if (!killer || !killer->isStillAlive())
+			{
+				killer = std::make_shared<MySQLConnection>(path);
+				if (!killer->reconnect())
+				{
+					MYSQL_LOG("[MySQL] cannot open the side connection to cancel a query");
+					killer.reset();
+					return false;
+				}
+			}
+
+			std::ostringstream sql;
+			sql << "KILL QUERY " << thread_id;
+			if (!killer->exec(sql.str().c_str()))
+			{
+				MYSQL_LOG("[MySQL] cannot cancel a query: %s", killer->errorMessage());
+				return false;
+			}
+			return true;
+		}
+
+		static long long now()
+		{
+			using namespace std::chrono;
+			return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+		}
+
+		bool start()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_thread.joinable())
+				return m_running; // started by another environment
+			m_running = true;
+			try {
+				m_thread = std::thread([this] { run(); });
+			} catch (std::system_error&) { m_running = false; }
+			return m_running;
+		}
+
+		void stop()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_running = false;
+				m_wake.notify_all();
+			}
+			if (m_thread.joinable())
+				m_thread.join();
+		}
+
+		void add(Watch& watch)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			bool earliest = m_watches.empty() || watch.deadline < m_watches.begin()->first;
+			m_watches.insert(std::make_pair(watch.deadline, &watch));
+			if (earliest)
+				m_wake.notify_all();
+		}
+
+		bool remove(Watch& watch)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_killed.wait(lock, [&watch] { return !watch.killing; });
+			auto range = m_watches.equal_range(watch.deadline);
+			for (auto it = range.first; it != range.second; ++it)
+			{
+				if (it->second == &watch)
+				{
+					m_watches.erase(it);
+					break;
+				}
+			}
+			return watch.fired;
+		}
+	};
+
+	static Watchdog watchdog;
+
+	class Deadline
+	{
+		Watchdog::Watch m_watch;
+		bool m_active;
+	public:
+		Deadline(MySQLConnection* conn, long timeout)
+			: m_active(timeout > 0)
+		{
+			if (!m_active)
+				return;
+
+			m_watch.conn = conn;
+			m_watch.thread_id = conn->threadId();
+			m_watch.deadline = Watchdog::now() + timeout;
+			m_watch.fired = false;
+			m_watch.killing = false;
+			watchdog.add(m_watch);
+		}
+		~Deadline() { expired(); }
+
+		bool expired()
+		{
+			if (!m_active)
+				return false;
+			m_active = false;
+			return watchdog.remove(m_watch);
+		}
+	};
+
+	void RunningQuery::started(unsigned long threadId)
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_running = true;
+		m_cancelled = false;
+		m_threadId = threadId;
+	}
+
+	bool RunningQuery::finished()
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_running = false;
+		return m_cancelled;
+	}
+
+	bool RunningQuery::cancel(const filesystem::path& path)
+	{
+		// under the lock, the call cannot finish and start another query
+		// before this one is killed
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (!m_running)
+			return false;
+		m_cancelled = true;
+		return watchdog.kill(path, m_threadId);
+	}
+
 	bool startup_driver()
 	{
 		REGISTER_DRIVER("mysql", db::mysql::MySQLDriver);
-		return mysql_library_init(0, nullptr, nullptr) == 0;
+		if (mysql_library_init(0, nullptr, nullptr) != 0)
+			return false;
+
+		if (!keepalive.start())
+		{
+			mysql_library_end();
+			return false;
+		}
+
+		if (!watchdog.start())
+		{
+			keepalive.stop();
+			mysql_library_end();
+			return false;
+		}
+
+		return true;
 	}
 
 	void shutdown_driver()
 	{
+		watchdog.stop();
+		keepalive.stop();
 		mysql_library_end();
 	}
 
@@ -48,8 +358,64 @@ namespace db { namespace mysql {
 		std::string password;
 		std::string server;
 		std::string database;
+		long ping_after;
+		bool keepalive;
+		bool multi_statements;
+		std::string admission;
+		AdmissionConfig admission_config;
+		MemoryLimits memory;
+		std::string memory_group;
+		MemoryLimits memory_group_limits;
+		DriverData(): ping_after(30), keepalive(true), multi_statements(false) {}
+
+		// bytes, with an optional k, m or g
+		static size_t readSize(const std::string& value)
+		{
+			char* end;
+			size_t size = (size_t)strtoull(value.c_str(), &end, 10);
+			switch (*end)
+			{
+			case 'g': case 'G': size *= 1024; // fall through
+			case 'm': case 'M': size *= 1024; // fall through
+			case 'k': case 'K': size *= 1024; // fall through
+			default: break;
+			}
+			return size;
+		}
+
+		static void readLimits(const Driver::Props& props, const std::string& prefix, MemoryLimits& limits)
+		{
+			std::string value;
+			if (Driver::getProp(props, prefix + ".soft", value))
+				limits.soft = readSize(value);
+			if (Driver::getProp(props, prefix + ".hard", value))
+				limits.hard = readSize(value);
+			if (Driver::getProp(props, prefix + ".keep", value))
+				limits.keep = readSize(value);
+		}
+
 		bool read(const Driver::Props& props)
 		{
+			std::string value;
+			if (Driver::getProp(props, "ping_after", value))
+				ping_after = strtol(value.c_str(), nullptr, 10);
+			if (Driver::getProp(props, "keepalive", value))
+				keepalive = value != "0" && value != "false" && value != "off";
+			if (Driver::getProp(props, "multi_statements", value))
+				multi_statements = value == "1" || value == "true" || value == "on";
+
+			Driver::getProp(props, "admission", admission);
+			if (Driver::getProp(props, "admission.max", value))
+				admission_config.maxLimit = strtoul(value.c_str(), nullptr, 10);
+			if (Driver::getProp(props, "admission.queue", value))
+				admission_config.queueSize = strtoul(value.c_str(), nullptr, 10);
+			if (Driver::getProp(props, "admission.wait", value))
+				admission_config.maxWait = strtoll(value.c_str(), nullptr, 10);
+
+			readLimits(props, "memory", memory);
+			Driver::getProp(props, "memory.group", memory_group);
+			readLimits(props, "memory.group", memory_group_limits);
+
 			return 
 				Driver::getProp(props, "user", user) &&
 				Driver::getProp(props, "password", password) &&
@@ -72,6 +438,13 @@ namespace db { namespace mysql {
 
 		try {
 			auto conn = std::make_shared<MySQLConnection>(ini_path);
+			conn->setPingAfter(data.ping_after);
+			conn->setMultiStatements(data.multi_statements);
+
+			MemoryBudgetPtr group = MemoryBudget::global();
+			if (!data.memory_group.empty())
+				group = MemoryBudget::named(data.memory_group, data.memory_group_limits);
+			conn->setMemory(std::make_shared<MemoryBudget>(data.memory, group));
 
 			if (!conn->connect(data.user, data.password, data.server, data.database))
 			{
@@ -79,6 +452,12 @@ namespace db { namespace mysql {
 				return nullptr;
 			}
 
+			if (data.keepalive)
+				keepalive.add(conn);
+
+			if (!data.admission.empty())
+				conn->setAdmission(AdmissionController::named(data.admission, data.admission_config));
+
 			MYSQL_LOG("[MySQL] connected to %s@%s", data.user.c_str(), data.server.c_str());
 			return conn;
 		} catch(std::bad_alloc) { return nullptr; }
@@ -87,6 +466,15 @@ namespace db { namespace mysql {
 	MySQLConnection::MySQLConnection(const filesystem::path& path)
 		: m_connected(false)
 		, m_path(path)
+		, m_lastActivity(0)
+		, m_broken(false)
+		, m_pingAfter(30000)
+		, m_generation(0)
+		, m_inTransaction(false)
+		, m_transactionLost(false)
+		, m_serverTimeout(0)
+		, m_hasServerTimeout(false)
+		, m_multiStatements(false)
 	{
 		mysql_init(&m_mysql);
 	}
@@ -116,15 +504,28 @@ namespace db { namespace mysql {
 		my_bool reconnect = 0;
 		mysql_options(&m_mysql, MYSQL_OPT_RECONNECT, &reconnect);
 
-		m_connected = mysql_real_connect(&m_mysql, srvr.c_str(), user.c_str(), password.c_str(), database.c_str(), port, nullptr, 0) != nullptr;
+		unsigned long flags = CLIENT_MULTI_RESULTS;
+		if (m_multiStatements)
+			flags |= CLIENT_MULTI_STATEMENTS;
+
+		m_connected = mysql_real_connect(&m_mysql, srvr.c_str(), user.c_str(), password.c_str(), database.c_str(), port, nullptr, flags) != nullptr;
 
 		if (m_connected)
+		{
 			m_fake_uri = "mysql://" + user + "@" + server + "/" + database;
+			m_serverTimeout = 0;
+			// max_execution_time stops only SELECTs, and only since 5.7.8;
+			// MariaDB reports 10.x, but names the variable differently
+			m_hasServerTimeout = mysql_get_server_version(&m_mysql) >= 50708 &&
+				!strstr(mysql_get_server_info(&m_mysql), "MariaDB");
+			m_broken = false;
+			m_lastActivity = now();
+		}
 
 		return m_connected;
 	}
 
-	bool MySQLConnection::reconnect()
+	bool MySQLConnection::reconnectImpl()
 	{
 		Driver::Props props;
 		if (!Driver::readProps(m_path, props))
@@ -134,39 +535,156 @@ namespace db { namespace mysql {
 		if (!data.read(props))
 			return false;
 
-		return connect(data.user, data.password, data.server, data.database);
+		if (m_connected)
+		{
+			mysql_close(&m_mysql);
+			m_connected = false;
+		}
+		mysql_init(&m_mysql);
+		m_multiStatements = data.multi_statements;
+
+		if (!connect(data.user, data.password, data.server, data.database))
+			return false;
+
+		++m_generation;
+		if (m_inTransaction)
+		{
+			MYSQL_LOG("[MySQL] transaction lost while reconnecting to %s", m_fake_uri.c_str());
+			m_inTransaction = false;
+			m_transactionLost = true;
+		}
+		return true;
+	}
+
+	bool MySQLConnection::reconnect()
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		return reconnectImpl();
+	}
+
+	long long MySQLConnection::now()
+	{
+		using namespace std::chrono;
+		return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	void MySQLConnection::activity(unsigned int error)
+	{
+		// any answer from the server, even an error, proves the link works
+		if (error == CR_SERVER_GONE_ERROR || error == CR_SERVER_LOST)
+			m_broken = true;
+		else
+			m_lastActivity = now();
+	}
+
+	void MySQLConnection::maintain()
+	{
+		std::unique_lock<std::mutex> guard(m_lock, std::try_to_lock);
+		if (!guard.owns_lock())
+			return; // in use, so not idle
+
+		// prepare() and direct() take the lock, too; a reconnect bumps the
+		// generation, so the open statements prepare again on their next use
+		if (!m_connected || m_broken)
+		{
+			if (reconnectImpl())
+				MYSQL_LOG("[MySQL] reconnected to %s", m_fake_uri.c_str());
+			return;
+		}
+
+		if (now() - m_lastActivity >= m_pingAfter)
+			activity(mysql_ping(&m_mysql) == 0 ? 0 : mysql_errno(&m_mysql));
 	}
 
 	bool MySQLConnection::isStillAlive()
 	{
-		return mysql_ping(&m_mysql) == 0;
+		if (!m_connected || m_broken)
+			return false;
+
+		if (now() - m_lastActivity < m_pingAfter)
+			return true;
+
+		std::lock_guard<std::mutex> guard(m_lock);
+		bool alive = mysql_ping(&m_mysql) == 0;
+		activity(alive ? 0 : mysql_errno(&m_mysql));
+		return alive;
+	}
+
+	void MySQLConnection::serverTimeout(long milliseconds)
+	{
+		// the watchdog covers everything else
+		if (milliseconds == m_serverTimeout || !m_hasServerTimeout)
+			return;
+
+		std::ostringstream sql;
+		sql << "SET SESSION max_execution_time=" << milliseconds;
+		if (mysql_query(&m_mysql, sql.str().c_str()) == 0)
+			m_serverTimeout = milliseconds;
+		else if (mysql_errno(&m_mysql) == ER_UNKNOWN_SYSTEM_VARIABLE)
+			m_hasServerTimeout = false; // do not try again on every call
+		activity(mysql_errno(&m_mysql));
+	}
+
+	bool MySQLConnection::query(const char* sql)
+	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_failure.clear();
+		if (m_transactionLost)
+			return m_failure.set(error::TRANSACTION_LOST, "Transaction was lost when reconnecting");
+		bool ret = mysql_query(&m_mysql, sql) == 0;
+		activity(mysql_errno(&m_mysql));
+		return ret;
 	}
 
 	bool MySQLConnection::beginTransaction()
 	{
-		return mysql_query(&m_mysql, "START TRANSACTION") == 0;
+		m_transactionLost = false;
+		if (!query("START TRANSACTION"))
+			return false;
+		m_inTransaction = true;
+		return true;
 	}
 
 	bool MySQLConnection::rollbackTransaction()
 	{
-		return mysql_query(&m_mysql, "ROLLBACK") == 0;
+		// a lost transaction is as good as rolled back
+		m_transactionLost = false;
+		m_inTransaction = false;
+		return query("ROLLBACK");
 	}
 
 	bool MySQLConnection::commitTransaction()
 	{
-		return mysql_query(&m_mysql, "COMMIT") == 0;
+		m_inTransaction = false;
+		if (m_transactionLost)
+		{
+			m_transactionLost = false;
+			return m_failure.set(error::TRANSACTION_LOST, "Transaction was lost when reconnecting");
+		}
+		return query("COMMIT");
 	}
 
 	StatementPtr MySQLConnection::prepare(const char* sql)
 	{
+		std::shared_ptr<MySQLStatement> stmt; // released after the guard, closing takes the lock again
+		std::lock_guard<std::mutex> guard(m_lock);
+		m_failure.clear();
+		if (m_transactionLost)
+		{
+			m_failure.set(error::TRANSACTION_LOST, "Transaction was lost when reconnecting");
+			return nullptr;
+		}
+
 		MYSQL_STMT * stmtptr = mysql_stmt_init(&m_mysql);
 		if (stmtptr == nullptr)
 			return nullptr;
 
 		try {
-			auto stmt = std::make_shared<MySQLStatement>(&m_mysql, stmtptr, shared_from_this());
+			stmt = std::make_shared<MySQLStatement>(&m_mysql, stmtptr, shared_from_this(), m_generation, m_memory);
 
-			if (!stmt->prepare(sql))
+			bool prepared = stmt->prepare(sql);
+			activity(stmt->errorCode());
+			if (!prepared)
 				return nullptr;
 
 			return stmt;
@@ -180,24 +698,68 @@ namespace db { namespace mysql {
 		return prepare(s.str().c_str());
 	}
 
+	StatementPtr MySQLConnection::direct(const char* sql, bool stream)
+	{
+		std::shared_ptr<MySQLTextStatement> stmt; // released after the guard, closing counts it again
+		std::lock_guard<std::mutex> guard(m_lock); // not while maintain() reconnects
+		m_failure.clear();
+		try {
+			stmt = std::make_shared<MySQLTextStatement>(shared_from_this(), stream);
+			if (!stmt->prepare(sql))
+				return nullptr;
+			return stmt;
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
 	bool MySQLConnection::exec(const char* sql)
 	{
-		return mysql_query(&m_mysql, sql) == 0;
+		return query(sql);
 	}
 
 	const char* MySQLConnection::errorMessage()
 	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (m_failure.code)
+			return m_failure.message;
 		return mysql_error(&m_mysql);
 	}
 
 	long MySQLConnection::errorCode()
 	{
+		std::lock_guard<std::mutex> guard(m_lock);
+		if (m_failure.code)
+			return m_failure.code;
 		return mysql_errno(&m_mysql);
 	}
 
+	MySQLStatement::MySQLStatement(MYSQL *mysql, MYSQL_STMT *stmt, const MySQLConnectionPtr& parent, unsigned long generation, const MemoryBudgetPtr& memory)
+		: MySQLBinding(mysql, stmt, memory)
+		, m_parent(parent)
+		, m_meta(nullptr)
+		, m_generation(generation)
+		, m_timeout(0)
+		, m_buffered(false)
+		, m_stored(0)
+	{
+	}
+
+	MySQLStatement::~MySQLStatement()
+	{
+		releaseStored();
+		m_result.reset();
+		if (m_meta)
+			mysql_free_result(m_meta);
+
+		std::lock_guard<std::mutex> guard(m_parent->lock());
+		if (m_stmt)
+			mysql_stmt_close(m_stmt);
+		m_stmt = nullptr;
+	}
+
 	bool MySQLStatement::prepare(const char* stmt)
 	{
 		if (!stmt) return false;
+		m_sql = stmt;
 		int rc = mysql_stmt_prepare(m_stmt, stmt, strlen(stmt));
 		//if (rc == 1)
 		//	std::cerr << "MySQL: " << mysql_stmt_errno(m_stmt) << ": "
@@ -208,6 +770,11 @@ namespace db { namespace mysql {
 		if (!allocBind(mysql_stmt_param_count(m_stmt)))
 			return false;
 
+#if DEBUG_CGI
+		RefGuard empty = {};
+		m_guards.assign(m_count, empty);
+#endif
+
 		rc = mysql_stmt_bind_param(m_stmt, m_bind);
 		//if (rc == 1)
 		//	std::cerr << "MySQL: " << mysql_stmt_errno(m_stmt) << ": "
@@ -244,15 +811,46 @@ namespace db { namespace mysql {
 		if (!value)
 			return bindNull(arg);
 
-		size_t len = strlen(value);
-		if (!bindImpl(arg, value, len))
+		return bindText(arg, value, strlen(value));
+	}
+
+	bool MySQLStatement::bindText(int arg, const char* value, size_t length)
+	{
+		if (!value)
+			return bindNull(arg);
+
+		if (!bindImpl(arg, value, length))
+			return false;
+
+		memcpy(m_buffers[arg], value, length);
+		m_bind[arg].buffer_type = MYSQL_TYPE_STRING;
+		return true;
+	}
+
+	bool MySQLStatement::bindTextRef(int arg, const char* value, size_t length)
+	{
+		if (!value)
+			return bindNull(arg);
+
+		if (!bindRefImpl(arg, value, length))
 			return false;
 
-		strncpy(m_buffers[arg], value, len);
 		m_bind[arg].buffer_type = MYSQL_TYPE_STRING;
 		return true;
 	}
 
+	bool MySQLStatement::bindBlobRef(int arg, const void* value, size_t size)
+	{
+		if (!value)
+			return bindNull(arg);
+
+		if (!bindRefImpl(arg, value, size))
+			return false;
+
+		m_bind[arg].buffer_type = MYSQL_TYPE_BLOB;
+		return true;
+	}
+
 	bool MySQLStatement::bind(int arg, const void* value, size_t size)
 	{
 		if (!value)
@@ -291,8 +889,8 @@ namespace db { namespace mysql {
 			return false;
 		}
 
-		delete [] m_buffers[arg];
-		m_buffers[arg] = nullptr;
+		freeBuffer(arg);
+		unguardRef(arg);
 
 		m_bind[arg].buffer = nullptr;
 		m_bind[arg].buffer_length = 0;
@@ -309,78 +907,528 @@ namespace db { namespace mysql {
 			return false;
 		}
 
-		delete [] m_buffers[arg];
-		m_buffers[arg] = new (std::nothrow) char[len];
-		if (!m_buffers[arg])
+		long error = allocBuffer(arg, len);
+		unguardRef(arg);
+		if (error)
+		{
+			m_bind[arg].buffer = nullptr;
+			m_bind[arg].buffer_length = 0;
+			m_bind[arg].buffer_type = MYSQL_TYPE_NULL;
+			if (error == error::MEMORY_LIMIT)
+				m_failure.set(error, MEMORY_LIMIT_MESSAGE);
 			return false;
+		}
 
 		m_bind[arg].buffer = m_buffers[arg];
 		m_bind[arg].buffer_length = len;
 		return true;
 	}
 
-	bool MySQLStatement::execute()
-	{
-		if (mysql_stmt_bind_param(m_stmt, m_bind) != 0)
-			return false;
-		return mysql_stmt_execute(m_stmt) == 0;
-	}
-
-	CursorPtr MySQLStatement::query()
+	bool MySQLStatement::bindRefImpl(int arg, const void* value, size_t len)
 	{
-		if (mysql_stmt_bind_param(m_stmt, m_bind) != 0)
-			return false;
-
-		unsigned long type = CURSOR_TYPE_READ_ONLY;
-		if (mysql_stmt_attr_set(m_stmt, STMT_ATTR_CURSOR_TYPE, (void*) &type) != 0)
+		if ((size_t)arg >= m_count)
+		{
+			MYSQL_LOG("[MySQL/Bind] Argument out of bounds (size:%d / index:%d)", (int)m_count, arg);
 			return false;
+		}
 
-		if (mysql_stmt_execute(m_stmt) != 0)
-			return false;
+		freeBuffer(arg);
+		guardRef(arg, value, len);
 
-		try {
-			auto cursor = std::make_shared<MySQLCursor>(m_mysql, m_stmt, shared_from_this());
+		m_bind[arg].buffer = const_cast<void*>(value);
+		m_bind[arg].buffer_length = len;
+		return true;
+	}
 
-			if (!cursor->prepare())
-				return nullptr;
+#if DEBUG_CGI
+	static size_t refHash(const void* value, size_t size)
+	{
+		// FNV-1a
+		size_t hash = 2166136261u;
+		const unsigned char* ptr = (const unsigned char*)value;
+		for (size_t i = 0; i < size; ++i)
+		{
+			hash ^= ptr[i];
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+#endif
 
-			return cursor;
-		} catch(std::bad_alloc) { return nullptr; }
+	void MySQLStatement::guardRef(int arg, const void* value, size_t size)
+	{
+#if DEBUG_CGI
+		RefGuard& guard = m_guards[arg];
+		guard.ptr = value;
+		guard.size = size;
+		guard.hash = refHash(value, size);
+#endif
 	}
 
-	const char* MySQLStatement::errorMessage()
+	void MySQLStatement::unguardRef(int arg)
 	{
-		return mysql_stmt_error(m_stmt);
+#if DEBUG_CGI
+		m_guards[arg].ptr = nullptr;
+#endif
 	}
 
-	long MySQLStatement::errorCode()
+	bool MySQLStatement::checkRefs()
 	{
-		return mysql_stmt_errno(m_stmt);
+#if DEBUG_CGI
+		for (size_t i = 0; i < m_guards.size(); ++i)
+		{
+			const RefGuard& guard = m_guards[i];
+			if (!guard.ptr)
+				continue;
+
+			if (m_bind[i].buffer != guard.ptr || refHash(guard.ptr, guard.size) != guard.hash)
+			{
+				MYSQL_LOG("[MySQL/Bind] Memory bound by reference changed before execution (index:%d)", (int)i);
+				return false;
+			}
+		}
+#endif
+		return true;
 	}
 
-	bool MySQLCursor::allocBind(size_t count)
+	bool MySQLStatement::refresh()
 	{
-		if (!MySQLBinding::allocBind(count))
-			return false;
+		if (m_parent->transactionLost())
+			return m_failure.set(error::TRANSACTION_LOST, "Transaction was lost when reconnecting");
 
-		unsigned long *lengths = new (std::nothrow) unsigned long[m_count];
-		my_bool *is_null = new (std::nothrow) my_bool[m_count];
-		my_bool *error = new (std::nothrow) my_bool[m_count];
-		if (!lengths || !is_null || !error)
+		if (m_stmt && m_generation == m_parent->generation())
+			return true;
+
+		// mysql_close has already detached the old handle, it only needs to be freed
+		if (m_stmt)
+			mysql_stmt_close(m_stmt);
+		releaseStored();
+		m_result.reset();
+		if (m_meta)
 		{
-			delete [] lengths;
-			delete [] is_null;
-			delete [] error;
-			return false;
+			mysql_free_result(m_meta);
+			m_meta = nullptr;
 		}
 
-		deleteBind();
+		m_stmt = mysql_stmt_init(m_mysql);
+		if (!m_stmt)
+			return m_failure.set(CR_OUT_OF_MEMORY, "Cannot allocate the statement after reconnecting");
 
-		m_lengths = lengths;
-		m_is_null = is_null;
-		m_error = error;
+		bool prepared = mysql_stmt_prepare(m_stmt, m_sql.c_str(), m_sql.length()) == 0;
+		m_parent->activity(mysql_stmt_errno(m_stmt));
+		if (!prepared)
+			return false;
 
-		memset(lengths, 0, sizeof(lengths[0]) * count);
+		if (mysql_stmt_param_count(m_stmt) != m_count)
+			return m_failure.set(CR_INVALID_PARAMETER_NO, "Statement has different parameters after reconnecting");
+
+		m_generation = m_parent->generation();
+		return true;
+	}
+
+	static size_t fieldSize(enum_field_types fld_type);
+
+	// at most, as the longest value of each column is counted for each row
+	static size_t storedSize(MYSQL_STMT* stmt)
+	{
+		MYSQL_RES* meta = mysql_stmt_result_metadata(stmt);
+		if (!meta)
+			return 0;
+
+		size_t row = 0;
+		unsigned int count = mysql_num_fields(meta);
+		MYSQL_FIELD* fields = mysql_fetch_fields(meta);
+		for (unsigned int i = 0; i < count; ++i)
+		{
+			size_t size = fieldSize(fields[i].type);
+			row += size && size != (size_t)-1 ? size : fields[i].max_length;
+		}
+		mysql_free_result(meta);
+		return row * (size_t)mysql_stmt_num_rows(stmt);
+	}
+
+	// the values and row pointers of a result read whole
+	static size_t storedSize(MYSQL_RES* result)
+	{
+		size_t size = 0;
+		unsigned int count = mysql_num_fields(result);
+		while (MYSQL_ROW row = mysql_fetch_row(result))
+		{
+			unsigned long* lengths = mysql_fetch_lengths(result);
+			size += (count + 1) * sizeof(row[0]);
+			for (unsigned int i = 0; i < count; ++i)
+				size += lengths[i] + 1;
+		}
+		mysql_data_seek(result, 0);
+		return size;
+	}
+
+	// errors telling the server cannot keep up, as opposed to errors of the call
+	static bool overloaded(unsigned int error)
+	{
+		switch (error)
+		{
+		case CR_SERVER_GONE_ERROR:
+		case CR_SERVER_LOST:
+		case ER_CON_COUNT_ERROR:
+		case ER_OUT_OF_RESOURCES:
+		case ER_TOO_MANY_USER_CONNECTIONS:
+		case ER_LOCK_WAIT_TIMEOUT:
+			return true;
+		default:
+			break;
+		}
+		return false;
+	}
+
+	bool MySQLStatement::execute()
+	{
+		m_failure.clear();
+		if (!checkRefs())
+			return false;
+
+		AdmissionController::Ticket ticket(m_parent->admission());
+		if (!ticket.admitted())
+			return m_failure.set(ticket.error(), ticket.message());
+
+		std::lock_guard<std::mutex> guard(m_parent->lock());
+		if (!refresh())
+			return false;
+		if (mysql_stmt_bind_param(m_stmt, m_bind) != 0)
+			return false;
+		releaseStored(); // freed by the execution
+
+		m_parent->serverTimeout(m_timeout);
+		Deadline deadline(m_parent.get(), m_timeout);
+		m_running.started(m_parent->threadId());
+		bool ret = mysql_stmt_execute(m_stmt) == 0;
+		bool cancelled = m_running.finished() && !ret;
+		unsigned int error = mysql_stmt_errno(m_stmt);
+		bool expired = !ret && (deadline.expired() || error == ER_QUERY_TIMEOUT);
+		m_parent->activity(error);
+		ticket.done(expired || overloaded(error));
+
+		if (cancelled)
+			return m_failure.set(error::CANCELLED, "Statement was cancelled");
+		if (expired)
+			return m_failure.set(error::TIMEOUT, "Statement deadline exceeded");
+		return ret;
+	}
+
+	bool MySQLStatement::cancel()
+	{
+		return m_running.cancel(m_parent->path());
+	}
+
+	CursorPtr MySQLStatement::query()
+	{
+		return open(false);
+	}
+
+	// whole: the rows are read right away, the cursor must not stream
+	CursorPtr MySQLStatement::open(bool whole)
+	{
+		m_failure.clear();
+		if (!checkRefs())
+			return nullptr;
+
+		// under memory pressure, the rows are read as the cursor goes
+		bool buffered = m_buffered || whole;
+		if (buffered && !whole && m_memory && m_memory->pressured())
+		{
+			buffered = false;
+			m_memory->spilled();
+		}
+
+		{
+			AdmissionController::Ticket ticket(m_parent->admission());
+			if (!ticket.admitted())
+			{
+				m_failure.set(ticket.error(), ticket.message());
+				return nullptr;
+			}
+
+			std::lock_guard<std::mutex> guard(m_parent->lock());
+			if (!refresh())
+				return nullptr;
+			if (mysql_stmt_bind_param(m_stmt, m_bind) != 0)
+				return nullptr;
+			releaseStored(); // freed by the execution
+
+			// a buffered result is read whole, right away
+			unsigned long type = buffered ? CURSOR_TYPE_NO_CURSOR : CURSOR_TYPE_READ_ONLY;
+			my_bool maxLength = buffered;
+			if (mysql_stmt_attr_set(m_stmt, STMT_ATTR_CURSOR_TYPE, (void*) &type) != 0 ||
+				mysql_stmt_attr_set(m_stmt, STMT_ATTR_UPDATE_MAX_LENGTH, (void*) &maxLength) != 0)
+				return nullptr;
+
+			m_parent->serverTimeout(m_timeout);
+			Deadline deadline(m_parent.get(), m_timeout);
+			m_running.started(m_parent->threadId());
+			bool executed = mysql_stmt_execute(m_stmt) == 0 && (!buffered || mysql_stmt_store_result(m_stmt) == 0);
+			bool cancelled = m_running.finished() && !executed;
+			unsigned int error = mysql_stmt_errno(m_stmt);
+			bool expired = !executed && (deadline.expired() || error == ER_QUERY_TIMEOUT);
+			m_parent->activity(error);
+			ticket.done(expired || overloaded(error));
+
+			if (cancelled)
+				m_failure.set(error::CANCELLED, "Statement was cancelled");
+			else if (expired)
+				m_failure.set(error::TIMEOUT, "Statement deadline exceeded");
+			if (!executed)
+				return nullptr;
+
+			if (buffered && !keepStored())
+				return nullptr;
+		}
+
+		try {
+			MySQLResultBindingPtr result;
+			if (!resultBinding(result))
+				return nullptr;
+
+			return std::make_shared<MySQLCursor>(m_stmt, result, shared_from_this(), m_parent.get(), m_generation, buffered);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	// the result is kept until the next execution or closing; it is read
+	// whole by now, so a result over the hard limit can only be freed
+	bool MySQLStatement::keepStored()
+	{
+		if (!m_memory)
+			return true;
+
+		size_t stored = storedSize(m_stmt);
+		if (!m_memory->reserve(stored))
+		{
+			MYSQL_LOG("[MySQL] memory limit exceeded, cannot keep a result of %lu bytes", (unsigned long)stored);
+			mysql_stmt_free_result(m_stmt);
+			return m_failure.set(error::MEMORY_LIMIT, MEMORY_LIMIT_MESSAGE);
+		}
+		m_stored = stored;
+		return true;
+	}
+
+	void MySQLStatement::releaseStored()
+	{
+		if (m_stored)
+			m_memory->release(m_stored);
+		m_stored = 0;
+	}
+
+	// the statement holds a single result at a time; the numbers, decimals
+	// and dates of the copy keep both their value and their text
+	static CursorPtr copyResult(const std::shared_ptr<MySQLCursor>& source)
+	{
+		size_t columns = source->columnCount();
+		auto chunk = std::make_shared<RowChunk>(columns);
+		chunk->reserve(source->rowCount());
+		auto recorder = std::make_shared<RowRecorder>(source);
+		recorder->attach(chunk);
+		while (recorder->next())
+		{
+			for (size_t i = 0; i < columns; ++i)
+			{
+				int column = (int)i;
+				if (recorder->isNull(column))
+					continue;
+
+				bool typed = true;
+				switch (source->type(column))
+				{
+				case MYSQL_TYPE_TINY:
+				case MYSQL_TYPE_SHORT:
+				case MYSQL_TYPE_INT24:
+				case MYSQL_TYPE_LONG:
+				case MYSQL_TYPE_LONGLONG:
+				case MYSQL_TYPE_YEAR:
+					recorder->getLongLong(column);
+					break;
+				case MYSQL_TYPE_FLOAT:
+				case MYSQL_TYPE_DOUBLE:
+					recorder->getDouble(column);
+					break;
+				case MYSQL_TYPE_DECIMAL:
+				case MYSQL_TYPE_NEWDECIMAL:
+					recorder->getDecimal(column);
+					break;
+				case MYSQL_TYPE_DATE:
+				case MYSQL_TYPE_DATETIME:
+				case MYSQL_TYPE_TIMESTAMP:
+					recorder->getTimestamp(column);
+					break;
+				default:
+					recorder->getBlob(column);
+					typed = false;
+					break;
+				}
+
+				if (typed)
+					recorder->getText(column);
+			}
+		}
+		return std::make_shared<ChunkCursor>(chunk, source);
+	}
+
+	bool MySQLStatement::nextResult(CursorPtr& cursor)
+	{
+		cursor.reset();
+		{
+			std::lock_guard<std::mutex> guard(m_parent->lock());
+			if (m_generation != m_parent->generation())
+				return m_failure.set(CR_SERVER_LOST, "Lost connection to MySQL server during query");
+
+			releaseStored(); // freed by moving on
+			int status = mysql_stmt_next_result(m_stmt);
+			m_parent->activity(mysql_stmt_errno(m_stmt));
+			if (status != 0)
+				return false;
+			if (!mysql_stmt_field_count(m_stmt))
+				return true;
+			if (mysql_stmt_store_result(m_stmt) != 0 || !keepStored())
+				return false;
+		}
+
+		MySQLResultBindingPtr result;
+		if (!resultBinding(result))
+			return false;
+		cursor = std::make_shared<MySQLCursor>(m_stmt, result, shared_from_this(), m_parent.get(), m_generation, true);
+		return true;
+	}
+
+	ResultsPtr MySQLStatement::results()
+	{
+		// a CALL returns a result for each SELECT inside and the status
+		// of the call; all but the last one are copied before moving on
+		CursorPtr cursor = open(true);
+		if (!cursor && errorCode())
+			return nullptr;
+
+		try {
+			auto results = std::make_shared<MySQLResults>();
+			while (true)
+			{
+				long long affected = cursor ? 0 : (long long)mysql_stmt_affected_rows(m_stmt);
+				bool more;
+				{
+					std::lock_guard<std::mutex> guard(m_parent->lock());
+					more = m_generation == m_parent->generation() && mysql_more_results(m_parent->handle());
+				}
+
+				if (more && cursor)
+					cursor = copyResult(std::static_pointer_cast<MySQLCursor>(cursor));
+				results->add(cursor, affected);
+				if (!more)
+					break;
+
+				if (!nextResult(cursor))
+				{
+					results->fail(errorCode(), errorMessage());
+					break;
+				}
+			}
+			return results;
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	bool MySQLStatement::resultBinding(MySQLResultBindingPtr& result)
+	{
+		// taken after each execution, the types of the columns may change
+		// while their count does not; the result only points to the fields
+		// of the statement, it is cheap to get
+		if (m_meta)
+			mysql_free_result(m_meta);
+		m_meta = mysql_stmt_result_metadata(m_stmt);
+		if (!m_meta)
+			return false;
+
+		// the binding is still registered with the statement, it only
+		// needs to be replaced, if the previous cursor is still alive
+		// or the shape of the result changed
+		if (m_result && m_result.use_count() == 1 && m_result->matches(m_meta))
+		{
+			result = m_result;
+			return true;
+		}
+
+		m_result.reset();
+		result = std::make_shared<MySQLResultBinding>(m_mysql, m_stmt, m_memory);
+		if (!result->prepare(m_meta))
+			return false;
+
+		m_result = result;
+		return true;
+	}
+
+	ConnectionPtr MySQLStatement::getConnection() const
+	{
+		return m_parent;
+	}
+
+	const char* MySQLStatement::errorMessage()
+	{
+		if (m_failure.code)
+			return m_failure.message;
+		return mysql_stmt_error(m_stmt);
+	}
+
+	long MySQLStatement::errorCode()
+	{
+		if (m_failure.code)
+			return m_failure.code;
+		return mysql_stmt_errno(m_stmt);
+	}
+
+	long MySQLBinding::allocBuffer(size_t i, size_t size)
+	{
+		// rebinding the same argument for every row costs nothing, until
+		// a value outgrows the buffer
+		if (m_buffers[i] && m_sizes[i] >= size)
+			return 0;
+
+		freeBuffer(i);
+		if (m_memory && !m_memory->reserve(size))
+		{
+			MYSQL_LOG("[MySQL] memory limit exceeded, cannot allocate %lu bytes", (unsigned long)size);
+			return error::MEMORY_LIMIT;
+		}
+
+		m_buffers[i] = new (std::nothrow) char[size];
+		if (!m_buffers[i])
+		{
+			if (m_memory)
+				m_memory->release(size);
+			return CR_OUT_OF_MEMORY;
+		}
+
+		m_sizes[i] = size;
+		return 0;
+	}
+
+	bool MySQLResultBinding::allocBind(size_t count)
+	{
+		if (!MySQLBinding::allocBind(count))
+			return false;
+
+		unsigned long *lengths = new (std::nothrow) unsigned long[m_count];
+		my_bool *is_null = new (std::nothrow) my_bool[m_count];
+		my_bool *error = new (std::nothrow) my_bool[m_count];
+		if (!lengths || !is_null || !error)
+		{
+			delete [] lengths;
+			delete [] is_null;
+			delete [] error;
+			return false;
+		}
+
+		deleteBind();
+
+		m_lengths = lengths;
+		m_is_null = is_null;
+		m_error = error;
+
+		memset(lengths, 0, sizeof(lengths[0]) * count);
 		memset(is_null, 0, sizeof(is_null[0]) * count);
 		memset(error, 0, sizeof(error[0]) * count);
 
@@ -430,43 +1478,43 @@ namespace db { namespace mysql {
 		return (size_t)-1;
 	}
 
-	bool MySQLCursor::bindResult(const MYSQL_FIELD& field, MYSQL_BIND& bind, char*& buffer)
+	bool MySQLResultBinding::bindResult(const MYSQL_FIELD& field, size_t column)
 	{
+		MYSQL_BIND& bind = m_bind[column];
 		size_t size = fieldSize(field.type);
 		if (size == (size_t)-1)
 			return false;
 
 		bind.buffer_type = field.type;
+		bind.is_unsigned = (field.flags & UNSIGNED_FLAG) != 0; // for copyRow()
 		bind.buffer_length = 0;
-		bind.buffer = buffer;  //?
+		bind.buffer = m_buffers[column];  //?
 
 		if (size == 0)
 			return true;
 
-		delete [] buffer;
-		buffer = new (std::nothrow) char[size];
-		if (!buffer)
+		if (allocBuffer(column, size))
 			return false;
 
-		bind.buffer = buffer;  //?
+		bind.buffer = m_buffers[column];  //?
 		bind.buffer_length = size;
 		return true;
 	}
 
-	bool MySQLCursor::prepare()
+	bool MySQLResultBinding::prepare(MYSQL_RES* meta)
 	{
-		MYSQL_RES *meta = mysql_stmt_result_metadata(m_stmt);
-		if (!meta)
-			return false;
-
 		if (!allocBind(mysql_num_fields(meta)))
 			return false;
 
 		MYSQL_FIELD* fields = mysql_fetch_fields(meta);
 
+		m_types.resize(m_count);
 		for (size_t i = 0; i < m_count; ++i)
-			if (!bindResult(fields[i], m_bind[i], m_buffers[i]))
+		{
+			m_types[i] = fields[i].type;
+			if (!bindResult(fields[i], i))
 				return false;
+		}
 
 		if (mysql_stmt_bind_result(m_stmt, m_bind) != 0)
 			return false;
@@ -474,9 +1522,56 @@ namespace db { namespace mysql {
 		return true;
 	}
 
-	bool MySQLCursor::next()
+	bool MySQLResultBinding::matches(MYSQL_RES* meta) const
+	{
+		if (mysql_num_fields(meta) != m_count)
+			return false;
+
+		MYSQL_FIELD* fields = mysql_fetch_fields(meta);
+		for (size_t i = 0; i < m_count; ++i)
+		{
+			if (fields[i].type != m_types[i])
+				return false;
+		}
+
+		return true;
+	}
+
+	long MySQLResultBinding::fit(size_t column)
+	{
+		size_t size = m_lengths[column] + 1;
+		if (m_buffers[column] && m_sizes[column] >= size)
+			return 0;
+
+		long error = allocBuffer(column, size);
+		if (!error && m_memory && size > m_memory->keep())
+			m_oversized = true;
+		return error;
+	}
+
+	void MySQLResultBinding::shrink()
+	{
+		if (!m_oversized)
+			return;
+		m_oversized = false;
+
+		// the fixed-size buffers are registered with the statement and stay
+		size_t keep = m_memory->keep();
+		for (size_t i = 0; i < m_count; ++i)
+		{
+			if (m_sizes[i] <= keep || fieldSize(m_types[i]) != 0)
+				continue;
+			freeBuffer(i);
+			m_bind[i].buffer = nullptr;
+			m_bind[i].buffer_length = 0;
+			m_memory->shrunk();
+		}
+	}
+
+	bool MySQLCursor::fetch()
 	{
 		int rc = mysql_stmt_fetch(m_stmt);
+		m_conn->activity(mysql_stmt_errno(m_stmt));
 		//if (rc == 1)
 		//	std::cerr << "MySQL: " << mysql_stmt_errno(m_stmt) << ": "
 		//		<< mysql_stmt_error(m_stmt) << std::endl;
@@ -485,13 +1580,106 @@ namespace db { namespace mysql {
 		return rc == 0;
 	}
 
+	bool MySQLCursor::next()
+	{
+		std::lock_guard<std::mutex> guard(m_conn->lock());
+		// past the end, there is no row to bookmark
+		if (m_generation != m_conn->generation())
+		{
+			m_row = npos;
+			return false; // the statement was closed by reconnecting
+		}
+		m_result->shrink();
+		if (!fetch())
+		{
+			m_row = npos;
+			return false;
+		}
+		++m_row;
+		return true;
+	}
+
+	bool MySQLCursor::seek(size_t row)
+	{
+		if (!m_buffered || row >= rowCount())
+			return false;
+
+		std::lock_guard<std::mutex> guard(m_conn->lock());
+		if (m_generation != m_conn->generation())
+			return false;
+		m_result->shrink();
+		mysql_stmt_data_seek(m_stmt, row);
+		if (!fetch())
+		{
+			m_row = npos;
+			return false;
+		}
+		m_row = row;
+		return true;
+	}
+
+	bool MySQLCursor::rewind()
+	{
+		if (!m_buffered)
+			return false;
+
+		std::lock_guard<std::mutex> guard(m_conn->lock());
+		if (m_generation != m_conn->generation())
+			return false;
+		mysql_stmt_data_seek(m_stmt, 0);
+		m_row = npos;
+		return true;
+	}
+
+	// after a reconnect, the statement closes the handle of this cursor
+	static tyme::time_t timeOf(const MYSQL_TIME& time)
+	{
+		tyme::tm_t tm = {};
+		tm.tm_year = time.year - 1900;
+		tm.tm_mon  = time.month - 1;
+		tm.tm_mday = time.day;
+		tm.tm_hour = time.hour;
+		tm.tm_min  = time.minute;
+		tm.tm_sec  = time.second;
+		return tyme::mktime(tm);
+	}
+
+	// the integer columns are bound with their own type and size
+	static bool integerOf(enum_field_types type, bool isUnsigned, const char* buffer, long long& value)
+	{
+		switch (type)
+		{
+		case MYSQL_TYPE_TINY:
+			value = isUnsigned ? (long long)*(const unsigned char*)buffer : (long long)*(const signed char*)buffer;
+			return true;
+		case MYSQL_TYPE_SHORT:
+		case MYSQL_TYPE_YEAR:
+			value = isUnsigned ? (long long)*(const unsigned short*)buffer : (long long)*(const short*)buffer;
+			return true;
+		case MYSQL_TYPE_INT24:
+		case MYSQL_TYPE_LONG:
+			value = isUnsigned ? (long long)*(const uint32_t*)buffer : (long long)*(const int32_t*)buffer;
+			return true;
+		case MYSQL_TYPE_LONGLONG:
+			value = *(const long long*)buffer;
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	bool MySQLCursor::stale() const
+	{
+		return m_generation != m_conn->generation();
+	}
+
 	size_t MySQLCursor::columnCount()
 	{
-		return m_count;
+		return m_result->m_count;
 	}
 
 	template <typename T>
-	T getIntType(MYSQL_STMT* stmt, int column, enum_field_types type)
+	T getValue(MYSQL_STMT* stmt, int column, enum_field_types type)
 	{
 		T ret = 0;
 		MYSQL_BIND bind = {};
@@ -504,154 +1692,776 @@ namespace db { namespace mysql {
 
 	long MySQLCursor::getLong(int column)
 	{
-		if ((size_t)column >= m_count)
+		if ((size_t)column >= m_result->m_count)
 		{
-			MYSQL_LOG("[MySQL/getLong] Argument out of bounds (size:%d / index:%d)", (int)m_count, column);
+			MYSQL_LOG("[MySQL/getLong] Argument out of bounds (size:%d / index:%d)", (int)m_result->m_count, column);
 			return false;
 		}
 
-		if (m_is_null[column])
+		if (m_result->m_is_null[column] || stale())
 			return 0;
 
-		return getIntType<long>(m_stmt, column, MYSQL_TYPE_LONG);
+		return getValue<long>(m_stmt, column, MYSQL_TYPE_LONG);
 	}
 
 	long long MySQLCursor::getLongLong(int column)
 	{
-		if ((size_t)column >= m_count)
+		if ((size_t)column >= m_result->m_count)
 		{
-			MYSQL_LOG("[MySQL/getLongLong] Argument out of bounds (size:%d / index:%d)", (int)m_count, column);
+			MYSQL_LOG("[MySQL/getLongLong] Argument out of bounds (size:%d / index:%d)", (int)m_result->m_count, column);
 			return false;
 		}
 
-		if (m_is_null[column])
+		if (m_result->m_is_null[column] || stale())
 			return 0;
 
-		return getIntType<long long>(m_stmt, column, MYSQL_TYPE_LONGLONG);
+		return getValue<long long>(m_stmt, column, MYSQL_TYPE_LONGLONG);
 	}
 
-	tyme::time_t MySQLCursor::getTimestamp(int column)
+	double MySQLCursor::getDouble(int column)
 	{
-		if ((size_t)column >= m_count)
+		if ((size_t)column >= m_result->m_count)
 		{
-			MYSQL_LOG("[MySQL/getTimestamp] Argument out of bounds (size:%d / index:%d)", (int)m_count, column);
-			return false;
+			MYSQL_LOG("[MySQL/getDouble] Argument out of bounds (size:%d / index:%d)", (int)m_result->m_count, column);
+			return 0;
 		}
 
-		if (m_is_null[column])
+		if (m_result->m_is_null[column] || stale())
 			return 0;
 
-		MYSQL_TIME time = {};
+		// the bound buffer already holds the value
+		switch (m_result->m_types[column])
+		{
+		case MYSQL_TYPE_DOUBLE: return *(const double*)m_result->m_buffers[column];
+		case MYSQL_TYPE_FLOAT: return *(const float*)m_result->m_buffers[column];
+		default: break;
+		}
+
+		return getValue<double>(m_stmt, column, MYSQL_TYPE_DOUBLE);
+	}
+
+	float MySQLCursor::getFloat(int column)
+	{
+		if ((size_t)column < m_result->m_count && m_result->m_types[column] == MYSQL_TYPE_FLOAT)
+		{
+			if (m_result->m_is_null[column] || stale())
+				return 0;
+			return *(const float*)m_result->m_buffers[column];
+		}
+
+		return (float)getDouble(column);
+	}
+
+	Decimal MySQLCursor::getDecimal(int column)
+	{
+		Decimal value;
+		readDecimal(column, value);
+		return value;
+	}
+
+	bool MySQLCursor::readDecimal(int column, Decimal& value)
+	{
+		value = Decimal();
+		if ((size_t)column >= m_result->m_count)
+		{
+			MYSQL_LOG("[MySQL/getDecimal] Argument out of bounds (size:%d / index:%d)", (int)m_result->m_count, column);
+			return false;
+		}
+
+		if (m_result->m_is_null[column])
+			return true;
+		if (stale())
+			return false;
+
+		switch (m_result->m_types[column])
+		{
+		case MYSQL_TYPE_TINY:
+		case MYSQL_TYPE_SHORT:
+		case MYSQL_TYPE_INT24:
+		case MYSQL_TYPE_LONG:
+		case MYSQL_TYPE_LONGLONG:
+		case MYSQL_TYPE_YEAR:
+			value = Decimal(getLongLong(column), 0);
+			return true;
+		default: break;
+		}
+
+		MySQLStatement* parent = static_cast<MySQLStatement*>(m_parent.get());
+
+		// DECIMAL(65,30) with the sign and the point still fits
+		char text[80];
+		unsigned long length = 0;
+		MYSQL_BIND bind = {};
+		bind.buffer_type = MYSQL_TYPE_STRING;
+		bind.buffer = text;
+		bind.buffer_length = sizeof(text);
+		bind.length = &length;
+		if (mysql_stmt_fetch_column(m_stmt, &bind, column, 0) != 0)
+		{
+			MYSQL_LOG("[MySQL/getDecimal] %s", mysql_stmt_error(m_stmt));
+			return false; // the error stays on the statement
+		}
+
+		if (!Decimal::parse(text, length < sizeof(text) ? length : sizeof(text), value))
+		{
+			MYSQL_LOG("[MySQL/getDecimal] value of column %d does not fit in 18 digits", column);
+			value = Decimal();
+			return parent->fail(ER_WARN_DATA_OUT_OF_RANGE, "Value does not fit in a Decimal");
+		}
+		return true;
+	}
+
+	tyme::time_t MySQLCursor::getTimestamp(int column)
+	{
+		if ((size_t)column >= m_result->m_count)
+		{
+			MYSQL_LOG("[MySQL/getTimestamp] Argument out of bounds (size:%d / index:%d)", (int)m_result->m_count, column);
+			return false;
+		}
+
+		if (m_result->m_is_null[column] || stale())
+			return 0;
+
+		MYSQL_TIME time = {};
 		MYSQL_BIND bind = {};
 		bind.buffer_type = MYSQL_TYPE_TIMESTAMP;
 		bind.buffer = &time;
 		if (mysql_stmt_fetch_column(m_stmt, &bind, column, 0) != 0)
 			return 0;
 
-		tyme::tm_t tm = {};
-		tm.tm_year = time.year - 1900;
-		tm.tm_mon  = time.month - 1;
-		tm.tm_mday = time.day;
-		tm.tm_hour = time.hour;
-		tm.tm_min  = time.minute;
-		tm.tm_sec  = time.second;
-		return tyme::mktime(tm);
+		return timeOf(time);
 	}
 
-	const char* MySQLCursor::getText(int column)
+	bool MySQLCursor::copyRow(BatchColumn* columns, size_t count, size_t row)
 	{
-		if ((size_t)column >= m_count)
+		if (stale())
+			return false;
+
+		// straight from the bound buffers, where they hold the value in
+		// the type asked for; through the getters otherwise
+		for (size_t i = 0; i < count; ++i)
+		{
+			BatchColumn& col = columns[i];
+			size_t column = (size_t)col.column;
+			if (column >= m_result->m_count)
+				return false;
+
+			bool null = m_result->m_is_null[column] != 0;
+			col.nulls[row] = null ? 0xFF : 0;
+			if (null)
+			{
+				if (col.type == BatchColumn::REAL)
+					col.reals[row] = 0;
+				else
+					col.ints[row] = 0;
+				continue;
+			}
+
+			const char* buffer = m_result->m_buffers[column];
+			enum_field_types type = m_result->m_types[column];
+			switch (col.type)
+			{
+			case BatchColumn::INTEGER:
+				if (!integerOf(type, m_result->m_bind[column].is_unsigned != 0, buffer, col.ints[row]))
+					col.ints[row] = getLongLong(col.column);
+				break;
+			case BatchColumn::REAL:
+				if (type == MYSQL_TYPE_DOUBLE)
+					col.reals[row] = *(const double*)buffer;
+				else if (type == MYSQL_TYPE_FLOAT)
+					col.reals[row] = *(const float*)buffer;
+				else
+					col.reals[row] = getDouble(col.column);
+				break;
+			case BatchColumn::TIMESTAMP:
+				if (type == MYSQL_TYPE_DATE || type == MYSQL_TYPE_DATETIME || type == MYSQL_TYPE_TIMESTAMP)
+					col.ints[row] = (long long)timeOf(*(const MYSQL_TIME*)buffer);
+				else
+					col.ints[row] = (long long)getTimestamp(col.column);
+				break;
+			}
+		}
+		return true;
+	}
+
+	char* MySQLCursor::fetchColumn(int column, enum_field_types type, const char* getter)
+	{
+		if ((size_t)column >= m_result->m_count)
 		{
-			MYSQL_LOG("[MySQL/getText] Argument out of bounds (size:%d / index:%d)", (int)m_count, column);
+			MYSQL_LOG("[MySQL/%s] Argument out of bounds (size:%d / index:%d)", getter, (int)m_result->m_count, column);
 			return nullptr;
 		}
 
-		if (m_is_null[column])
+		if (m_result->m_is_null[column] || stale())
 			return nullptr;
 
-		if (m_error[column] || !m_buffers[column]) // the field would have been truncated
+		if (m_result->m_error[column] || !m_result->m_buffers[column]) // the field would have been truncated
 		{
-			char* buffer = new (std::nothrow) char[m_lengths[column] + 1];
-			if (!buffer)
+			// the buffer of a previous row is reused, if long enough
+			long error = m_result->fit(column);
+			if (error == error::MEMORY_LIMIT)
+				static_cast<MySQLStatement*>(m_parent.get())->fail(error, MEMORY_LIMIT_MESSAGE);
+			if (error)
 				return nullptr;
 
-			delete [] m_buffers[column];
-			m_buffers[column] = buffer;
-
-			m_bind[column].buffer_type = MYSQL_TYPE_STRING;
-			m_bind[column].buffer = m_buffers[column];
-			m_bind[column].buffer_length = m_lengths[column];
+			m_result->m_bind[column].buffer_type = type;
+			m_result->m_bind[column].buffer = m_result->m_buffers[column];
+			m_result->m_bind[column].buffer_length = m_result->m_lengths[column];
 		}
 
 		MYSQL_BIND bind = {};
-		bind.buffer_type = MYSQL_TYPE_STRING;
-		bind.buffer = m_buffers[column];
-		bind.buffer_length = m_lengths[column];
+		bind.buffer_type = type;
+		bind.buffer = m_result->m_buffers[column];
+		bind.buffer_length = m_result->m_lengths[column];
 
 		if (mysql_stmt_fetch_column(m_stmt, &bind, column, 0) != 0)
 			return nullptr;
 
-		m_buffers[column][m_lengths[column]] = 0;
-		return m_buffers[column];
+		m_result->m_buffers[column][m_result->m_lengths[column]] = 0;
+		return m_result->m_buffers[column];
+	}
+
+	const char* MySQLCursor::getText(int column)
+	{
+		return fetchColumn(column, MYSQL_TYPE_STRING, "getText");
 	}
 
 	size_t MySQLCursor::getBlobSize(int column)
 	{
-		if ((size_t)column >= m_count)
+		if ((size_t)column >= m_result->m_count)
 		{
-			MYSQL_LOG("[MySQL/getBlobSize] Argument out of bounds (size:%d / index:%d)", (int)m_count, column);
+			MYSQL_LOG("[MySQL/getBlobSize] Argument out of bounds (size:%d / index:%d)", (int)m_result->m_count, column);
 			return 0;
 		}
 
-		return m_lengths[column];
+		return m_result->m_lengths[column];
 	}
 
 	const void* MySQLCursor::getBlob(int column)
 	{
-		if ((size_t)column >= m_count)
+		return fetchColumn(column, MYSQL_TYPE_BLOB, "getBlob");
+	}
+
+	bool MySQLCursor::isNull(int column)
+	{
+		if ((size_t)column >= m_result->m_count)
 		{
-			MYSQL_LOG("[MySQL/getBlob] Argument out of bounds (size:%d / index:%d)", (int)m_count, column);
-			return nullptr;
+			MYSQL_LOG("[MySQL/isNull] Argument out of bounds (size:%d / index:%d)", (int)m_result->m_count, column);
+			return true;
+		}
+
+		return m_result->m_is_null[column] != 0;
+	}
+
+	MySQLTextStatement::MySQLTextStatement(const MySQLConnectionPtr& parent, bool stream)
+		: m_parent(parent)
+		, m_stream(stream)
+		, m_timeout(0)
+	{
+	}
+
+	bool MySQLTextStatement::prepare(const char* sql)
+	{
+		if (!sql) return false;
+
+		// split on the placeholders outside of quotes and comments
+		std::string chunk;
+		const char* ptr = sql;
+		while (*ptr)
+		{
+			char c = *ptr;
+			if (c == '?')
+			{
+				m_sql.push_back(chunk);
+				chunk.clear();
+				++ptr;
+				continue;
+			}
+
+			const char* end = ptr + 1;
+			if (c == '\'' || c == '"' || c == '`')
+			{
+				while (*end && *end != c)
+				{
+					if (*end == '\\' && c != '`' && end[1])
+						++end;
+					++end;
+				}
+				if (*end)
+					++end;
+			}
+			else if (c == '#' || (c == '-' && ptr[1] == '-' && (ptr[2] == ' ' || ptr[2] == '\t')))
+			{
+				while (*end && *end != '\n')
+					++end;
+			}
+			else if (c == '/' && ptr[1] == '*')
+			{
+				const char* close = strstr(ptr + 2, "*/");
+				end = close ? close + 2 : ptr + strlen(ptr);
+			}
+
+			chunk.append(ptr, end);
+			ptr = end;
+		}
+		m_sql.push_back(chunk);
+		m_args.resize(m_sql.size() - 1);
+		return true;
+	}
+
+	bool MySQLTextStatement::literal(int arg, const std::string& value)
+	{
+		if ((size_t)arg >= m_args.size())
+		{
+			MYSQL_LOG("[MySQL/Bind] Argument out of bounds (size:%d / index:%d)", (int)m_args.size(), arg);
+			return false;
+		}
+
+		m_args[arg] = value;
+		return true;
+	}
+
+	bool MySQLTextStatement::quoted(int arg, const char* value, size_t length)
+	{
+		if ((size_t)arg >= m_args.size())
+			return literal(arg, std::string());
+
+		// the escaping follows the character set and the sql_mode of the connection
+		std::string& out = m_args[arg];
+		out.resize(length * 2 + 3);
+		out[0] = '\'';
+#if MYSQL_VERSION_ID >= 50706 && !defined(MARIADB_BASE_VERSION)
+		unsigned long size = mysql_real_escape_string_quote(m_parent->handle(), &out[1], value, length, '\'');
+#else
+		unsigned long size = mysql_real_escape_string(m_parent->handle(), &out[1], value, length);
+#endif
+		if (size == (unsigned long)-1) // NO_BACKSLASH_ESCAPES
+		{
+			out.clear();
+			return m_failure.set(CR_UNKNOWN_ERROR, "Cannot escape the value for the sql_mode of the connection");
+		}
+		out[size + 1] = '\'';
+		out.resize(size + 2);
+		return true;
+	}
+
+	bool MySQLTextStatement::bind(int arg, long long value)
+	{
+		std::ostringstream s;
+		s << value;
+		return literal(arg, s.str());
+	}
+
+	bool MySQLTextStatement::bind(int arg, const char* value)
+	{
+		if (!value)
+			return bindNull(arg);
+
+		return quoted(arg, value, strlen(value));
+	}
+
+	bool MySQLTextStatement::bindText(int arg, const char* value, size_t length)
+	{
+		if (!value)
+			return bindNull(arg);
+
+		return quoted(arg, value, length);
+	}
+
+	bool MySQLTextStatement::bind(int arg, const void* value, size_t size)
+	{
+		if (!value)
+			return bindNull(arg);
+
+		if ((size_t)arg >= m_args.size())
+			return literal(arg, std::string());
+
+		// X'' is not accepted by older servers
+		if (!size)
+			return literal(arg, "''");
+
+		std::string& out = m_args[arg];
+		out.resize(size * 2 + 4);
+		out[0] = 'X';
+		out[1] = '\'';
+		size_t length = mysql_hex_string(&out[2], (const char*)value, size);
+		out[length + 2] = '\'';
+		out.resize(length + 3);
+		return true;
+	}
+
+	bool MySQLTextStatement::bindTime(int arg, tyme::time_t value)
+	{
+		tyme::tm_t tm = tyme::gmtime(value);
+		char buffer[64];
+		sprintf(buffer, "'%04d-%02d-%02d %02d:%02d:%02d'",
+			tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+			tm.tm_hour, tm.tm_min, tm.tm_sec);
+		return literal(arg, buffer);
+	}
+
+	// the statements of a batch, after the one already read; false, if
+	// one of them failed, with the error left on the connection
+	static bool drainResults(MYSQL* mysql)
+	{
+		while (mysql_more_results(mysql))
+		{
+			if (mysql_next_result(mysql) != 0)
+				return false;
+			MYSQL_RES* res = mysql_store_result(mysql);
+			if (res)
+				mysql_free_result(res);
+			else if (mysql_field_count(mysql))
+				return false;
+		}
+		return true;
+	}
+
+	bool MySQLTextStatement::run(MYSQL_RES** result, MySQLResults* batch)
+	{
+		m_failure.clear();
+
+		std::string sql = m_sql[0];
+		for (size_t i = 0; i < m_args.size(); ++i)
+		{
+			if (m_args[i].empty())
+				return m_failure.set(CR_PARAMS_NOT_BOUND, "No data supplied for parameters in prepared statement");
+			sql.append(m_args[i]);
+			sql.append(m_sql[i + 1]);
+		}
+
+		AdmissionController::Ticket ticket(m_parent->admission());
+		if (!ticket.admitted())
+			return m_failure.set(ticket.error(), ticket.message());
+
+		std::lock_guard<std::mutex> guard(m_parent->lock());
+		if (m_parent->transactionLost())
+			return m_failure.set(error::TRANSACTION_LOST, "Transaction was lost when reconnecting");
+
+		MYSQL* mysql = m_parent->handle();
+		m_parent->serverTimeout(m_timeout);
+		Deadline deadline(m_parent.get(), m_timeout);
+		m_running.started(m_parent->threadId());
+		bool ret = mysql_real_query(mysql, sql.c_str(), sql.length()) == 0;
+		if (ret && batch)
+			collect(mysql, *batch);
+		else if (ret)
+		{
+			bool stream = result && m_stream;
+			MYSQL_RES* res = stream ? mysql_use_result(mysql) : mysql_store_result(mysql);
+			// no result set at all is fine, a lost one is not
+			if (!res && mysql_field_count(mysql))
+				ret = false;
+			if (result)
+				*result = res;
+			else if (res)
+				mysql_free_result(res);
+			if (ret && !stream && !drainResults(mysql))
+			{
+				ret = false;
+				if (result && *result)
+				{
+					mysql_free_result(*result);
+					*result = nullptr;
+				}
+			}
+		}
+		bool cancelled = m_running.finished() && !ret;
+		unsigned int error = mysql_errno(mysql);
+		bool expired = !ret && (deadline.expired() || error == ER_QUERY_TIMEOUT);
+		m_parent->activity(error);
+		ticket.done(expired || overloaded(error));
+
+		if (cancelled)
+			return m_failure.set(error::CANCELLED, "Statement was cancelled");
+		if (expired)
+			return m_failure.set(error::TIMEOUT, "Statement deadline exceeded");
+		return ret;
+	}
+
+	void MySQLTextStatement::collect(MYSQL* mysql, MySQLResults& batch)
+	{
+		int status = 0;
+		while (status == 0)
+		{
+			MYSQL_RES* res = mysql_store_result(mysql);
+			if (!res && mysql_field_count(mysql))
+			{
+				batch.fail(mysql_errno(mysql), mysql_error(mysql));
+				drainResults(mysql);
+				return;
+			}
+
+			CursorPtr cursor;
+			if (res)
+			{
+				size_t stored = storedSize(res);
+				const MemoryBudgetPtr& memory = m_parent->budget();
+				if (memory && !memory->reserve(stored))
+				{
+					MYSQL_LOG("[MySQL] memory limit exceeded, cannot keep a result of %lu bytes", (unsigned long)stored);
+					mysql_free_result(res);
+					batch.fail(error::MEMORY_LIMIT, MEMORY_LIMIT_MESSAGE);
+					drainResults(mysql);
+					return;
+				}
+
+				try {
+					cursor = std::make_shared<MySQLTextCursor>(res, shared_from_this(), m_parent.get(), m_parent->generation(), false, memory ? stored : 0);
+				} catch(std::bad_alloc) {
+					if (memory)
+						memory->release(stored);
+					mysql_free_result(res);
+					batch.fail(CR_OUT_OF_MEMORY, "Cannot allocate the cursor");
+					drainResults(mysql);
+					return;
+				}
+			}
+			batch.add(cursor, res ? 0 : (long long)mysql_affected_rows(mysql));
+
+			// the server stops the batch on the first failing statement
+			status = mysql_next_result(mysql);
+			if (status > 0)
+				batch.fail(mysql_errno(mysql), mysql_error(mysql));
 		}
+	}
+
+	ResultsPtr MySQLTextStatement::results()
+	{
+		MySQLResultsPtr batch;
+		try {
+			batch = std::make_shared<MySQLResults>();
+		} catch(std::bad_alloc) { return nullptr; }
+
+		if (!run(nullptr, batch.get()))
+			return nullptr;
+		return batch;
+	}
 
-		if (m_is_null[column])
+	CursorPtr MySQLTextStatement::query()
+	{
+		// a streamed result would keep the connection busy, unlike the
+		// server-side cursors of MySQLStatement, so it never spills
+		MYSQL_RES* result = nullptr;
+		if (!run(&result, nullptr))
 			return nullptr;
 
-		if (m_error[column] || !m_buffers[column]) // the field would have been truncated
+		const MemoryBudgetPtr& memory = m_parent->budget();
+		size_t stored = 0;
+		if (result && !m_stream && memory)
 		{
-			char* buffer = new (std::nothrow) char[m_lengths[column] + 1];
-			if (!buffer)
+			stored = storedSize(result);
+			if (!memory->reserve(stored))
+			{
+				MYSQL_LOG("[MySQL] memory limit exceeded, cannot keep a result of %lu bytes", (unsigned long)stored);
+				mysql_free_result(result);
+				m_failure.set(error::MEMORY_LIMIT, MEMORY_LIMIT_MESSAGE);
 				return nullptr;
+			}
+		}
+
+		try {
+			return std::make_shared<MySQLTextCursor>(result, shared_from_this(), m_parent.get(), m_parent->generation(), m_stream, stored);
+		} catch(std::bad_alloc) {
+			if (stored)
+				memory->release(stored);
+			if (result)
+			{
+				std::lock_guard<std::mutex> guard(m_parent->lock());
+				mysql_free_result(result);
+			}
+			return nullptr;
+		}
+	}
+
+	bool MySQLTextStatement::cancel()
+	{
+		return m_running.cancel(m_parent->path());
+	}
+
+	ConnectionPtr MySQLTextStatement::getConnection() const
+	{
+		return m_parent;
+	}
+
+	const char* MySQLTextStatement::errorMessage()
+	{
+		if (m_failure.code)
+			return m_failure.message;
+		return mysql_error(m_parent->handle());
+	}
+
+	long MySQLTextStatement::errorCode()
+	{
+		if (m_failure.code)
+			return m_failure.code;
+		return mysql_errno(m_parent->handle());
+	}
+
+	void MySQLResults::add(const CursorPtr& cursor, long long affected)
+	{
+		Outcome outcome = { cursor, affected, 0, std::string() };
+		m_outcomes.push_back(outcome);
+	}
 
-			delete[] m_buffers[column];
-			m_buffers[column] = buffer;
+	void MySQLResults::fail(long error, const char* message)
+	{
+		Outcome outcome = { nullptr, 0, error, message ? message : "" };
+		m_outcomes.push_back(outcome);
+	}
+
+	bool MySQLResults::next()
+	{
+		if (m_current != (size_t)-1 && m_current >= m_outcomes.size())
+			return false;
+		++m_current;
+		return m_current < m_outcomes.size();
+	}
+
+	MySQLTextCursor::~MySQLTextCursor()
+	{
+		if (m_stored)
+			m_conn->budget()->release(m_stored);
+		if (!m_result)
+			return;
 
-			m_bind[column].buffer_type = MYSQL_TYPE_BLOB;
-			m_bind[column].buffer = m_buffers[column];
-			m_bind[column].buffer_length = m_lengths[column];
+		if (!m_stream)
+		{
+			mysql_free_result(m_result);
+			return;
 		}
 
-		MYSQL_BIND bind = {};
-		bind.buffer_type = MYSQL_TYPE_BLOB;
-		bind.buffer = m_buffers[column];
-		bind.buffer_length = m_lengths[column];
+		// reads the rest of the rows off the connection; after a reconnect,
+		// mysql_close has already marked the result as cancelled
+		std::lock_guard<std::mutex> guard(m_conn->lock());
+		mysql_free_result(m_result);
+	}
 
-		if (mysql_stmt_fetch_column(m_stmt, &bind, column, 0) != 0)
-			return nullptr;
+	bool MySQLTextCursor::next()
+	{
+		if (!m_result)
+			return false;
+
+		if (m_stream)
+		{
+			std::lock_guard<std::mutex> guard(m_conn->lock());
+			if (m_generation != m_conn->generation())
+				return false; // the result was lost by reconnecting
+			m_row = mysql_fetch_row(m_result);
+			m_conn->activity(mysql_errno(m_conn->handle()));
+		}
+		else
+			m_row = mysql_fetch_row(m_result);
 
-		m_buffers[column][m_lengths[column]] = 0;
-		return m_buffers[column];
+		m_lengths = m_row ? mysql_fetch_lengths(m_result) : nullptr;
+		if (!m_row)
+		{
+			m_index = npos;
+			return false;
+		}
+		++m_index;
+		return true;
 	}
 
-	bool MySQLCursor::isNull(int column)
+	bool MySQLTextCursor::seek(size_t row)
+	{
+		if (!m_result || m_stream || row >= rowCount())
+			return false;
+
+		mysql_data_seek(m_result, row);
+		m_row = mysql_fetch_row(m_result);
+		m_lengths = m_row ? mysql_fetch_lengths(m_result) : nullptr;
+		m_index = m_row ? row : npos;
+		return m_row != nullptr;
+	}
+
+	bool MySQLTextCursor::rewind()
+	{
+		if (!m_result || m_stream)
+			return false;
+
+		mysql_data_seek(m_result, 0);
+		m_row = nullptr;
+		m_lengths = nullptr;
+		m_index = npos;
+		return true;
+	}
+
+	const char* MySQLTextCursor::value(int column, const char* getter)
 	{
 		if ((size_t)column >= m_count)
 		{
-			MYSQL_LOG("[MySQL/isNull] Argument out of bounds (size:%d / index:%d)", (int)m_count, column);
-			return true;
+			MYSQL_LOG("[MySQL/%s] Argument out of bounds (size:%d / index:%d)", getter, (int)m_count, column);
+			return nullptr;
+		}
+
+		return m_row ? m_row[column] : nullptr;
+	}
+
+	long MySQLTextCursor::getLong(int column)
+	{
+		const char* text = value(column, "getLong");
+		return text ? strtol(text, nullptr, 10) : 0;
+	}
+
+	long long MySQLTextCursor::getLongLong(int column)
+	{
+		const char* text = value(column, "getLongLong");
+		return text ? strtoll(text, nullptr, 10) : 0;
+	}
+
+	double MySQLTextCursor::getDouble(int column)
+	{
+		const char* text = value(column, "getDouble");
+		return text ? strtod(text, nullptr) : 0;
+	}
+
+	Decimal MySQLTextCursor::getDecimal(int column)
+	{
+		Decimal ret;
+		readDecimal(column, ret);
+		return ret;
+	}
+
+	bool MySQLTextCursor::readDecimal(int column, Decimal& ret)
+	{
+		ret = Decimal();
+		const char* text = value(column, "getDecimal");
+		if (!text)
+			return (size_t)column < m_count && isNull(column);
+
+		if (!Decimal::parse(text, m_lengths[column], ret))
+		{
+			MYSQL_LOG("[MySQL/getDecimal] value of column %d does not fit in 18 digits", column);
+			ret = Decimal();
+			return static_cast<MySQLTextStatement*>(m_parent.get())->fail(ER_WARN_DATA_OUT_OF_RANGE, "Value does not fit in a Decimal");
 		}
+		return true;
+	}
+
+	tyme::time_t MySQLTextCursor::getTimestamp(int column)
+	{
+		const char* text = value(column, "getTimestamp");
+		if (!text)
+			return 0;
+
+		tyme::tm_t tm = {};
+		if (sscanf(text, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) < 3)
+			return 0;
+		tm.tm_year -= 1900;
+		tm.tm_mon  -= 1;
+		return tyme::mktime(tm);
+	}
 
-		return m_is_null[column] != 0;
+	size_t MySQLTextCursor::getBlobSize(int column)
+	{
+		if (!value(column, "getBlobSize"))
+			return 0;
+		return m_lengths[column];
 	}
 
+	bool MySQLTextCursor::isNull(int column)
+	{
+		return !value(column, "isNull");
+	}
 }}
@@ -27,20 +27,54 @@
 
 #include <db/conn.hpp>
 #include <db/driver.hpp>
+#include <db/admission.hpp>
 #include <filesystem.hpp>
 
 #ifdef _WIN32
 #include <mysql.h>
+#include <errmsg.h>
+#include <mysqld_error.h>
 #else
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>
+#include <mysql/mysqld_error.h>
 #endif
 
 #include <string.h>
+#include <atomic>
+#include <mutex>
 
 namespace db
 {
 	namespace mysql
 	{
+		class MySQLConnection;
+		typedef std::shared_ptr<MySQLConnection> MySQLConnectionPtr;
+
+		struct ClientError
+		{
+			long code;
+			const char* message;
+			ClientError(): code(0), message(nullptr) {}
+			bool set(long c, const char* msg) { code = c; message = msg; return false; }
+			void clear() { code = 0; message = nullptr; }
+		};
+
+		// the call of a statement, which is running right now, as seen by
+		// a cancel() from another thread
+		class RunningQuery
+		{
+			std::mutex m_lock;
+			bool m_running;
+			bool m_cancelled;
+			unsigned long m_threadId;
+		public:
+			RunningQuery(): m_running(false), m_cancelled(false), m_threadId(0) {}
+			void started(unsigned long threadId);
+			bool finished();
+			bool cancel(const filesystem::path& path);
+		};
+
 		class MySQLBinding
 		{
 		protected:
@@ -48,13 +82,17 @@ namespace db
 			MYSQL_STMT* m_stmt;
 			MYSQL_BIND *m_bind;
 			char **m_buffers;
+			size_t *m_sizes;
 			size_t m_count;
-			MySQLBinding(MYSQL *mysql, MYSQL_STMT* stmt)
+			MemoryBudgetPtr m_memory;
+			MySQLBinding(MYSQL *mysql, MYSQL_STMT* stmt, const MemoryBudgetPtr& memory)
 				: m_mysql(mysql)
 				, m_stmt(stmt)
 				, m_bind(nullptr)
 				, m_buffers(nullptr)
+				, m_sizes(nullptr)
 				, m_count(0)
+				, m_memory(memory)
 			{
 			}
 			~MySQLBinding()
@@ -67,10 +105,12 @@ namespace db
 				delete [] m_bind;
 				m_bind = nullptr;
 				for (size_t i = 0 ; i < m_count; ++i)
-					delete [] m_buffers[i];
+					freeBuffer(i);
 				delete [] m_buffers;
+				delete [] m_sizes;
 
 				m_buffers = nullptr;
+				m_sizes = nullptr;
 				m_count = 0;
 			}
 
@@ -78,11 +118,13 @@ namespace db
 			{
 				MYSQL_BIND *bind = new (std::nothrow) MYSQL_BIND[count];
 				char **buffers = new (std::nothrow) char*[count];
+				size_t *sizes = new (std::nothrow) size_t[count];
 
-				if (!bind || !buffers)
+				if (!bind || !buffers || !sizes)
 				{
 					delete [] bind;
 					delete [] buffers;
+					delete [] sizes;
 					return false;
 				}
 
@@ -90,20 +132,36 @@ namespace db
 
 				memset(bind, 0, sizeof(MYSQL_BIND) * count);
 				memset(buffers, 0, sizeof(char*) * count);
+				memset(sizes, 0, sizeof(size_t) * count);
 				m_bind = bind;
 				m_buffers = buffers;
+				m_sizes = sizes;
 				m_count = count;
 
 				return true;
 			}
+
+			// replaces the buffer with a new one, charged to the budget;
+			// error::MEMORY_LIMIT or CR_OUT_OF_MEMORY, if there is none
+			long allocBuffer(size_t i, size_t size);
+			void freeBuffer(size_t i)
+			{
+				delete [] m_buffers[i];
+				m_buffers[i] = nullptr;
+				if (m_memory)
+					m_memory->release(m_sizes[i]);
+				m_sizes[i] = 0;
+			}
 		};
 
-		class MySQLCursor: public Cursor, MySQLBinding
+		class MySQLResultBinding: public MySQLBinding
 		{
+			friend class MySQLCursor;
 			unsigned long *m_lengths;
 			my_bool	   *m_is_null;
 			my_bool	   *m_error;
-			StatementPtr m_parent;
+			std::vector<enum_field_types> m_types;
+			bool m_oversized;
 			bool allocBind(size_t count);
 			void deleteBind()
 			{
@@ -111,26 +169,62 @@ namespace db
 				delete [] m_is_null;
 				delete [] m_error;
 			}
-			static bool bindResult(const MYSQL_FIELD& field, MYSQL_BIND& bind, char*& buffer);
+			bool bindResult(const MYSQL_FIELD& field, size_t column);
 		public:
-			MySQLCursor(MYSQL *mysql, MYSQL_STMT *stmt, const StatementPtr& parent)
-				: MySQLBinding(mysql, stmt)
+			MySQLResultBinding(MYSQL *mysql, MYSQL_STMT *stmt, const MemoryBudgetPtr& memory)
+				: MySQLBinding(mysql, stmt, memory)
 				, m_lengths(nullptr)
 				, m_is_null(nullptr)
 				, m_error(nullptr)
-				, m_parent(parent)
+				, m_oversized(false)
 			{
 			}
-			~MySQLCursor()
+			~MySQLResultBinding()
 			{
 				deleteBind();
 			}
-			bool prepare();
+			bool prepare(MYSQL_RES* meta);
+			bool matches(MYSQL_RES* meta) const;
+			// room for the whole value of the column, fetched as text or blob
+			long fit(size_t column);
+			// frees the text and blob buffers grown over the budget's keep
+			void shrink();
+		};
+		typedef std::shared_ptr<MySQLResultBinding> MySQLResultBindingPtr;
+
+		class MySQLCursor: public Cursor
+		{
+			MYSQL_STMT* m_stmt;
+			MySQLResultBindingPtr m_result;
+			StatementPtr m_parent;
+			MySQLConnection* m_conn;
+			unsigned long m_generation;
+			bool m_buffered;
+			size_t m_row;
+			bool fetch();
+			bool stale() const;
+			char* fetchColumn(int column, enum_field_types type, const char* getter);
+		public:
+			MySQLCursor(MYSQL_STMT *stmt, const MySQLResultBindingPtr& result, const StatementPtr& parent, MySQLConnection* conn, unsigned long generation, bool buffered)
+				: m_stmt(stmt)
+				, m_result(result)
+				, m_parent(parent)
+				, m_conn(conn)
+				, m_generation(generation)
+				, m_buffered(buffered)
+				, m_row(npos)
+			{
+			}
+			enum_field_types type(int column) const { return m_result->m_types[column]; }
 			bool next() override;
 			size_t columnCount() override;
 			int getInt(int column) override { return getLong(column); }
 			long getLong(int column) override;
 			long long getLongLong(int column) override;
+			double getDouble(int column) override;
+			float getFloat(int column) override;
+			Decimal getDecimal(int column) override;
+			bool readDecimal(int column, Decimal& value) override;
 			tyme::time_t getTimestamp(int column) override;
 			const char* getText(int column) override;
 			size_t getBlobSize(int column) override;
@@ -138,32 +232,61 @@ namespace db
 			bool isNull(int column) override;
 			ConnectionPtr getConnection() const override { return m_parent->getConnection(); }
 			StatementPtr getStatement() const override { return m_parent; }
+			bool copyRow(BatchColumn* columns, size_t count, size_t row) override;
+			size_t rowCount() override { return m_buffered ? (size_t)mysql_stmt_num_rows(m_stmt) : npos; }
+			size_t bookmark() override { return m_buffered ? m_row : npos; }
+			bool seek(size_t row) override;
+			bool rewind() override;
 		};
 
 		class MySQLStatement: public Statement, MySQLBinding, public std::enable_shared_from_this<Statement>
 		{
-			ConnectionPtr m_parent;
-		public:
-			MySQLStatement(MYSQL *mysql, MYSQL_STMT *stmt, const ConnectionPtr& parent)
-				: MySQLBinding(mysql, stmt)
-				, m_parent(parent)
-			{
-			}
-			~MySQLStatement()
+			MySQLConnectionPtr m_parent;
+			MYSQL_RES* m_meta;
+			MySQLResultBindingPtr m_result;
+			std::string m_sql;
+			unsigned long m_generation;
+			ClientError m_failure;
+			long m_timeout;
+			bool m_buffered;
+			size_t m_stored; // charged for the result kept by the client
+			RunningQuery m_running;
+#if DEBUG_CGI
+			struct RefGuard
 			{
-				mysql_stmt_close(m_stmt);
-				m_stmt = nullptr;
-
-			}
+				const void* ptr;
+				size_t size;
+				size_t hash;
+			};
+			std::vector<RefGuard> m_guards;
+#endif
+			void guardRef(int arg, const void* value, size_t size);
+			void unguardRef(int arg);
+			bool checkRefs();
+			bool resultBinding(MySQLResultBindingPtr& result);
+			bool refresh();
+			bool keepStored();
+			void releaseStored();
+			CursorPtr open(bool whole);
+			bool nextResult(CursorPtr& cursor);
+		public:
+			MySQLStatement(MYSQL *mysql, MYSQL_STMT *stmt, const MySQLConnectionPtr& parent, unsigned long generation, const MemoryBudgetPtr& memory);
+			~MySQLStatement();
 			bool prepare(const char* stmt);
+			bool fail(long code, const char* message) { return m_failure.set(code, message); }
 			bool bind(int arg, int value) override { return bind(arg, (long)value); }
 			bool bind(int arg, short value) override;
 			bool bind(int arg, long value) override;
 			bool bind(int arg, long long value) override;
 			bool bind(int arg, const char* value) override;
 			bool bind(int arg, const void* value, size_t size) override;
+			bool bindText(int arg, const char* value, size_t length) override;
+			bool bindTextRef(int arg, const char* value, size_t length) override;
+			bool bindBlobRef(int arg, const void* value, size_t size) override;
 			bool bindTime(int arg, tyme::time_t value) override;
 			bool bindNull(int arg) override;
+			void setBuffered(bool buffered) override { m_buffered = buffered; }
+			void setTimeout(long milliseconds) override { m_timeout = milliseconds; }
 			template <class T>
 			bool bindImpl(int arg, const T& value)
 			{
@@ -173,23 +296,178 @@ namespace db
 				return true;
 			}
 			bool bindImpl(int arg, const void* value, size_t len);
+			bool bindRefImpl(int arg, const void* value, size_t len);
 			bool execute() override;
 			CursorPtr query() override;
+			ResultsPtr results() override;
+			bool cancel() override;
+			const char* errorMessage() override;
+			long errorCode() override;
+			ConnectionPtr getConnection() const override;
+		};
+
+		class MySQLTextCursor: public Cursor
+		{
+			MYSQL_RES* m_result;
+			MYSQL_ROW m_row;
+			size_t m_index;
+			unsigned long* m_lengths;
+			size_t m_count;
+			StatementPtr m_parent;
+			MySQLConnection* m_conn;
+			unsigned long m_generation;
+			bool m_stream;
+			size_t m_stored; // charged for the buffered result
+			const char* value(int column, const char* getter);
+		public:
+			MySQLTextCursor(MYSQL_RES* result, const StatementPtr& parent, MySQLConnection* conn, unsigned long generation, bool stream, size_t stored)
+				: m_result(result)
+				, m_row(nullptr)
+				, m_index(npos)
+				, m_lengths(nullptr)
+				, m_count(result ? mysql_num_fields(result) : 0)
+				, m_parent(parent)
+				, m_conn(conn)
+				, m_generation(generation)
+				, m_stream(stream)
+				, m_stored(stored)
+			{
+			}
+			~MySQLTextCursor();
+			bool next() override;
+			size_t columnCount() override { return m_count; }
+			int getInt(int column) override { return getLong(column); }
+			long getLong(int column) override;
+			long long getLongLong(int column) override;
+			double getDouble(int column) override;
+			float getFloat(int column) override { return (float)getDouble(column); }
+			Decimal getDecimal(int column) override;
+			bool readDecimal(int column, Decimal& value) override;
+			tyme::time_t getTimestamp(int column) override;
+			const char* getText(int column) override { return value(column, "getText"); }
+			size_t getBlobSize(int column) override;
+			const void* getBlob(int column) override { return value(column, "getBlob"); }
+			bool isNull(int column) override;
+			ConnectionPtr getConnection() const override { return m_parent->getConnection(); }
+			StatementPtr getStatement() const override { return m_parent; }
+			size_t rowCount() override { return m_result && !m_stream ? (size_t)mysql_num_rows(m_result) : npos; }
+			size_t bookmark() override { return m_result && !m_stream ? m_index : npos; }
+			bool seek(size_t row) override;
+			bool rewind() override;
+		};
+
+		class MySQLResults: public Results
+		{
+			struct Outcome
+			{
+				CursorPtr cursor;
+				long long affected;
+				long error;
+				std::string message;
+			};
+			std::vector<Outcome> m_outcomes;
+			size_t m_current;
+			const Outcome* current() const { return m_current < m_outcomes.size() ? &m_outcomes[m_current] : nullptr; }
+		public:
+			MySQLResults(): m_current((size_t)-1) {}
+			void add(const CursorPtr& cursor, long long affected);
+			void fail(long error, const char* message);
+			bool next() override;
+			CursorPtr cursor() override { return current() ? current()->cursor : nullptr; }
+			long long affectedRows() override { return current() ? current()->affected : 0; }
+			const char* errorMessage() override { return current() ? current()->message.c_str() : ""; }
+			long errorCode() override { return current() ? current()->error : 0; }
+		};
+		typedef std::shared_ptr<MySQLResults> MySQLResultsPtr;
+
+		// Statement over the text protocol: the arguments are kept as SQL
+		// literals and interpolated into the query on each call
+		class MySQLTextStatement: public Statement, public std::enable_shared_from_this<Statement>
+		{
+			MySQLConnectionPtr m_parent;
+			std::vector<std::string> m_sql;  // the text around the placeholders
+			std::vector<std::string> m_args; // literals, empty until bound
+			bool m_stream;
+			ClientError m_failure;
+			long m_timeout;
+			RunningQuery m_running;
+			bool literal(int arg, const std::string& value);
+			bool quoted(int arg, const char* value, size_t length);
+			bool run(MYSQL_RES** result, MySQLResults* batch);
+			void collect(MYSQL* mysql, MySQLResults& batch);
+		public:
+			MySQLTextStatement(const MySQLConnectionPtr& parent, bool stream);
+			bool prepare(const char* sql);
+			bool fail(long code, const char* message) { return m_failure.set(code, message); }
+			bool bind(int arg, int value) override { return bind(arg, (long)value); }
+			bool bind(int arg, short value) override { return bind(arg, (long)value); }
+			bool bind(int arg, long value) override { return bind(arg, (long long)value); }
+			bool bind(int arg, long long value) override;
+			bool bind(int arg, const char* value) override;
+			bool bind(int arg, const void* value, size_t size) override;
+			bool bindText(int arg, const char* value, size_t length) override;
+			bool bindTextRef(int arg, const char* value, size_t length) override { return bindText(arg, value, length); }
+			bool bindBlobRef(int arg, const void* value, size_t size) override { return bind(arg, value, size); }
+			bool bindTime(int arg, tyme::time_t value) override;
+			bool bindNull(int arg) override { return literal(arg, "NULL"); }
+			void setBuffered(bool buffered) override { m_stream = !buffered; }
+			void setTimeout(long milliseconds) override { m_timeout = milliseconds; }
+			bool execute() override { return run(nullptr, nullptr); }
+			CursorPtr query() override;
+			ResultsPtr results() override;
+			bool cancel() override;
 			const char* errorMessage() override;
 			long errorCode() override;
-			ConnectionPtr getConnection() const override { return m_parent; }
+			ConnectionPtr getConnection() const override;
 		};
 
-		class MySQLConnection : public Connection, public std::enable_shared_from_this<Connection>
+		class MySQLConnection : public Connection, public std::enable_shared_from_this<MySQLConnection>
 		{
 			MYSQL m_mysql;
-			bool m_connected;
+			std::atomic<bool> m_connected;
 			filesystem::path m_path;
 			std::string m_fake_uri;
+
+			// guards m_mysql against the keepalive thread
+			std::mutex m_lock;
+			std::atomic<long long> m_lastActivity;
+			std::atomic<bool> m_broken;
+			long long m_pingAfter;
+
+			// bumped on every reconnect; statements prepared in an older
+			// generation are prepared again before their next use
+			std::atomic<unsigned long> m_generation;
+			std::atomic<bool> m_inTransaction;
+			std::atomic<bool> m_transactionLost;
+			ClientError m_failure;
+			AdmissionControllerPtr m_admission;
+			MemoryBudgetPtr m_memory;
+			long m_serverTimeout;
+			bool m_hasServerTimeout;
+			bool m_multiStatements;
+
+			static long long now();
+			bool reconnectImpl();
+			bool query(const char* sql);
 		public:
 			MySQLConnection(const filesystem::path& path);
 			~MySQLConnection();
 			bool connect(const std::string& user, const std::string& password, const std::string& server, const std::string& database);
+			std::mutex& lock() { return m_lock; }
+			MYSQL* handle() { return &m_mysql; }
+			unsigned long generation() const { return m_generation; }
+			const filesystem::path& path() const { return m_path; }
+			unsigned long threadId() { return mysql_thread_id(&m_mysql); }
+			void serverTimeout(long milliseconds);
+			bool transactionLost() const { return m_transactionLost; }
+			void activity(unsigned int error);
+			void setPingAfter(long seconds) { m_pingAfter = seconds * 1000LL; }
+			void setMultiStatements(bool enabled) { m_multiStatements = enabled; }
+			void setAdmission(const AdmissionControllerPtr& admission) { m_admission = admission; }
+			const AdmissionControllerPtr& admission() const { return m_admission; }
+			void setMemory(const MemoryBudgetPtr& memory) { m_memory = memory; }
+			const MemoryBudgetPtr& budget() const { return m_memory; }
+			void maintain();
 			bool isStillAlive() override;
 			bool reconnect() override;
 			bool beginTransaction() override;
@@ -197,10 +475,12 @@ namespace db
 			bool commitTransaction() override;
 			StatementPtr prepare(const char* sql) override;
 			StatementPtr prepare(const char* sql, long lowLimit, long hiLimit) override;
+			StatementPtr direct(const char* sql, bool stream) override;
 			bool exec(const char* sql) override;
 			const char* errorMessage() override;
 			long errorCode() override;
 			std::string getURI() const override { return m_fake_uri; }
+			MemoryBudgetPtr memory() const override { return m_memory; }
 		};
 
 		class MySQLDriver: public Driver
@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include "record.hpp"
+#include <utils.hpp>
+#include <chrono>
+#include <map>
+#include <stdlib.h>
+#include <string.h>
+
+extern "C" void flog(const char* file, int line, const char* fmt, ...);
+#define RECORD_LOG(...) ::flog(__FILE__, __LINE__, __VA_ARGS__)
+
+namespace db { namespace record {
+	bool startup_driver()
+	{
+		REGISTER_DRIVER("record", db::record::RecordDriver);
+		return true;
+	}
+
+	void shutdown_driver()
+	{
+		TraceFile::closeAll();
+	}
+
+	static filesystem::path resolve(const filesystem::path& ini_path, const std::string& file)
+	{
+		if (!file.empty() && (file[0] == '/' || file[0] == '\\' || (file.length() > 1 && file[1] == ':')))
+			return file;
+		return ini_path.parent_path() / file;
+	}
+
+	static int64_t clock()
+	{
+		using namespace std::chrono;
+		return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	ConnectionPtr RecordDriver::open(const filesystem::path& ini_path, const Props& props)
+	{
+		std::string target, trace;
+		if (!getProp(props, "target", target) || target.empty() || !getProp(props, "trace", trace) || trace.empty())
+		{
+			RECORD_LOG("[Record] invalid configuration: missing `target' or `trace'");
+			return nullptr;
+		}
+
+		TraceFilePtr file = TraceFile::named(resolve(ini_path, trace));
+		if (!file)
+		{
+			RECORD_LOG("[Record] cannot open the trace `%s'", trace.c_str());
+			return nullptr;
+		}
+
+		ConnectionPtr conn = Connection::open(resolve(ini_path, target));
+		if (!conn)
+			return nullptr;
+
+		try {
+			return std::make_shared<RecordingConnection>(conn, file);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	Entry::Entry(trace::Event event, uint32_t session, int64_t time)
+	{
+		m_data.reserve(64);
+		put8(event).put32(session).put64(time);
+	}
+
+	Entry& Entry::putText(const void* data, size_t size)
+	{
+		put32((uint32_t)size);
+		if (size)
+			m_data.append((const char*)data, size);
+		return *this;
+	}
+
+	TraceFile::TraceFile(const filesystem::path& path)
+		: m_out(path.native(), std::ios::binary | std::ios::out | std::ios::trunc)
+		, m_start(clock())
+		, m_sessions(0)
+		, m_statements(0)
+	{
+		uint32_t version = trace::VERSION;
+		uint32_t byteOrder = trace::BYTE_ORDER_MARK;
+		m_out.write(trace::MAGIC, sizeof(trace::MAGIC));
+		m_out.write((const char*)&version, sizeof(version));
+		m_out.write((const char*)&byteOrder, sizeof(byteOrder));
+	}
+
+	namespace
+	{
+		// kept open until the environment goes away; opening the file
+		// again would truncate what was recorded so far
+		std::mutex filesMutex;
+		std::map<std::string, TraceFilePtr> files;
+	}
+
+	TraceFilePtr TraceFile::named(const filesystem::path& path)
+	{
+		std::lock_guard<std::mutex> lock(filesMutex);
+		auto it = files.find(path.string());
+		if (it != files.end())
+			return it->second;
+
+		TraceFilePtr file;
+		try {
+			file = std::make_shared<TraceFile>(path);
+			if (!file->good())
+				return nullptr;
+			files[path.string()] = file;
+		} catch (std::bad_alloc&) { return nullptr; }
+		return file;
+	}
+
+	void TraceFile::closeAll()
+	{
+		std::map<std::string, TraceFilePtr> closing;
+		{
+			std::lock_guard<std::mutex> lock(filesMutex);
+			closing.swap(files);
+		}
+		for (auto&& file : closing)
+			file.second->flush();
+	}
+
+	void TraceFile::flush()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_out.flush();
+	}
+
+	int64_t TraceFile::now() const
+	{
+		return clock() - m_start;
+	}
+
+	void TraceFile::write(const Entry& entry, bool flush)
+	{
+		const std::string& data = entry.data();
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_out.write(data.data(), data.size());
+		if (flush)
+			m_out.flush();
+	}
+
+	RecordingConnection::RecordingConnection(const ConnectionPtr& conn, const TraceFilePtr& trace)
+		: m_conn(conn)
+		, m_trace(trace)
+		, m_session(trace->nextSession())
+	{
+		m_trace->write(Entry(trace::OPEN, m_session, m_trace->now()));
+	}
+
+	RecordingConnection::~RecordingConnection()
+	{
+		m_trace->write(Entry(trace::CLOSE, m_session, m_trace->now()), true);
+	}
+
+	bool RecordingConnection::call(trace::Event event, bool (Connection::*method)())
+	{
+		int64_t start = m_trace->now();
+		bool ret = (m_conn.get()->*method)();
+		m_trace->write(Entry(event, m_session, start).putCall(ret, m_trace->now() - start));
+		return ret;
+	}
+
+	bool RecordingConnection::exec(const char* sql)
+	{
+		if (!sql)
+			return false;
+
+		int64_t start = m_trace->now();
+		bool ret = m_conn->exec(sql);
+		m_trace->write(Entry(trace::EXEC, m_session, start).putText(sql, strlen(sql)).putCall(ret, m_trace->now() - start));
+		return ret;
+	}
+
+	StatementPtr RecordingConnection::wrap(const StatementPtr& stmt, trace::Event event, long long low, long long hi, bool stream, const char* sql, int64_t start)
+	{
+		uint32_t id = m_trace->nextStatement();
+		Entry entry(event, m_session, start);
+		entry.put32(id);
+		if (event == trace::PREPARE)
+			entry.put64(low).put64(hi);
+		else
+			entry.put8(stream ? 1 : 0);
+		entry.putText(sql, strlen(sql)).putCall(!!stmt, m_trace->now() - start);
+		m_trace->write(entry);
+
+		if (!stmt)
+			return nullptr;
+
+		try {
+			return std::make_shared<RecordingStatement>(stmt, shared_from_this(), id);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	StatementPtr RecordingConnection::prepare(const char* sql)
+	{
+		if (!sql)
+			return nullptr;
+		int64_t start = m_trace->now();
+		return wrap(m_conn->prepare(sql), trace::PREPARE, -1, -1, false, sql, start);
+	}
+
+	StatementPtr RecordingConnection::prepare(const char* sql, long lowLimit, long hiLimit)
+	{
+		if (!sql)
+			return nullptr;
+		int64_t start = m_trace->now();
+		return wrap(m_conn->prepare(sql, lowLimit, hiLimit), trace::PREPARE, lowLimit, hiLimit, false, sql, start);
+	}
+
+	StatementPtr RecordingConnection::direct(const char* sql, bool stream)
+	{
+		if (!sql)
+			return nullptr;
+		int64_t start = m_trace->now();
+		return wrap(m_conn->direct(sql, stream), trace::DIRECT, -1, -1, stream, sql, start);
+	}
+
+	Entry RecordingStatement::entry(trace::Event event, int64_t time)
+	{
+		Entry entry(event, m_conn->session(), time);
+		entry.put32(m_id);
+		return entry;
+	}
+
+	bool RecordingStatement::bound(int arg, trace::Value type, bool ok, int64_t value, const void* data, size_t size)
+	{
+		// a failed bind leaves the argument as it was
+		if (!ok)
+			return false;
+
+		const TraceFilePtr& file = m_conn->traceFile();
+		Entry bind = entry(trace::BIND, file->now());
+		bind.put32((uint32_t)arg).put8(type);
+		if (type == trace::TEXT || type == trace::BLOB)
+			bind.putText(data, size);
+		else
+			bind.put64(value);
+		file->write(bind);
+		return true;
+	}
+
+	bool RecordingStatement::bind(int arg, const char* value)
+	{
+		if (!value)
+			return bindNull(arg);
+		return bound(arg, trace::TEXT, m_stmt->bind(arg, value), 0, value, strlen(value));
+	}
+
+	void RecordingStatement::setBuffered(bool buffered)
+	{
+		m_stmt->setBuffered(buffered);
+		const TraceFilePtr& file = m_conn->traceFile();
+		file->write(entry(trace::OPTION, file->now()).put8(trace::BUFFERED).put64(buffered ? 1 : 0));
+	}
+
+	void RecordingStatement::setTimeout(long milliseconds)
+	{
+		m_stmt->setTimeout(milliseconds);
+		const TraceFilePtr& file = m_conn->traceFile();
+		file->write(entry(trace::OPTION, file->now()).put8(trace::TIMEOUT).put64(milliseconds));
+	}
+
+	bool RecordingStatement::call(trace::Event event, bool ok, int64_t start)
+	{
+		const TraceFilePtr& file = m_conn->traceFile();
+		file->write(entry(event, start).putCall(ok, file->now() - start));
+		return ok;
+	}
+
+	void RecordingStatement::fetched(uint32_t result, unsigned long long rows, bool exhausted, int64_t start)
+	{
+		const TraceFilePtr& file = m_conn->traceFile();
+		file->write(entry(trace::FETCHED, file->now()).put32(result).put64(rows).put8(exhausted ? 1 : 0).put64(file->now() - start));
+	}
+
+	bool RecordingStatement::execute()
+	{
+		int64_t start = m_conn->traceFile()->now();
+		return call(trace::EXECUTE, m_stmt->execute(), start);
+	}
+
+	CursorPtr RecordingStatement::query()
+	{
+		int64_t start = m_conn->traceFile()->now();
+		CursorPtr cursor = m_stmt->query();
+		call(trace::QUERY, !!cursor, start);
+		if (!cursor)
+			return nullptr;
+
+		try {
+			return std::make_shared<RecordingCursor>(cursor, shared_from_this(), 0, start);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	ResultsPtr RecordingStatement::results()
+	{
+		int64_t start = m_conn->traceFile()->now();
+		ResultsPtr results = m_stmt->results();
+		call(trace::RESULTS, !!results, start);
+		if (!results)
+			return nullptr;
+
+		try {
+			return std::make_shared<RecordingResults>(results, shared_from_this(), start);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	CursorPtr RecordingResults::cursor()
+	{
+		CursorPtr cursor = m_results->cursor();
+		if (!cursor)
+			return nullptr;
+
+		try {
+			return std::make_shared<RecordingCursor>(cursor, m_parent, m_result, m_start);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+}}
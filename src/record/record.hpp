@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __RECORD_HPP__
+#define __RECORD_HPP__
+
+#include <db/replay.hpp>
+#include <db/driver.hpp>
+#include <filesystem.hpp>
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <stdint.h>
+
+namespace db
+{
+	namespace record
+	{
+		// a single record, written to the trace at once
+		class Entry
+		{
+			std::string m_data;
+		public:
+			Entry(trace::Event event, uint32_t session, int64_t time);
+			Entry& put8(uint8_t value) { m_data.append((const char*)&value, sizeof(value)); return *this; }
+			Entry& put32(uint32_t value) { m_data.append((const char*)&value, sizeof(value)); return *this; }
+			Entry& put64(int64_t value) { m_data.append((const char*)&value, sizeof(value)); return *this; }
+			Entry& putText(const void* data, size_t size);
+			Entry& putCall(bool ok, int64_t duration) { return put8(ok ? 1 : 0).put64(duration); }
+			const std::string& data() const { return m_data; }
+		};
+
+		class TraceFile;
+		typedef std::shared_ptr<TraceFile> TraceFilePtr;
+
+		class TraceFile
+		{
+			std::mutex m_mutex;
+			std::ofstream m_out;
+			int64_t m_start;
+			std::atomic<uint32_t> m_sessions;
+			std::atomic<uint32_t> m_statements;
+		public:
+			explicit TraceFile(const filesystem::path& path);
+			// one object per path, for the whole life of the environment
+			static TraceFilePtr named(const filesystem::path& path);
+			static void closeAll();
+			bool good() { return m_out.good(); }
+			// microseconds since the trace was opened
+			int64_t now() const;
+			uint32_t nextSession() { return ++m_sessions; }
+			uint32_t nextStatement() { return ++m_statements; }
+			void write(const Entry& entry, bool flush = false);
+			void flush();
+		};
+
+		class RecordingConnection: public Connection, public std::enable_shared_from_this<RecordingConnection>
+		{
+			ConnectionPtr m_conn;
+			TraceFilePtr m_trace;
+			uint32_t m_session;
+
+			bool call(trace::Event event, bool (Connection::*method)());
+			StatementPtr wrap(const StatementPtr& stmt, trace::Event event, long long low, long long hi, bool stream, const char* sql, int64_t start);
+		public:
+			RecordingConnection(const ConnectionPtr& conn, const TraceFilePtr& trace);
+			~RecordingConnection();
+			const TraceFilePtr& traceFile() const { return m_trace; }
+			uint32_t session() const { return m_session; }
+
+			bool isStillAlive() override { return m_conn->isStillAlive(); }
+			bool beginTransaction() override { return call(trace::BEGIN, &Connection::beginTransaction); }
+			bool rollbackTransaction() override { return call(trace::ROLLBACK, &Connection::rollbackTransaction); }
+			bool commitTransaction() override { return call(trace::COMMIT, &Connection::commitTransaction); }
+			bool exec(const char* sql) override;
+			StatementPtr prepare(const char* sql) override;
+			StatementPtr prepare(const char* sql, long lowLimit, long hiLimit) override;
+			StatementPtr direct(const char* sql, bool stream) override;
+			bool reconnect() override { return call(trace::RECONNECT, &Connection::reconnect); }
+			std::string getURI() const override { return m_conn->getURI(); }
+			MemoryBudgetPtr memory() const override { return m_conn->memory(); }
+			const char* errorMessage() override { return m_conn->errorMessage(); }
+			long errorCode() override { return m_conn->errorCode(); }
+		};
+		typedef std::shared_ptr<RecordingConnection> RecordingConnectionPtr;
+
+		class RecordingStatement: public Statement, public std::enable_shared_from_this<RecordingStatement>
+		{
+			StatementPtr m_stmt;
+			RecordingConnectionPtr m_conn;
+			uint32_t m_id;
+
+			Entry entry(trace::Event event, int64_t time);
+			bool bound(int arg, trace::Value type, bool ok, int64_t value, const void* data = nullptr, size_t size = 0);
+			bool call(trace::Event event, bool ok, int64_t start);
+		public:
+			RecordingStatement(const StatementPtr& stmt, const RecordingConnectionPtr& conn, uint32_t id)
+				: m_stmt(stmt)
+				, m_conn(conn)
+				, m_id(id)
+			{
+			}
+			void fetched(uint32_t result, unsigned long long rows, bool exhausted, int64_t start);
+
+			bool bind(int arg, int value) override { return bound(arg, trace::INTEGER, m_stmt->bind(arg, value), value); }
+			bool bind(int arg, short value) override { return bound(arg, trace::INTEGER, m_stmt->bind(arg, value), value); }
+			bool bind(int arg, long value) override { return bound(arg, trace::INTEGER, m_stmt->bind(arg, value), value); }
+			bool bind(int arg, long long value) override { return bound(arg, trace::INTEGER, m_stmt->bind(arg, value), value); }
+			bool bind(int arg, const char* value) override;
+			bool bind(int arg, const void* value, size_t size) override { return bound(arg, trace::BLOB, m_stmt->bind(arg, value, size), 0, value, size); }
+			bool bindText(int arg, const char* value, size_t length) override { return bound(arg, trace::TEXT, m_stmt->bindText(arg, value, length), 0, value, length); }
+			bool bindTextRef(int arg, const char* value, size_t length) override { return bound(arg, trace::TEXT, m_stmt->bindTextRef(arg, value, length), 0, value, length); }
+			bool bindBlobRef(int arg, const void* value, size_t size) override { return bound(arg, trace::BLOB, m_stmt->bindBlobRef(arg, value, size), 0, value, size); }
+			bool bindTime(int arg, tyme::time_t value) override { return bound(arg, trace::TIME, m_stmt->bindTime(arg, value), value); }
+			bool bindNull(int arg) override { return bound(arg, trace::NUL, m_stmt->bindNull(arg), 0); }
+			void setBuffered(bool buffered) override;
+			void setTimeout(long milliseconds) override;
+			bool execute() override;
+			CursorPtr query() override;
+			ResultsPtr results() override;
+			bool cancel() override { return m_stmt->cancel(); }
+			ConnectionPtr getConnection() const override { return m_conn; }
+			const char* errorMessage() override { return m_stmt->errorMessage(); }
+			long errorCode() override { return m_stmt->errorCode(); }
+		};
+		typedef std::shared_ptr<RecordingStatement> RecordingStatementPtr;
+
+		// counts the rows read; the count goes to the trace with the cursor
+		class RecordingCursor: public Cursor
+		{
+			CursorPtr m_cursor;
+			RecordingStatementPtr m_parent;
+			uint32_t m_result;
+			int64_t m_start;
+			unsigned long long m_rows;
+			bool m_exhausted;
+		public:
+			RecordingCursor(const CursorPtr& cursor, const RecordingStatementPtr& parent, uint32_t result, int64_t start)
+				: m_cursor(cursor)
+				, m_parent(parent)
+				, m_result(result)
+				, m_start(start)
+				, m_rows(0)
+				, m_exhausted(false)
+			{
+			}
+			~RecordingCursor() { m_parent->fetched(m_result, m_rows, m_exhausted, m_start); }
+			bool next() override
+			{
+				if (!m_cursor->next())
+				{
+					m_exhausted = true;
+					return false;
+				}
+				++m_rows;
+				return true;
+			}
+			size_t columnCount() override { return m_cursor->columnCount(); }
+			int getInt(int column) override { return m_cursor->getInt(column); }
+			long getLong(int column) override { return m_cursor->getLong(column); }
+			long long getLongLong(int column) override { return m_cursor->getLongLong(column); }
+			double getDouble(int column) override { return m_cursor->getDouble(column); }
+			float getFloat(int column) override { return m_cursor->getFloat(column); }
+			Decimal getDecimal(int column) override { return m_cursor->getDecimal(column); }
+			bool readDecimal(int column, Decimal& value) override { return m_cursor->readDecimal(column, value); }
+			tyme::time_t getTimestamp(int column) override { return m_cursor->getTimestamp(column); }
+			const char* getText(int column) override { return m_cursor->getText(column); }
+			size_t getBlobSize(int column) override { return m_cursor->getBlobSize(column); }
+			const void* getBlob(int column) override { return m_cursor->getBlob(column); }
+			bool isNull(int column) override { return m_cursor->isNull(column); }
+			ConnectionPtr getConnection() const override { return m_parent->getConnection(); }
+			StatementPtr getStatement() const override { return m_parent; }
+			size_t rowCount() override { return m_cursor->rowCount(); }
+			size_t bookmark() override { return m_cursor->bookmark(); }
+			bool seek(size_t row) override { return m_cursor->seek(row); }
+			bool rewind() override { return m_cursor->rewind(); }
+		};
+
+		// numbers the statements, so the rows of each cursor are recorded
+		// for the right one
+		class RecordingResults: public Results
+		{
+			ResultsPtr m_results;
+			RecordingStatementPtr m_parent;
+			int64_t m_start;
+			uint32_t m_result;
+		public:
+			RecordingResults(const ResultsPtr& results, const RecordingStatementPtr& parent, int64_t start)
+				: m_results(results)
+				, m_parent(parent)
+				, m_start(start)
+				, m_result(0)
+			{
+			}
+			bool next() override
+			{
+				if (!m_results->next())
+					return false;
+				++m_result;
+				return true;
+			}
+			CursorPtr cursor() override;
+			long long affectedRows() override { return m_results->affectedRows(); }
+			const char* errorMessage() override { return m_results->errorMessage(); }
+			long errorCode() override { return m_results->errorCode(); }
+		};
+
+		class RecordDriver: public Driver
+		{
+			ConnectionPtr open(const filesystem::path& ini_path, const Props& props);
+		};
+	}
+}
+
+#endif //__RECORD_HPP__
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include "sharded.hpp"
+#include <db/tracing.hpp>
+#include <utils.hpp>
+#include <limits.h>
+#include <stdlib.h>
+
+extern "C" void flog(const char* file, int line, const char* fmt, ...);
+#define SHARDED_LOG(...) ::flog(__FILE__, __LINE__, __VA_ARGS__)
+
+namespace db { namespace sharded {
+	bool startup_driver()
+	{
+		REGISTER_DRIVER("sharded", db::sharded::ShardedDriver);
+		return true;
+	}
+
+	void shutdown_driver()
+	{
+	}
+
+	static filesystem::path resolve(const filesystem::path& ini_path, const std::string& file)
+	{
+		if (!file.empty() && (file[0] == '/' || file[0] == '\\' || (file.length() > 1 && file[1] == ':')))
+			return file;
+		return ini_path.parent_path() / file;
+	}
+
+	static bool readNumber(const Driver::Props& props, const std::string& name, long long& value)
+	{
+		std::string prop;
+		if (!Driver::getProp(props, name, prop) || prop.empty())
+			return false;
+
+		char* end;
+		value = strtoll(prop.c_str(), &end, 10);
+		return !*end;
+	}
+
+	ConnectionPtr ShardedDriver::open(const filesystem::path& ini_path, const Props& props)
+	{
+		long long shards = 0;
+		if (!readNumber(props, "shards", shards) || shards < 1)
+		{
+			SHARDED_LOG("[Sharded] invalid configuration: missing `shards'");
+			return nullptr;
+		}
+
+		Sharded::Function function = Sharded::HASH;
+		std::string value;
+		if (getProp(props, "function", value))
+		{
+			if (value == "range")
+				function = Sharded::RANGE;
+			else if (value != "hash")
+			{
+				SHARDED_LOG("[Sharded] invalid configuration: unknown function `%s'", value.c_str());
+				return nullptr;
+			}
+		}
+
+		long long pool = 4;
+		if (getProp(props, "pool", value) && (!readNumber(props, "pool", pool) || pool < 0))
+		{
+			SHARDED_LOG("[Sharded] invalid configuration: bad `pool'");
+			return nullptr;
+		}
+
+		try {
+			auto conn = std::make_shared<Sharded>(ini_path, function);
+
+			long long previous = LLONG_MIN;
+			for (long long i = 0; i < shards; ++i)
+			{
+				std::string key = "shard." + std::to_string(i);
+				std::string file;
+				if (!getProp(props, key, file) || file.empty())
+				{
+					SHARDED_LOG("[Sharded] invalid configuration: missing `%s'", key.c_str());
+					return nullptr;
+				}
+
+				long long lowest = LLONG_MIN;
+				if (function == Sharded::RANGE && i > 0)
+				{
+					key = "range." + std::to_string(i);
+					if (!readNumber(props, key, lowest) || lowest <= previous)
+					{
+						SHARDED_LOG("[Sharded] invalid configuration: missing or unordered `%s'", key.c_str());
+						return nullptr;
+					}
+					previous = lowest;
+				}
+
+				auto shard = std::make_shared<ShardPool>(resolve(ini_path, file), (size_t)pool);
+
+				// fail early and leave one warm connection in each pool
+				if (!shard->acquire())
+				{
+					SHARDED_LOG("[Sharded] cannot open shard %d (%s)", (int)i, shard->getURI().c_str());
+					return nullptr;
+				}
+
+				conn->addShard(shard, lowest);
+			}
+
+			return conn;
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	ConnectionPtr ShardPool::acquire()
+	{
+		Span span("pool.wait");
+		sweep();
+
+		ConnectionPtr conn;
+		while (!conn)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (m_idle.empty())
+					break;
+				conn = m_idle.front();
+				m_idle.pop_front();
+			}
+
+			if (!conn->isStillAlive())
+				conn.reset();
+		}
+
+		if (!conn)
+			conn = Connection::open(m_ini);
+
+		if (!conn)
+			return nullptr;
+
+		try {
+			return std::make_shared<Lease>(conn, shared_from_this());
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	void ShardPool::release(const ConnectionPtr& conn, bool transaction)
+	{
+		// the statements and cursors hold the real connection, it
+		// cannot be handed out again before the last one is gone
+		if (conn.use_count() > 1)
+		{
+			Released busy = { conn, transaction };
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_busy.push_back(busy);
+			return;
+		}
+
+		recycle(conn, transaction);
+	}
+
+	void ShardPool::recycle(const ConnectionPtr& conn, bool transaction)
+	{
+		// do not leave an open transaction to the next user; failing
+		// here only means there was nothing to roll back
+		if (transaction)
+			conn->rollbackTransaction();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_idle.size() < m_maxIdle)
+			m_idle.push_back(conn);
+	}
+
+	void ShardPool::sweep()
+	{
+		std::list<Released> done;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			auto it = m_busy.begin();
+			while (it != m_busy.end())
+			{
+				auto cur = it++;
+				if (cur->conn.use_count() == 1)
+					done.splice(done.end(), m_busy, cur);
+			}
+		}
+
+		for (auto&& busy : done)
+			recycle(busy.conn, busy.transaction);
+	}
+
+	void ShardPool::clear()
+	{
+		std::list<ConnectionPtr> idle;
+		std::list<Released> busy;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			idle.swap(m_idle);
+			busy.swap(m_busy);
+		}
+	}
+
+	static unsigned long long mix(unsigned long long key)
+	{
+		key ^= key >> 33;
+		key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33;
+		key *= 0xc4ceb9fe1a85ec53ULL;
+		key ^= key >> 33;
+		return key;
+	}
+
+	size_t Sharded::shardOf(long long key)
+	{
+		succeed();
+		if (m_function == HASH)
+			return (size_t)(mix((unsigned long long)key) % m_shards.size());
+
+		auto it = std::upper_bound(m_lowest.begin() + 1, m_lowest.end(), key);
+		return (it - m_lowest.begin()) - 1;
+	}
+
+	size_t Sharded::shardOf(const std::string& key)
+	{
+		succeed();
+		if (m_function != HASH)
+		{
+			fail(error::SHARD_KEY_REQUIRED, "Range sharding needs an integer key");
+			return npos;
+		}
+
+		// FNV-1a, stable between the processes and platforms
+		unsigned long long hash = 14695981039346656037ULL;
+		for (auto&& c : key)
+		{
+			hash ^= (unsigned char)c;
+			hash *= 1099511628211ULL;
+		}
+		return (size_t)(mix(hash) % m_shards.size());
+	}
+
+	ConnectionPtr Sharded::shard(size_t index)
+	{
+		succeed();
+		if (index >= m_shards.size())
+		{
+			fail(error::SHARD_UNAVAILABLE, "Shard index out of range");
+			return nullptr;
+		}
+
+		ConnectionPtr conn = m_shards[index]->acquire();
+		if (!conn)
+			fail(error::SHARD_UNAVAILABLE, "Cannot connect to the shard");
+		return conn;
+	}
+
+	bool Sharded::isStillAlive()
+	{
+		succeed();
+		for (auto&& shard : m_shards)
+		{
+			ConnectionPtr conn = shard->acquire();
+			if (!conn || !conn->isStillAlive())
+				return false;
+		}
+		return true;
+	}
+
+	bool Sharded::reconnect()
+	{
+		for (auto&& shard : m_shards)
+			shard->clear();
+		return isStillAlive();
+	}
+}}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __SHARDED_HPP__
+#define __SHARDED_HPP__
+
+#include <db/sharded.hpp>
+#include <db/driver.hpp>
+#include <filesystem.hpp>
+#include <mutex>
+
+namespace db
+{
+	namespace sharded
+	{
+		class ShardPool: public std::enable_shared_from_this<ShardPool>
+		{
+			friend class Lease;
+			struct Released
+			{
+				ConnectionPtr conn;
+				bool transaction;
+			};
+
+			filesystem::path m_ini;
+			size_t m_maxIdle;
+			std::mutex m_mutex;
+			std::list<ConnectionPtr> m_idle;
+			std::list<Released> m_busy; // released, but statements or cursors still use them
+			void release(const ConnectionPtr& conn, bool transaction);
+			void recycle(const ConnectionPtr& conn, bool transaction);
+			void sweep();
+		public:
+			ShardPool(const filesystem::path& ini, size_t maxIdle)
+				: m_ini(ini)
+				, m_maxIdle(maxIdle)
+			{
+			}
+			ConnectionPtr acquire();
+			void clear();
+			std::string getURI() const { return m_ini.string(); }
+		};
+		typedef std::shared_ptr<ShardPool> ShardPoolPtr;
+
+		// a pooled connection handed out by acquire(); goes back to the
+		// pool when the last user lets go of it
+		class Lease: public Connection
+		{
+			ConnectionPtr m_conn;
+			ShardPoolPtr m_pool;
+			bool m_transaction; // a transaction may be open on m_conn
+		public:
+			Lease(const ConnectionPtr& conn, const ShardPoolPtr& pool)
+				: m_conn(conn)
+				, m_pool(pool)
+				, m_transaction(false)
+			{
+			}
+			~Lease() { m_pool->release(m_conn, m_transaction); }
+
+			bool isStillAlive() override { return m_conn->isStillAlive(); }
+			bool beginTransaction() override { m_transaction = true; return m_conn->beginTransaction(); }
+			bool rollbackTransaction() override { return ended(m_conn->rollbackTransaction()); }
+			bool commitTransaction() override { return ended(m_conn->commitTransaction()); }
+			bool exec(const char* sql) override { return m_conn->exec(sql); }
+			StatementPtr prepare(const char* sql) override { return m_conn->prepare(sql); }
+			StatementPtr prepare(const char* sql, long lowLimit, long hiLimit) override { return m_conn->prepare(sql, lowLimit, hiLimit); }
+			StatementPtr direct(const char* sql, bool stream) override { return m_conn->direct(sql, stream); }
+			bool reconnect() override { return m_conn->reconnect(); }
+			std::string getURI() const override { return m_conn->getURI(); }
+			MemoryBudgetPtr memory() const override { return m_conn->memory(); }
+			const char* errorMessage() override { return m_conn->errorMessage(); }
+			long errorCode() override { return m_conn->errorCode(); }
+		private:
+			bool ended(bool ok)
+			{
+				if (ok)
+					m_transaction = false;
+				return ok;
+			}
+		};
+
+		class Sharded: public ShardedConnection
+		{
+		public:
+			enum Function
+			{
+				HASH,
+				RANGE
+			};
+		private:
+			filesystem::path m_path;
+			Function m_function;
+			std::vector<ShardPoolPtr> m_shards;
+			std::vector<long long> m_lowest;
+			std::mutex m_lock;
+			long m_error;
+			const char* m_message;
+			bool fail(long code, const char* message) { std::lock_guard<std::mutex> guard(m_lock); m_error = code; m_message = message; return false; }
+			void succeed() { std::lock_guard<std::mutex> guard(m_lock); m_error = 0; m_message = nullptr; }
+			bool unsharded() { return fail(error::SHARD_KEY_REQUIRED, "Sharded connection needs a shard key"); }
+		public:
+			Sharded(const filesystem::path& path, Function function)
+				: m_path(path)
+				, m_function(function)
+				, m_error(0)
+				, m_message(nullptr)
+			{
+			}
+			void addShard(const ShardPoolPtr& pool, long long lowest) { m_shards.push_back(pool); m_lowest.push_back(lowest); }
+
+			size_t shardCount() const override { return m_shards.size(); }
+			size_t shardOf(long long key) override;
+			size_t shardOf(const std::string& key) override;
+			ConnectionPtr shard(size_t index) override;
+
+			bool isStillAlive() override;
+			bool beginTransaction() override { return unsharded(); }
+			bool rollbackTransaction() override { return unsharded(); }
+			bool commitTransaction() override { return unsharded(); }
+			bool exec(const char*) override { return unsharded(); }
+			StatementPtr prepare(const char*) override { unsharded(); return nullptr; }
+			StatementPtr prepare(const char*, long, long) override { unsharded(); return nullptr; }
+			StatementPtr direct(const char*, bool) override { unsharded(); return nullptr; }
+			bool reconnect() override;
+			std::string getURI() const override { return "sharded:" + m_path.string(); }
+			const char* errorMessage() override { std::lock_guard<std::mutex> guard(m_lock); return m_message ? m_message : ""; }
+			long errorCode() override { std::lock_guard<std::mutex> guard(m_lock); return m_error; }
+		};
+
+		class ShardedDriver: public Driver
+		{
+			ConnectionPtr open(const filesystem::path& ini_path, const Props& props);
+		};
+	}
+}
+
+#endif //__SHARDED_HPP__
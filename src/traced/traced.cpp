@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pch.h"
+#include "traced.hpp"
+
+extern "C" void flog(const char* file, int line, const char* fmt, ...);
+#define TRACED_LOG(...) ::flog(__FILE__, __LINE__, __VA_ARGS__)
+
+namespace db { namespace traced {
+	bool startup_driver()
+	{
+		REGISTER_DRIVER("traced", db::traced::TracedDriver);
+		return true;
+	}
+
+	void shutdown_driver()
+	{
+	}
+
+	static filesystem::path resolve(const filesystem::path& ini_path, const std::string& file)
+	{
+		if (!file.empty() && (file[0] == '/' || file[0] == '\\' || (file.length() > 1 && file[1] == ':')))
+			return file;
+		return ini_path.parent_path() / file;
+	}
+
+	ConnectionPtr TracedDriver::open(const filesystem::path& ini_path, const Props& props)
+	{
+		std::string target;
+		if (!getProp(props, "target", target) || target.empty())
+		{
+			TRACED_LOG("[Traced] invalid configuration: missing `target'");
+			return nullptr;
+		}
+
+		ConnectionPtr conn;
+		{
+			Span span("connect");
+			conn = Connection::open(resolve(ini_path, target));
+		}
+		if (!conn)
+			return nullptr;
+
+		try {
+			return std::make_shared<TracedConnection>(conn);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	bool TracedConnection::isStillAlive()
+	{
+		Span span("ping");
+		return m_conn->isStillAlive();
+	}
+
+	bool TracedConnection::exec(const char* sql)
+	{
+		Span span("exec", sql);
+		return m_conn->exec(sql);
+	}
+
+	StatementPtr TracedConnection::prepare(const char* sql)
+	{
+		StatementPtr stmt;
+		{
+			Span span("prepare", sql);
+			stmt = m_conn->prepare(sql);
+		}
+		if (!stmt)
+			return nullptr;
+		try {
+			return std::make_shared<TracedStatement>(stmt, shared_from_this(), sql);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	StatementPtr TracedConnection::prepare(const char* sql, long lowLimit, long hiLimit)
+	{
+		StatementPtr stmt;
+		{
+			Span span("prepare", sql);
+			stmt = m_conn->prepare(sql, lowLimit, hiLimit);
+		}
+		if (!stmt)
+			return nullptr;
+		try {
+			return std::make_shared<TracedStatement>(stmt, shared_from_this(), sql);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	StatementPtr TracedConnection::direct(const char* sql, bool stream)
+	{
+		StatementPtr stmt;
+		{
+			Span span("prepare", sql);
+			stmt = m_conn->direct(sql, stream);
+		}
+		if (!stmt)
+			return nullptr;
+		try {
+			return std::make_shared<TracedStatement>(stmt, shared_from_this(), sql);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	bool TracedConnection::reconnect()
+	{
+		Span span("reconnect");
+		return m_conn->reconnect();
+	}
+
+	void TracedStatement::flushBinds()
+	{
+		if (!m_binds)
+			return;
+		Span::record("bind", m_bindStart, m_bindTime, m_binds);
+		m_binds = 0;
+		m_bindTime = 0;
+	}
+
+	bool TracedStatement::execute()
+	{
+		flushBinds();
+		Span span("execute", sql());
+		return m_stmt->execute();
+	}
+
+	CursorPtr TracedStatement::query()
+	{
+		flushBinds();
+		long long start = started();
+		CursorPtr cursor;
+		{
+			Span span("query", sql());
+			cursor = m_stmt->query();
+		}
+		if (!cursor)
+			return nullptr;
+
+		try {
+			return std::make_shared<TracedCursor>(cursor, shared_from_this(), start);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	ResultsPtr TracedStatement::results()
+	{
+		flushBinds();
+		long long start = started();
+		ResultsPtr results;
+		{
+			Span span("results", sql());
+			results = m_stmt->results();
+		}
+		if (!results)
+			return nullptr;
+
+		try {
+			return std::make_shared<TracedResults>(results, shared_from_this(), start);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+
+	bool TracedCursor::next()
+	{
+		if (m_done)
+			return false;
+
+		if (!m_cursor->next())
+		{
+			finish();
+			return false;
+		}
+
+		if (m_first)
+		{
+			m_first = false;
+			if (m_queried && m_context.sampled && Tracer::enabled())
+			{
+				Tracer::Scope scope(m_context);
+				Span::record("first_row", m_queried, Span::now() - m_queried, -1, m_parent->sql());
+			}
+		}
+		++m_rows;
+		return true;
+	}
+
+	void TracedCursor::finish()
+	{
+		if (m_done)
+			return;
+		m_done = true;
+
+		if (m_context.sampled && Tracer::enabled())
+		{
+			Tracer::Scope scope(m_context);
+			Span::record("fetch", m_fetched, Span::now() - m_fetched, m_rows, m_parent->sql());
+		}
+	}
+
+	CursorPtr TracedResults::cursor()
+	{
+		CursorPtr cursor = m_results->cursor();
+		if (!cursor)
+			return nullptr;
+
+		try {
+			return std::make_shared<TracedCursor>(cursor, m_parent, m_queried);
+		} catch(std::bad_alloc) { return nullptr; }
+	}
+}}
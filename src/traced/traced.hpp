@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2013 midnightBITS
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __TRACED_HPP__
+#define __TRACED_HPP__
+
+#include <db/conn.hpp>
+#include <db/driver.hpp>
+#include <filesystem.hpp>
+
+namespace db
+{
+	namespace traced
+	{
+		// Wraps the connection named by `target', recording a span for
+		// each call made in a sampled trace context (see Tracer):
+		//
+		//   driver=traced
+		//   target=orders.ini    (relative to this file)
+		class TracedConnection: public Connection, public std::enable_shared_from_this<TracedConnection>
+		{
+			ConnectionPtr m_conn;
+		public:
+			explicit TracedConnection(const ConnectionPtr& conn): m_conn(conn) {}
+
+			bool isStillAlive() override;
+			bool beginTransaction() override { return m_conn->beginTransaction(); }
+			bool rollbackTransaction() override { return m_conn->rollbackTransaction(); }
+			bool commitTransaction() override { return m_conn->commitTransaction(); }
+			bool exec(const char* sql) override;
+			StatementPtr prepare(const char* sql) override;
+			StatementPtr prepare(const char* sql, long lowLimit, long hiLimit) override;
+			StatementPtr direct(const char* sql, bool stream) override;
+			bool reconnect() override;
+			std::string getURI() const override { return m_conn->getURI(); }
+			MemoryBudgetPtr memory() const override { return m_conn->memory(); }
+			const char* errorMessage() override { return m_conn->errorMessage(); }
+			long errorCode() override { return m_conn->errorCode(); }
+		};
+		typedef std::shared_ptr<TracedConnection> TracedConnectionPtr;
+
+		class TracedStatement: public Statement, public std::enable_shared_from_this<TracedStatement>
+		{
+			StatementPtr m_stmt;
+			TracedConnectionPtr m_conn;
+			std::string m_sql;
+			long long m_bindStart;
+			long long m_bindTime;
+			long long m_binds;
+
+			// the binds since the last call, as a single span
+			bool bound(long long start, bool ok)
+			{
+				if (!Tracer::enabled())
+					return ok;
+				if (!m_binds++)
+					m_bindStart = start;
+				m_bindTime += Span::now() - start;
+				return ok;
+			}
+			static long long started() { return Tracer::enabled() ? Span::now() : 0; }
+			void flushBinds();
+		public:
+			const char* sql() const { return m_sql.c_str(); }
+			TracedStatement(const StatementPtr& stmt, const TracedConnectionPtr& conn, const char* sql)
+				: m_stmt(stmt)
+				, m_conn(conn)
+				, m_sql(sql)
+				, m_bindStart(0)
+				, m_bindTime(0)
+				, m_binds(0)
+			{
+			}
+
+			bool bind(int arg, int value) override { long long start = started(); return bound(start, m_stmt->bind(arg, value)); }
+			bool bind(int arg, short value) override { long long start = started(); return bound(start, m_stmt->bind(arg, value)); }
+			bool bind(int arg, long value) override { long long start = started(); return bound(start, m_stmt->bind(arg, value)); }
+			bool bind(int arg, long long value) override { long long start = started(); return bound(start, m_stmt->bind(arg, value)); }
+			bool bind(int arg, const char* value) override { long long start = started(); return bound(start, m_stmt->bind(arg, value)); }
+			bool bind(int arg, const void* value, size_t size) override { long long start = started(); return bound(start, m_stmt->bind(arg, value, size)); }
+			bool bindText(int arg, const char* value, size_t length) override { long long start = started(); return bound(start, m_stmt->bindText(arg, value, length)); }
+			bool bindTextRef(int arg, const char* value, size_t length) override { long long start = started(); return bound(start, m_stmt->bindTextRef(arg, value, length)); }
+			bool bindBlobRef(int arg, const void* value, size_t size) override { long long start = started(); return bound(start, m_stmt->bindBlobRef(arg, value, size)); }
+			bool bindTime(int arg, tyme::time_t value) override { long long start = started(); return bound(start, m_stmt->bindTime(arg, value)); }
+			bool bindNull(int arg) override { long long start = started(); return bound(start, m_stmt->bindNull(arg)); }
+			void setBuffered(bool buffered) override { m_stmt->setBuffered(buffered); }
+			void setTimeout(long milliseconds) override { m_stmt->setTimeout(milliseconds); }
+			bool execute() override;
+			CursorPtr query() override;
+			ResultsPtr results() override;
+			bool cancel() override { return m_stmt->cancel(); }
+			ConnectionPtr getConnection() const override { return m_conn; }
+			const char* errorMessage() override { return m_stmt->errorMessage(); }
+			long errorCode() override { return m_stmt->errorCode(); }
+		};
+		typedef std::shared_ptr<TracedStatement> TracedStatementPtr;
+
+		// records the wait for the first row and the whole fetch; the
+		// trace context is the one of the query
+		class TracedCursor: public Cursor
+		{
+			CursorPtr m_cursor;
+			TracedStatementPtr m_parent;
+			TraceContext m_context;
+			long long m_queried; // when the query started
+			long long m_fetched; // when it returned
+			long long m_rows;
+			bool m_first;
+			bool m_done;
+			void finish();
+		public:
+			TracedCursor(const CursorPtr& cursor, const TracedStatementPtr& parent, long long queried)
+				: m_cursor(cursor)
+				, m_parent(parent)
+				, m_context(Tracer::current())
+				, m_queried(queried)
+				, m_fetched(Span::now())
+				, m_rows(0)
+				, m_first(true)
+				, m_done(false)
+			{
+			}
+			~TracedCursor() { finish(); }
+			bool next() override;
+			size_t columnCount() override { return m_cursor->columnCount(); }
+			int getInt(int column) override { return m_cursor->getInt(column); }
+			long getLong(int column) override { return m_cursor->getLong(column); }
+			long long getLongLong(int column) override { return m_cursor->getLongLong(column); }
+			double getDouble(int column) override { return m_cursor->getDouble(column); }
+			float getFloat(int column) override { return m_cursor->getFloat(column); }
+			Decimal getDecimal(int column) override { return m_cursor->getDecimal(column); }
+			bool readDecimal(int column, Decimal& value) override { return m_cursor->readDecimal(column, value); }
+			tyme::time_t getTimestamp(int column) override { return m_cursor->getTimestamp(column); }
+			const char* getText(int column) override { return m_cursor->getText(column); }
+			size_t getBlobSize(int column) override { return m_cursor->getBlobSize(column); }
+			const void* getBlob(int column) override { return m_cursor->getBlob(column); }
+			bool isNull(int column) override { return m_cursor->isNull(column); }
+			ConnectionPtr getConnection() const override { return m_parent->getConnection(); }
+			StatementPtr getStatement() const override { return m_parent; }
+			size_t rowCount() override { return m_cursor->rowCount(); }
+			size_t bookmark() override { return m_cursor->bookmark(); }
+			bool seek(size_t row) override { return m_cursor->seek(row); }
+			bool rewind() override { return m_cursor->rewind(); }
+		};
+
+		// the first result counts its first row from the call, the later
+		// ones only their fetch
+		class TracedResults: public Results
+		{
+			ResultsPtr m_results;
+			TracedStatementPtr m_parent;
+			long long m_queried;
+		public:
+			TracedResults(const ResultsPtr& results, const TracedStatementPtr& parent, long long queried)
+				: m_results(results)
+				, m_parent(parent)
+				, m_queried(queried)
+			{
+			}
+			bool next() override
+			{
+				m_queried = 0;
+				return m_results->next();
+			}
+			CursorPtr cursor() override;
+			long long affectedRows() override { return m_results->affectedRows(); }
+			const char* errorMessage() override { return m_results->errorMessage(); }
+			long errorCode() override { return m_results->errorCode(); }
+		};
+
+		class TracedDriver: public Driver
+		{
+			ConnectionPtr open(const filesystem::path& ini_path, const Props& props);
+		};
+	}
+}
+
+#endif //__TRACED_HPP__